@@ -0,0 +1,124 @@
+#define _POSIX_C_SOURCE 199309L /* clock_gettime */
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "heatshrink_encoder.h"
+#include "heatshrink_decoder.h"
+
+/* Time compressing and expanding a file in memory, e.g.
+ *     make benchmark */
+
+#define DEF_WINDOW_SZ2 11
+#define DEF_LOOKAHEAD_SZ2 4
+#define DEF_DECODER_INPUT_BUFFER_SIZE 256
+#define CHUNK_SIZE 4096
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(char *msg) {
+    fprintf(stderr, "%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static size_t compress(uint8_t *in, size_t in_size, uint8_t *out, size_t out_size) {
+    heatshrink_encoder *hse = heatshrink_encoder_alloc(DEF_WINDOW_SZ2,
+        DEF_LOOKAHEAD_SZ2);
+    if (hse == NULL) die("encoder alloc");
+    size_t sunk = 0, polled = 0;
+    uint16_t count = 0;
+    for (;;) {
+        if (sunk < in_size) {
+            size_t rem = in_size - sunk;
+            if (heatshrink_encoder_sink(hse, &in[sunk],
+                    rem > CHUNK_SIZE ? CHUNK_SIZE : rem, &count) < 0) {
+                die("sink");
+            }
+            sunk += count;
+        } else if (heatshrink_encoder_finish(hse) == HSER_FINISH_DONE) {
+            break;
+        }
+        HEATSHRINK_ENCODER_POLL_RES pres;
+        do {
+            if (out_size - polled < CHUNK_SIZE) die("output too small");
+            pres = heatshrink_encoder_poll(hse, &out[polled], CHUNK_SIZE, &count);
+            if (pres < 0) die("poll");
+            polled += count;
+        } while (pres == HSER_POLL_MORE);
+    }
+    heatshrink_encoder_free(hse);
+    return polled;
+}
+
+static size_t expand(uint8_t *in, size_t in_size, uint8_t *out, size_t out_size) {
+    heatshrink_decoder *hsd = heatshrink_decoder_alloc(
+        DEF_DECODER_INPUT_BUFFER_SIZE, DEF_WINDOW_SZ2, DEF_LOOKAHEAD_SZ2);
+    if (hsd == NULL) die("decoder alloc");
+    size_t sunk = 0, polled = 0;
+    uint16_t count = 0;
+    while (sunk < in_size) {
+        if (heatshrink_decoder_sink(hsd, &in[sunk], in_size - sunk, &count) < 0) {
+            die("sink");
+        }
+        sunk += count;
+        HEATSHRINK_DECODER_POLL_RES pres;
+        do {
+            size_t rem = out_size - polled;
+            pres = heatshrink_decoder_poll(hsd, &out[polled],
+                rem > CHUNK_SIZE ? CHUNK_SIZE : rem, &count);
+            if (pres < 0) die("poll");
+            polled += count;
+        } while (pres == HSDR_POLL_MORE && polled < out_size);
+    }
+    if (heatshrink_decoder_finish(hsd) != HSDR_FINISH_DONE) die("finish");
+    heatshrink_decoder_free(hsd);
+    return polled;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) die("usage: bench FILE [RUNS]");
+    int runs = argc > 2 ? atoi(argv[2]) : 5;
+
+    FILE *f = fopen(argv[1], "rb");
+    if (f == NULL) die("open");
+    fseek(f, 0, SEEK_END);
+    size_t size = ftell(f);
+    rewind(f);
+    uint8_t *input = malloc(size);
+    size_t comp_cap = size + size/8 + 2*CHUNK_SIZE;
+    uint8_t *comp = malloc(comp_cap);
+    uint8_t *output = malloc(size);
+    if (input == NULL || comp == NULL || output == NULL) die("malloc");
+    if (fread(input, 1, size, f) != size) die("read");
+    fclose(f);
+
+    /* Report the best of RUNS, to filter out scheduling noise. */
+    double best_enc = 0, best_dec = 0;
+    size_t comp_sz = 0;
+    for (int i = 0; i < runs; i++) {
+        double t0 = now();
+        comp_sz = compress(input, size, comp, comp_cap);
+        double t1 = now();
+        size_t out_sz = expand(comp, comp_sz, output, size);
+        double t2 = now();
+        if (out_sz != size || memcmp(input, output, size) != 0) die("mismatch");
+        if (i == 0 || t1 - t0 < best_enc) best_enc = t1 - t0;
+        if (i == 0 || t2 - t1 < best_dec) best_dec = t2 - t1;
+    }
+
+    double mb = size / (1024.0 * 1024.0);
+    printf("%s (-w %u -l %u): %zu -> %zu, "
+        "encode %.1f MB/s, decode %.1f MB/s\n",
+        argv[1], DEF_WINDOW_SZ2, DEF_LOOKAHEAD_SZ2,
+        size, comp_sz, mb / best_enc, mb / best_dec);
+    free(input);
+    free(comp);
+    free(output);
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -6,14 +7,22 @@
 #include <string.h>
 #include <err.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 
 #include "heatshrink_encoder.h"
 #include "heatshrink_decoder.h"
+#include "heatshrink_frame.h"
+#include "heatshrink_crc32.h"
+#include "heatshrink_container.h"
+#include "heatshrink_parallel.h"
+#include "heatshrink_reader.h"
+#include "heatshrink_format.h"
 
 #define DEF_WINDOW_SZ2 11
 #define DEF_LOOKAHEAD_SZ2 4
 #define DEF_DECODER_INPUT_BUFFER_SIZE 256
 #define DEF_BUFFER_SIZE (64 * 1024)
+#define DEF_BLOCK_SIZE (32 * 1024)
 
 #if 0
 #define LOG(...) fprintf(stderr, __VA_ARGS__)
@@ -29,12 +38,12 @@ static const char author[] = HEATSHRINK_AUTHOR;
 static void usage() {
     fprintf(stderr, "heatshrink version %u.%u.%u by %s\n",
         version_major, version_minor, version_patch, author);
-    fprintf(stderr, "usage: heatshrink [-h] [-e|-d] [v] [-w BITS] [-l BITS] [IN_FILE] [OUT_FILE]\n");
+    fprintf(stderr, "usage: heatshrink [-h] [-e|-d|-t] [-v] [-F] [-P] [-S] [-T THREADS] [-r] [-x FORMAT] [-w BITS] [-l BITS] [-R OFFSET,LENGTH] [IN_FILE] [OUT_FILE]\n");
     exit(1);
 }
 
-typedef enum { IO_READ, IO_WRITE, } IO_MODE;
-typedef enum { OP_ENC, OP_DEC, } OPERATION;
+typedef enum { IO_READ, IO_WRITE, IO_DISCARD, } IO_MODE;
+typedef enum { OP_ENC, OP_DEC, OP_TEST, } OPERATION;
 
 typedef struct {
     int fd;                     /* file descriptor */
@@ -43,15 +52,33 @@ typedef struct {
     size_t read;                /* read index */
     size_t size;
     size_t total;
+    uint32_t crc;               /* CRC-32 of everything sunk, if discarding */
     uint8_t buf[];
 } io_handle;
 
 typedef struct {
     uint8_t window_sz2;
     uint8_t lookahead_sz2;
+    uint8_t format;             /* HEATSHRINK_FORMAT_* flags */
     size_t decoder_input_buffer_size;
     size_t buffer_size;
+    size_t block_size;
     uint8_t verbose;
+    uint8_t framed;
+    uint8_t primed;             /* prime blocks with the previous block */
+    size_t threads;
+    uint8_t raw;                /* no container header */
+    uint8_t seekable;           /* end framed output with a block index */
+    uint64_t *index;            /* offset of each block written */
+    size_t index_count;
+    size_t index_cap;
+    uint64_t stream_pos;        /* bytes of blocks written */
+    uint8_t range;              /* only decode range_size at range_offset */
+    uint64_t range_offset;
+    uint64_t range_size;
+    uint8_t has_size;           /* original_size is known */
+    uint64_t original_size;     /* summed over concatenated streams */
+    size_t streams;             /* container headers read */
     OPERATION cmd;
     char *in_fname;
     char *out_fname;
@@ -88,6 +115,8 @@ static io_handle *handle_open(char *fname, IO_MODE m, size_t buf_sz) {
         } else {
             io->fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC /*| O_EXCL*/, 0644);
         }
+    } else if (m == IO_DISCARD) {
+        return io;              /* nothing to open */
     }
 
     if (io->fd == -1) {         /* failed to open */
@@ -156,6 +185,11 @@ static int handle_drop(io_handle *io, size_t size) {
 static ssize_t handle_sink(io_handle *io, size_t size, uint8_t *input) {
     LOG("@ sink %zd\n", size);
     if (size > io->size) return -1;
+    if (io->mode == IO_DISCARD) {
+        io->crc = heatshrink_crc32(io->crc, input, size);
+        io->total += size;
+        return size;
+    }
     if (io->mode != IO_WRITE) return -1;
 
     if (io->fill + size > io->size) {
@@ -187,11 +221,33 @@ static void handle_close(io_handle *io) {
 static void close_and_report(config *cfg) {
     handle_close(cfg->in);
     handle_close(cfg->out);
-    if (cfg->verbose) report(cfg);
+    if (cfg->cmd != OP_ENC && cfg->has_size
+        && cfg->out->total != cfg->original_size) {
+        die("decoded size doesn't match container header");
+    }
+    if (cfg->verbose || cfg->cmd == OP_TEST) report(cfg);
     free(cfg->in);
     free(cfg->out);
 }
 
+static heatshrink_encoder *alloc_encoder(config *cfg) {
+    heatshrink_encoder *hse = heatshrink_encoder_alloc(cfg->window_sz2,
+        cfg->lookahead_sz2);
+    if (hse == NULL || heatshrink_encoder_set_format(hse, cfg->format) < 0) {
+        die("failed to init encoder: bad settings");
+    }
+    return hse;
+}
+
+static heatshrink_decoder *alloc_decoder(config *cfg) {
+    heatshrink_decoder *hsd = heatshrink_decoder_alloc(
+        cfg->decoder_input_buffer_size, cfg->window_sz2, cfg->lookahead_sz2);
+    if (hsd == NULL || heatshrink_decoder_set_format(hsd, cfg->format) < 0) {
+        die("failed to init decoder");
+    }
+    return hsd;
+}
+
 static int encoder_sink_read(config *cfg, heatshrink_encoder *hse,
         uint8_t *data, size_t data_sz) {
     size_t out_sz = 4096;
@@ -228,10 +284,8 @@ static int encoder_sink_read(config *cfg, heatshrink_encoder *hse,
 }
 
 static int encode(config *cfg) {
-    uint8_t window_sz2 = cfg->window_sz2;
-    size_t window_sz = 1 << window_sz2; 
-    heatshrink_encoder *hse = heatshrink_encoder_alloc(window_sz2, cfg->lookahead_sz2);
-    if (hse == NULL) die("failed to init encoder: bad settings");
+    size_t window_sz = 1 << cfg->window_sz2;
+    heatshrink_encoder *hse = alloc_encoder(cfg);
     ssize_t read_sz = 0;
     io_handle *in = cfg->in;
 
@@ -258,50 +312,30 @@ static int encode(config *cfg) {
     return 0;
 }
 
-static int decoder_sink_read(config *cfg, heatshrink_decoder *hsd,
+/* Decode DATA straight from the input handle's buffer, without sinking
+ * it into the decoder first. */
+static void decoder_poll_span(config *cfg, heatshrink_decoder *hsd,
         uint8_t *data, size_t data_sz) {
     io_handle *out = cfg->out;
-    uint16_t sink_sz = 0;
-    uint16_t poll_sz = 0;
+    size_t used = 0;
+    size_t in_count = 0;
+    size_t poll_sz = 0;
     size_t out_sz = 4096;
     uint8_t out_buf[out_sz];
     memset(out_buf, 0, out_sz);
 
-    HEATSHRINK_DECODER_SINK_RES sres;
     HEATSHRINK_DECODER_POLL_RES pres;
-    HEATSHRINK_DECODER_FINISH_RES fres;
-
-    uint16_t sunk = 0;
     do {
-        if (data_sz > 0) {
-            sres = heatshrink_decoder_sink(hsd, &data[sunk], data_sz - sunk, &sink_sz);
-            if (sres < 0) die("sink");
-            sunk += sink_sz;
-        }
-
-        do {
-            pres = heatshrink_decoder_poll(hsd, out_buf, out_sz, &poll_sz);
-            if (pres < 0) die("poll");
-            if (handle_sink(out, poll_sz, out_buf) < 0) die("handle_sink");
-        } while (pres == HSDR_POLL_MORE);
-        
-        if (data_sz == 0 && poll_sz == 0) {
-            fres = heatshrink_decoder_finish(hsd);
-            if (fres < 0) die("finish");
-            if (fres == HSDR_FINISH_DONE) return 1;
-        }
-    } while (sunk < data_sz);
-
-    return 0;
+        pres = heatshrink_decoder_poll_span(hsd, &data[used], data_sz - used,
+            &in_count, out_buf, out_sz, &poll_sz);
+        if (pres < 0) die("poll");
+        used += in_count;
+        if (handle_sink(out, poll_sz, out_buf) < 0) die("handle_sink");
+    } while (pres == HSDR_POLL_MORE);
 }
 
 static int decode(config *cfg) {
-    uint8_t window_sz2 = cfg->window_sz2;
-    size_t window_sz = 1 << window_sz2;
-    size_t ibs = cfg->decoder_input_buffer_size;
-    heatshrink_decoder *hsd = heatshrink_decoder_alloc(ibs,
-        window_sz2, cfg->lookahead_sz2);
-    if (hsd == NULL) die("failed to init decoder");
+    heatshrink_decoder *hsd = alloc_decoder(cfg);
 
     ssize_t read_sz = 0;
 
@@ -312,7 +346,7 @@ static int decode(config *cfg) {
     /* Process input until end of stream */
     while (1) {
         uint8_t *input = NULL;
-        read_sz = handle_read(in, window_sz, &input);
+        read_sz = handle_read(in, in->size, &input);
         if (input == NULL) {
             printf("handle read failure\n");
             die("read");
@@ -321,10 +355,11 @@ static int decode(config *cfg) {
             fres = heatshrink_decoder_finish(hsd);
             if (fres < 0) die("finish");
             if (fres == HSDR_FINISH_DONE) break;
+            die("truncated input");
         } else if (read_sz < 0) {
             die("read");
         } else {
-            if (decoder_sink_read(cfg, hsd, input, read_sz)) break;
+            decoder_poll_span(cfg, hsd, input, read_sz);
             if (handle_drop(in, read_sz) < 0) die("drop");
         }
     }
@@ -335,27 +370,483 @@ static int decode(config *cfg) {
     return 0;
 }
 
+/* Write SIZE bytes to an IO handle, in chunks that fit its buffer. */
+static void sink_all(io_handle *out, size_t size, uint8_t *data) {
+    size_t written = 0;
+    while (written < size) {
+        size_t chunk = size - written;
+        if (chunk > out->size) chunk = out->size;
+        if (handle_sink(out, chunk, &data[written]) < 0) die("handle_sink");
+        written += chunk;
+    }
+}
+
+/* Write one framed block, noting where it starts for the index. */
+static void emit_block(config *cfg, const uint8_t *buf, size_t size) {
+    if (cfg->seekable) {
+        if (cfg->index_count == cfg->index_cap) {
+            cfg->index_cap = cfg->index_cap ? 2 * cfg->index_cap : 64;
+            cfg->index = realloc(cfg->index, cfg->index_cap * sizeof(uint64_t));
+            if (cfg->index == NULL) die("realloc");
+        }
+        cfg->index[cfg->index_count++] = cfg->stream_pos;
+    }
+    cfg->stream_pos += size;
+    sink_all(cfg->out, size, (uint8_t *)buf);
+}
+
+/* End a framed stream with the block index, if it's seekable, and an
+ * end block. */
+static void finish_framed(config *cfg) {
+    uint8_t end[HEATSHRINK_FRAME_END_SIZE];
+    size_t end_sz = 0;
+    /* Encoding reads all of its input, so this is the stream's size. */
+    if (heatshrink_frame_write_end(cfg->in->total, end, sizeof(end),
+            &end_sz) != HSFR_OK) {
+        die("frame end");
+    }
+    if (!cfg->seekable) {
+        sink_all(cfg->out, end_sz, end);
+        return;
+    }
+    size_t index_sz = HEATSHRINK_FRAME_INDEX_BOUND(cfg->index_count);
+    uint8_t *index = malloc(index_sz);
+    if (index == NULL) die("malloc");
+    size_t out_sz = 0;
+    if (heatshrink_frame_write_index(cfg->index, cfg->index_count,
+            cfg->block_size, index, index_sz, &out_sz) != HSFR_OK) {
+        die("frame index");
+    }
+    sink_all(cfg->out, out_sz, index);
+    sink_all(cfg->out, end_sz, end);
+    free(index);
+    free(cfg->index);
+}
+
+/* Take the settings from the container header at the start of BUF.
+ * Returns the header's size, or 0 if BUF doesn't start with one. */
+static size_t apply_container(config *cfg, const uint8_t *buf, size_t size) {
+    heatshrink_container_header h;
+    size_t hdr_sz = 0;
+    switch (heatshrink_container_read_header(buf, size, &h, &hdr_sz)) {
+    case HSZR_OK:
+        break;
+    case HSZR_ERROR_BAD_MAGIC:
+        return 0;
+    case HSZR_MORE:
+        die("truncated container header");
+    default:
+        die("unsupported container version or settings");
+    }
+
+    cfg->window_sz2 = h.window_sz2;
+    cfg->lookahead_sz2 = h.lookahead_sz2;
+    cfg->format = h.format;
+    cfg->framed = (h.flags & HSZ_FLAG_FRAMED) != 0;
+    /* The total is only known if every stream recorded its size. */
+    uint8_t has_size = (h.flags & HSZ_FLAG_HAS_SIZE) != 0;
+    cfg->has_size = cfg->streams == 0 ? has_size : cfg->has_size && has_size;
+    cfg->original_size += h.original_size;
+    cfg->streams++;
+    return hdr_sz;
+}
+
+/* If the input starts with a container header, take the settings from
+ * it; otherwise leave them alone and decode it as a headerless stream.
+ * Returns whether there was a header. */
+static int read_container(config *cfg) {
+    io_handle *in = cfg->in;
+    size_t want = HEATSHRINK_CONTAINER_MAX_HEADER_SIZE;
+    uint8_t *input = NULL;
+    size_t read_sz = 0;
+    do {
+        read_sz = handle_read(in, want, &input);
+        if (input == NULL || read_sz == (size_t)-1) die("read");
+    } while (read_sz < want && in->fd != -1);
+
+    size_t hdr_sz = apply_container(cfg, input, read_sz);
+    if (handle_drop(in, hdr_sz) < 0) die("drop");
+    return hdr_sz > 0;
+}
+
+#if HEATSHRINK_USE_THREADS
+/* Read up to SIZE bytes into BUF, stopping short only at end of input. */
+static size_t read_fully(io_handle *in, uint8_t *buf, size_t size) {
+    size_t got = 0;
+    while (got < size) {
+        uint8_t *input = NULL;
+        size_t want = size - got;
+        if (want > in->size) want = in->size;
+        size_t read_sz = handle_read(in, want, &input);
+        if (input == NULL || read_sz == (size_t)-1) die("read");
+        if (read_sz == 0) break;
+        memcpy(&buf[got], input, read_sz);
+        if (handle_drop(in, read_sz) < 0) die("drop");
+        got += read_sz;
+    }
+    return got;
+}
+
+static int write_block(void *udata, const uint8_t *buf, size_t size) {
+    emit_block(udata, buf, size);
+    return 0;
+}
+
+/* Compress a few blocks per thread at a time, writing them in order. */
+static int encode_parallel(config *cfg) {
+    heatshrink_parallel_encoder *hpe = heatshrink_parallel_encoder_alloc(
+        cfg->window_sz2, cfg->lookahead_sz2, cfg->block_size,
+        cfg->threads, cfg->primed);
+    if (hpe == NULL
+        || heatshrink_parallel_encoder_set_format(hpe, cfg->format) < 0) {
+        die("failed to init parallel encoder: bad settings");
+    }
+    size_t batch_sz = 4 * cfg->threads * cfg->block_size;
+    uint8_t *batch = malloc(batch_sz);
+    if (batch == NULL) die("malloc");
+
+    size_t read_sz = 0;
+    do {
+        read_sz = read_fully(cfg->in, batch, batch_sz);
+        if (heatshrink_parallel_encode(hpe, batch, read_sz,
+                write_block, cfg) != HSPR_OK) {
+            die("frame encode");
+        }
+    } while (read_sz == batch_sz);
+
+    finish_framed(cfg);
+    free(batch);
+    heatshrink_parallel_encoder_free(hpe);
+    close_and_report(cfg);
+    return 0;
+}
+
+static heatshrink_parallel_decoder *alloc_parallel_decoder(config *cfg) {
+    heatshrink_parallel_decoder *hpd = heatshrink_parallel_decoder_alloc(
+        cfg->window_sz2, cfg->lookahead_sz2, cfg->threads);
+    if (hpd == NULL
+        || heatshrink_parallel_decoder_set_format(hpd, cfg->format) < 0) {
+        die("failed to init parallel decoder: bad settings");
+    }
+    return hpd;
+}
+
+/* Decode a few blocks per thread at a time, writing them in order. */
+static int decode_parallel(config *cfg) {
+    heatshrink_parallel_decoder *hpd = alloc_parallel_decoder(cfg);
+    size_t cap = HEATSHRINK_PARALLEL_BLOCKS_PER_THREAD * cfg->threads
+        * HEATSHRINK_FRAME_BLOCK_BOUND(cfg->block_size);
+    uint8_t *buf = malloc(cap);
+    if (buf == NULL) die("malloc");
+    size_t fill = 0;
+    uint8_t ended = 0;
+
+    for (;;) {
+        size_t read_sz = read_fully(cfg->in, &buf[fill], cap - fill);
+        fill += read_sz;
+        if (fill == 0) break;
+
+        if (ended) {
+            /* Another stream follows, maybe with different settings. */
+            size_t hdr_sz = cfg->raw ? 0 : apply_container(cfg, buf, fill);
+            if (!cfg->framed) die("unframed stream after framed stream");
+            if (hdr_sz > 0) {
+                heatshrink_parallel_decoder_free(hpd);
+                hpd = alloc_parallel_decoder(cfg);
+            }
+            memmove(buf, &buf[hdr_sz], fill - hdr_sz);
+            fill -= hdr_sz;
+            ended = 0;
+            continue;
+        }
+
+        size_t used = 0;
+        switch (heatshrink_parallel_decode(hpd, buf, fill, &used,
+                write_block, cfg)) {
+        case HSPR_OK:
+            break;
+        case HSPR_END:
+            ended = 1;
+            break;
+        case HSPR_ERROR_CHECKSUM:
+            die("block checksum mismatch");
+        default:
+            die("corrupt block");
+        }
+        if (used == 0) {
+            /* A block bigger than the buffer, or cut off. */
+            if (fill < cap) die("truncated block");
+            cap *= 2;
+            buf = realloc(buf, cap);
+            if (buf == NULL) die("realloc");
+        }
+        memmove(buf, &buf[used], fill - used);
+        fill -= used;
+    }
+    if (!ended) die("truncated stream: no end block");
+
+    free(buf);
+    heatshrink_parallel_decoder_free(hpd);
+    close_and_report(cfg);
+    return 0;
+}
+#endif
+
+static int encode_framed(config *cfg) {
+#if HEATSHRINK_USE_THREADS
+    if (cfg->threads > 1) return encode_parallel(cfg);
+#endif
+    heatshrink_encoder *hse = alloc_encoder(cfg);
+    size_t block_sz = cfg->block_size;
+    size_t frame_sz = HEATSHRINK_FRAME_BLOCK_BOUND(block_sz);
+    uint8_t *frame = malloc(frame_sz);
+    size_t window_sz = 1 << cfg->window_sz2;
+    uint8_t *dict = malloc(window_sz);
+    size_t dict_sz = 0;
+    if (frame == NULL || dict == NULL) die("malloc");
+    io_handle *in = cfg->in;
+
+    while (1) {
+        uint8_t *input = NULL;
+        size_t read_sz = handle_read(in, block_sz, &input);
+        if (input == NULL || read_sz == (size_t)-1) die("read");
+        if (read_sz == 0) break;
+
+        size_t out_sz = 0;
+        if (heatshrink_frame_encode_block_primed(hse, dict, dict_sz,
+                input, read_sz, frame, frame_sz, &out_sz) != HSFR_OK) {
+            die("frame encode");
+        }
+        emit_block(cfg, frame, out_sz);
+        if (cfg->primed) {
+            dict_sz = read_sz < window_sz ? read_sz : window_sz;
+            memcpy(dict, &input[read_sz - dict_sz], dict_sz);
+        }
+        if (handle_drop(in, read_sz) < 0) die("drop");
+    }
+
+    finish_framed(cfg);
+    free(dict);
+    free(frame);
+    heatshrink_encoder_free(hse);
+    close_and_report(cfg);
+    return 0;
+}
+
+static int decode_framed(config *cfg) {
+#if HEATSHRINK_USE_THREADS
+    if (cfg->threads > 1) return decode_parallel(cfg);
+#endif
+    heatshrink_decoder *hsd = alloc_decoder(cfg);
+    size_t raw_cap = 0;
+    uint8_t *raw = NULL;
+    uint8_t *prev = NULL;       /* previous block, for primed blocks */
+    size_t prev_sz = 0;
+    uint64_t stream_raw = 0;    /* decoded so far, to check the end block */
+    uint8_t ended = 0;
+    io_handle *in = cfg->in;
+
+    while (1) {
+        uint8_t *input = NULL;
+        size_t read_sz = handle_read(in, HEATSHRINK_FRAME_MAX_HEADER_SIZE, &input);
+        if (input == NULL || read_sz == (size_t)-1) die("read");
+        if (read_sz == 0) break;
+
+        if (ended) {
+            /* Another stream follows, maybe with different settings. */
+            if (!cfg->raw && read_container(cfg)) {
+                if (!cfg->framed) die("unframed stream after framed stream");
+                heatshrink_decoder_free(hsd);
+                hsd = alloc_decoder(cfg);
+            }
+            prev_sz = 0;
+            stream_raw = 0;
+            ended = 0;
+            continue;
+        }
+
+        heatshrink_frame_header h;
+        if (heatshrink_frame_read_header(input, read_sz, &h) != HSFR_OK) {
+            die("bad or truncated block header");
+        }
+        size_t block_sz = h.header_size + h.payload_size;
+        if (block_sz > in->size) die("block too large for input buffer");
+        read_sz = handle_read(in, block_sz, &input);
+        if (read_sz < block_sz) die("truncated block");
+
+        if (h.type == HSF_BLOCK_END) {
+            uint64_t raw_total = 0;
+            if (heatshrink_frame_read_end(input, read_sz, &raw_total) != HSFR_OK
+                || raw_total != stream_raw) {
+                die("stream size doesn't match its end block");
+            }
+            if (handle_drop(in, block_sz) < 0) die("drop");
+            ended = 1;
+            continue;
+        }
+
+        if (h.raw_size > raw_cap) {
+            raw_cap = h.raw_size;
+            raw = realloc(raw, raw_cap);
+            uint8_t *p = realloc(prev, raw_cap);
+            if (raw == NULL || p == NULL) die("realloc");
+            prev = p;
+        }
+        size_t used = 0;
+        size_t out_sz = 0;
+        switch (heatshrink_frame_decode_block_primed(hsd, prev, prev_sz,
+                input, read_sz, &used, raw, raw_cap, &out_sz)) {
+        case HSFR_OK:
+            break;
+        case HSFR_ERROR_CHECKSUM:
+            die("block checksum mismatch");
+        default:
+            die("corrupt block");
+        }
+        sink_all(cfg->out, out_sz, raw);
+        stream_raw += out_sz;
+        if (handle_drop(in, used) < 0) die("drop");
+
+        uint8_t *swap = prev;
+        prev = raw;
+        raw = swap;
+        prev_sz = out_sz;
+    }
+    if (!ended) die("truncated stream: no end block");
+
+    free(prev);
+    free(raw);
+    heatshrink_decoder_free(hsd);
+    close_and_report(cfg);
+    return 0;
+}
+
+/* Start the output with a container header describing the settings. */
+static void write_container(config *cfg) {
+    heatshrink_container_header h;
+    memset(&h, 0, sizeof(h));
+    h.window_sz2 = cfg->window_sz2;
+    h.lookahead_sz2 = cfg->lookahead_sz2;
+    h.format = cfg->format;
+    if (cfg->framed) h.flags |= HSZ_FLAG_FRAMED;
+    if (cfg->seekable) h.flags |= HSZ_FLAG_SEEKABLE;
+
+    struct stat st;
+    if (fstat(cfg->in->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        h.flags |= HSZ_FLAG_HAS_SIZE;
+        h.original_size = st.st_size;
+    }
+
+    uint8_t buf[HEATSHRINK_CONTAINER_MAX_HEADER_SIZE];
+    size_t hdr_sz = 0;
+    if (heatshrink_container_write_header(&h, buf, sizeof(buf), &hdr_sz)
+        != HSZR_OK) {
+        die("failed to write container header");
+    }
+    sink_all(cfg->out, hdr_sz, buf);
+}
+
+static int read_at_fd(void *udata, uint64_t offset, uint8_t *buf, size_t size) {
+    int fd = *(int *)udata;
+    while (size > 0) {
+        ssize_t read_sz = pread(fd, buf, size, offset);
+        if (read_sz <= 0) return -1;
+        buf += read_sz;
+        size -= read_sz;
+        offset += read_sz;
+    }
+    return 0;
+}
+
+/* Decode just the requested range, using the seekable stream's index. */
+static int decode_range(config *cfg) {
+    struct stat st;
+    if (fstat(cfg->in->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        die("-R needs a seekable input file");
+    }
+    HEATSHRINK_READER_RES res;
+    heatshrink_reader *r = heatshrink_reader_open(read_at_fd, &cfg->in->fd,
+        st.st_size, 4, &res);
+    if (r == NULL) {
+        die(res == HSRR_ERROR_IO ? "read" : "input isn't a seekable stream");
+    }
+
+    uint8_t buf[4096];
+    uint64_t offset = cfg->range_offset;
+    uint64_t rem = cfg->range_size;
+    while (rem > 0) {
+        size_t got = 0;
+        size_t want = rem < sizeof(buf) ? rem : sizeof(buf);
+        if (heatshrink_reader_pread(r, buf, want, offset, &got) != HSRR_OK) {
+            die("corrupt block");
+        }
+        if (got == 0) break;    /* past the end */
+        sink_all(cfg->out, got, buf);
+        offset += got;
+        rem -= got;
+    }
+
+    heatshrink_reader_close(r);
+    close_and_report(cfg);
+    return 0;
+}
+
 static void report(config *cfg) {
     size_t inb = cfg->in->total;
     size_t outb = cfg->out->total;
+    if (cfg->cmd == OP_TEST) {
+        printf("%s: OK, %zd -> %zd bytes, crc32 %08x\n",
+            cfg->in_fname, inb, outb, cfg->out->crc);
+        return;
+    }
     fprintf(cfg->out->fd == STDOUT_FILENO ? stderr : stdout,
         "%s %0.2f %%\t %zd -> %zd (-w %u -l %u)\n",
         cfg->in_fname, 100.0 - (100.0 * outb) / inb, inb, outb,
         cfg->window_sz2, cfg->lookahead_sz2);
 }
 
+/* Parse a comma-separated list of format extensions. */
+static uint8_t parse_format(char *list) {
+    static const struct { const char *name; uint8_t flag; } names[] = {
+        { "varlen", HEATSHRINK_FORMAT_VARLEN },
+        { "repeat", HEATSHRINK_FORMAT_REPEAT },
+        { "long", HEATSHRINK_FORMAT_LONG },
+        { "literals", HEATSHRINK_FORMAT_LITERAL_RUNS },
+        { "aligned", HEATSHRINK_FORMAT_ALIGNED },
+        { "entropy", HEATSHRINK_FORMAT_ENTROPY },
+    };
+    uint8_t format = HEATSHRINK_FORMAT_CLASSIC;
+    for (char *name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+        size_t i = 0;
+        while (i < sizeof(names)/sizeof(names[0])
+            && strcmp(name, names[i].name) != 0) {
+            i++;
+        }
+        if (i == sizeof(names)/sizeof(names[0])) usage();
+        format |= names[i].flag;
+    }
+    if (format & ~HEATSHRINK_FORMATS_SUPPORTED) {
+        die("format extension not supported by this build");
+    } else if (!heatshrink_format_supported(format)) {
+        die("aligned and entropy don't combine with other extensions");
+    }
+    return format;
+}
+
 static void proc_args(config *cfg, int argc, char **argv) {
     cfg->window_sz2 = DEF_WINDOW_SZ2;
     cfg->lookahead_sz2 = DEF_LOOKAHEAD_SZ2;
     cfg->buffer_size = DEF_BUFFER_SIZE;
     cfg->decoder_input_buffer_size = DEF_DECODER_INPUT_BUFFER_SIZE;
+    cfg->block_size = DEF_BLOCK_SIZE;
+    cfg->threads = 1;
     cfg->cmd = OP_ENC;
     cfg->verbose = 0;
     cfg->in_fname = "-";
     cfg->out_fname = "-";
 
     int a = 0;
-    while ((a = getopt(argc, argv, "hedi:w:l:v")) != -1) {
+    while ((a = getopt(argc, argv, "hedti:w:l:vFPST:rR:x:")) != -1) {
         switch (a) {
         case 'h':               /* help */
             usage();
@@ -363,6 +854,8 @@ static void proc_args(config *cfg, int argc, char **argv) {
             cfg->cmd = OP_ENC; break;
         case 'd':               /* decode */
             cfg->cmd = OP_DEC; break;
+        case 't':               /* test: decode, but only checksum output */
+            cfg->cmd = OP_TEST; break;
         case 'i':               /* input buffer size */
             cfg->decoder_input_buffer_size = atoi(optarg);
             break;
@@ -375,6 +868,37 @@ static void proc_args(config *cfg, int argc, char **argv) {
         case 'v':               /* verbosity++ */
             cfg->verbose++;
             break;
+        case 'F':               /* block-framed format */
+            cfg->framed = 1;
+            break;
+        case 'P':               /* prime framed blocks */
+            cfg->primed = 1;
+            cfg->framed = 1;
+            break;
+        case 'S':               /* seekable: framed, with a block index */
+            cfg->seekable = 1;
+            cfg->framed = 1;
+            break;
+        case 'R': {             /* decode a range of a seekable stream */
+            char *end = NULL;
+            cfg->range_offset = strtoull(optarg, &end, 0);
+            if (*end != ',') usage();
+            cfg->range_size = strtoull(end + 1, &end, 0);
+            if (*end != '\0') usage();
+            cfg->range = 1;
+            cfg->cmd = OP_DEC;
+            break;
+        }
+        case 'T':               /* use N threads for blocks, 0 = per CPU */
+            cfg->threads = atoi(optarg);
+            cfg->framed = 1;
+            break;
+        case 'r':               /* raw stream, no container header */
+            cfg->raw = 1;
+            break;
+        case 'x':               /* format extensions, e.g. "varlen,repeat" */
+            cfg->format = parse_format(optarg);
+            break;
         case '?':               /* unknown argument */
         default:
             usage();
@@ -388,6 +912,13 @@ static void proc_args(config *cfg, int argc, char **argv) {
         argv++;
     }
     if (argc > 0) cfg->out_fname = argv[0];
+    if (cfg->seekable && (cfg->primed || cfg->raw)) {
+        die("-S can't be combined with -P or -r");
+    }
+    if (!heatshrink_format_fits(cfg->format,
+            cfg->window_sz2, cfg->lookahead_sz2)) {
+        die("repeat needs varlen or a larger -w/-l");
+    }
 }
 
 int main(int argc, char **argv) {
@@ -396,20 +927,39 @@ int main(int argc, char **argv) {
     proc_args(&cfg, argc, argv);
 
     if (0 == strcmp(cfg.in_fname, cfg.out_fname)
-        && (0 != strcmp("-", cfg.in_fname))) {
+        && (0 != strcmp("-", cfg.in_fname)) && cfg.cmd != OP_TEST) {
         printf("Refusing to overwrite file '%s' with itself.\n", cfg.in_fname);
         exit(1);
     }
 
     cfg.in = handle_open(cfg.in_fname, IO_READ, cfg.buffer_size);
     if (cfg.in == NULL) die("Failed to open input file for read");
-    cfg.out = handle_open(cfg.out_fname, IO_WRITE, cfg.buffer_size);
+    cfg.out = handle_open(cfg.out_fname,
+        cfg.cmd == OP_TEST ? IO_DISCARD : IO_WRITE, cfg.buffer_size);
     if (cfg.out == NULL) die("Failed to open output file for write");
 
+    if (cfg.threads == 0) {
+#if HEATSHRINK_USE_THREADS
+        cfg.threads = heatshrink_parallel_default_threads();
+#else
+        cfg.threads = 1;
+#endif
+    }
+
+    if (cfg.range) return decode_range(&cfg);
+
+    if (!cfg.raw) {
+        if (cfg.cmd == OP_ENC) {
+            write_container(&cfg);
+        } else {
+            read_container(&cfg);
+        }
+    }
+
     if (cfg.cmd == OP_ENC) {
-        return encode(&cfg);
-    } else if (cfg.cmd == OP_DEC) {
-        return decode(&cfg);
+        return cfg.framed ? encode_framed(&cfg) : encode(&cfg);
+    } else if (cfg.cmd == OP_DEC || cfg.cmd == OP_TEST) {
+        return cfg.framed ? decode_framed(&cfg) : decode(&cfg);
     } else {
         usage();
     }
@@ -16,4 +16,15 @@
 #define HEATSHRINK_LITERAL_MARKER 0x01
 #define HEATSHRINK_BACKREF_MARKER 0x00
 
+/* Optional format extensions, as flags (see heatshrink_format.h). The
+ * encoder and decoder have to use the same ones; 0 is the classic
+ * format. */
+#define HEATSHRINK_FORMAT_CLASSIC 0x00
+#define HEATSHRINK_FORMAT_VARLEN 0x01   /* variable-length offsets, counts */
+#define HEATSHRINK_FORMAT_REPEAT 0x02   /* repeat-last-offset backrefs */
+#define HEATSHRINK_FORMAT_LONG 0x04     /* backrefs past the lookahead */
+#define HEATSHRINK_FORMAT_LITERAL_RUNS 0x08 /* raw runs of literal bytes */
+#define HEATSHRINK_FORMAT_ALIGNED 0x10  /* byte-aligned sequences, on its own */
+#define HEATSHRINK_FORMAT_ENTROPY 0x20  /* range-coded tokens, on its own */
+
 #endif
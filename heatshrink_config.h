@@ -1,8 +1,12 @@
 #ifndef HEATSHRINK_CONFIG_H
 #define HEATSHRINK_CONFIG_H
 
+#include "heatshrink.h"
+
 /* Should functionality assuming dynamic allocation be used? */
+#ifndef HEATSHRINK_DYNAMIC_ALLOC
 #define HEATSHRINK_DYNAMIC_ALLOC 1
+#endif
 
 #if HEATSHRINK_DYNAMIC_ALLOC
     /* Optional replacement of malloc/free */
@@ -13,6 +17,7 @@
     #define HEATSHRINK_STATIC_INPUT_BUFFER_SIZE 256
     #define HEATSHRINK_STATIC_WINDOW_BITS 8
     #define HEATSHRINK_STATIC_LOOKAHEAD_BITS 4
+    #define HEATSHRINK_STATIC_FORMAT HEATSHRINK_FORMAT_CLASSIC
 #endif
 
 /* Turn on logging for debugging. */
@@ -21,4 +26,38 @@
 /* Use indexing for faster compression. (This requires additional space.) */
 #define HEATSHRINK_USE_INDEX 1
 
+/* Map the decoder's window into memory twice, back to back, so that
+ * backrefs never wrap around it. Linux-only, and requires dynamic
+ * allocation; windows smaller than a page use the normal buffer. */
+#ifndef HEATSHRINK_USE_MIRRORED_WINDOW
+#define HEATSHRINK_USE_MIRRORED_WINDOW 0
+#endif
+
+/* Support the optional format extensions in heatshrink_format.h, which
+ * trade some code size for smaller output. Without them, only the
+ * classic format can be encoded or decoded. */
+#ifndef HEATSHRINK_USE_EXTENDED_FORMATS
+#define HEATSHRINK_USE_EXTENDED_FORMATS 1
+#endif
+
+/* Support HEATSHRINK_FORMAT_ENTROPY (see heatshrink_entropy.h), which
+ * needs extended formats, and adds about 1 KB to every encoder and
+ * decoder for its model. Static builds only get it if
+ * HEATSHRINK_STATIC_FORMAT uses it. */
+#ifndef HEATSHRINK_USE_ENTROPY_CODER
+#if HEATSHRINK_DYNAMIC_ALLOC
+#define HEATSHRINK_USE_ENTROPY_CODER 1
+#else
+#define HEATSHRINK_USE_ENTROPY_CODER \
+    ((HEATSHRINK_STATIC_FORMAT & HEATSHRINK_FORMAT_ENTROPY) != 0)
+#endif
+#endif
+
+/* Build the block-parallel API in heatshrink_parallel.c, which runs a
+ * pool of POSIX threads (link with -lpthread). Requires dynamic
+ * allocation. */
+#ifndef HEATSHRINK_USE_THREADS
+#define HEATSHRINK_USE_THREADS 1
+#endif
+
 #endif
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <string.h>
+#include "heatshrink_container.h"
+
+static const uint8_t magic[] = { 'H', 'S', 'Z', 0x1A };
+
+size_t heatshrink_container_header_size(const heatshrink_container_header *h) {
+    size_t size = HEATSHRINK_CONTAINER_MIN_HEADER_SIZE;
+    if ((h->flags & HSZ_FLAG_FORMAT) || h->format != 0) size += 1;
+    if (h->flags & HSZ_FLAG_HAS_SIZE) size += 8;
+    return size;
+}
+
+HEATSHRINK_CONTAINER_RES heatshrink_container_write_header(
+        const heatshrink_container_header *h,
+        uint8_t *buf, size_t buf_size, size_t *output_size) {
+    if ((h == NULL) || (buf == NULL) || (output_size == NULL)) {
+        return HSZR_ERROR_NULL;
+    }
+    if (h->flags & HSZ_FLAG_RESERVED_MASK) return HSZR_ERROR_UNSUPPORTED;
+    size_t hdr_sz = heatshrink_container_header_size(h);
+    if (buf_size < hdr_sz) return HSZR_ERROR_OUTPUT_FULL;
+
+    memcpy(buf, magic, sizeof(magic));
+    buf[4] = HEATSHRINK_CONTAINER_VERSION;
+    buf[5] = h->flags & ~HSZ_FLAG_FORMAT;
+    buf[6] = h->window_sz2;
+    buf[7] = h->lookahead_sz2;
+    size_t pos = HEATSHRINK_CONTAINER_MIN_HEADER_SIZE;
+    if (h->format != 0) {
+        buf[5] |= HSZ_FLAG_FORMAT;
+        buf[pos++] = h->format;
+    }
+    if (h->flags & HSZ_FLAG_HAS_SIZE) {
+        for (int i = 0; i < 8; i++) {
+            buf[pos + i] = (h->original_size >> (8 * i)) & 0xFF;
+        }
+    }
+    *output_size = hdr_sz;
+    return HSZR_OK;
+}
+
+HEATSHRINK_CONTAINER_RES heatshrink_container_read_header(const uint8_t *buf,
+        size_t size, heatshrink_container_header *h, size_t *header_size) {
+    if ((buf == NULL) || (h == NULL) || (header_size == NULL)) {
+        return HSZR_ERROR_NULL;
+    }
+    size_t cmp_sz = size < sizeof(magic) ? size : sizeof(magic);
+    if (0 != memcmp(buf, magic, cmp_sz)) return HSZR_ERROR_BAD_MAGIC;
+    if (size < HEATSHRINK_CONTAINER_MIN_HEADER_SIZE) return HSZR_MORE;
+
+    h->version = buf[4];
+    h->flags = buf[5];
+    h->window_sz2 = buf[6];
+    h->lookahead_sz2 = buf[7];
+    h->format = HEATSHRINK_FORMAT_CLASSIC;
+    h->original_size = 0;
+    if (h->version != HEATSHRINK_CONTAINER_VERSION) return HSZR_ERROR_UNSUPPORTED;
+    if (h->flags & HSZ_FLAG_RESERVED_MASK) return HSZR_ERROR_UNSUPPORTED;
+    if ((h->window_sz2 < HEATSHRINK_MIN_WINDOW_BITS) ||
+        (h->window_sz2 > HEATSHRINK_MAX_WINDOW_BITS) ||
+        (h->lookahead_sz2 < HEATSHRINK_MIN_LOOKAHEAD_BITS) ||
+        (h->lookahead_sz2 >= h->window_sz2)) {
+        return HSZR_ERROR_UNSUPPORTED;
+    }
+
+    size_t hdr_sz = heatshrink_container_header_size(h);
+    if (size < hdr_sz) return HSZR_MORE;
+    size_t pos = HEATSHRINK_CONTAINER_MIN_HEADER_SIZE;
+    if (h->flags & HSZ_FLAG_FORMAT) {
+        h->format = buf[pos++];
+        if (!heatshrink_format_supported(h->format)
+            || !heatshrink_format_fits(h->format,
+                h->window_sz2, h->lookahead_sz2)) {
+            return HSZR_ERROR_UNSUPPORTED;
+        }
+    }
+    if (h->flags & HSZ_FLAG_HAS_SIZE) {
+        for (int i = 0; i < 8; i++) {
+            h->original_size |= (uint64_t)buf[pos + i] << (8 * i);
+        }
+    }
+    *header_size = hdr_sz;
+    return HSZR_OK;
+}
+
+#if HEATSHRINK_DYNAMIC_ALLOC
+heatshrink_decoder *heatshrink_container_alloc_decoder(
+        const heatshrink_container_header *h, uint16_t input_buffer_size) {
+    if (h == NULL) return NULL;
+    heatshrink_decoder *hsd = heatshrink_decoder_alloc(input_buffer_size,
+        h->window_sz2, h->lookahead_sz2);
+    if (hsd != NULL && heatshrink_decoder_set_format(hsd, h->format) < 0) {
+        heatshrink_decoder_free(hsd);
+        return NULL;
+    }
+    return hsd;
+}
+#endif
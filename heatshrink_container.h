@@ -0,0 +1,79 @@
+#ifndef HEATSHRINK_CONTAINER_H
+#define HEATSHRINK_CONTAINER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "heatshrink.h"
+#include "heatshrink_config.h"
+#include "heatshrink_decoder.h"
+#include "heatshrink_format.h"
+
+/* Container (.hsz) header, so a decoder can configure itself:
+ *
+ *     ["HSZ" 0x1A] [version:u8] [flags:u8] [window bits:u8]
+ *     [lookahead bits:u8] [format:u8, if HSZ_FLAG_FORMAT]
+ *     [original size:u64le, if HSZ_FLAG_HAS_SIZE]
+ *
+ * followed by a raw stream, or by blocks if HSZ_FLAG_FRAMED is set.
+ * The first byte has its top bit clear, which the encoder never emits
+ * (its first token is always a literal), and isn't a valid frame block
+ * type, so headerless streams can still be told apart. */
+
+#define HEATSHRINK_CONTAINER_VERSION 1
+#define HEATSHRINK_CONTAINER_MIN_HEADER_SIZE 8
+#define HEATSHRINK_CONTAINER_MAX_HEADER_SIZE 17
+
+typedef enum {
+    HSZ_FLAG_HAS_SIZE = 0x01,   /* original size follows the header */
+    HSZ_FLAG_FRAMED = 0x02,     /* payload is heatshrink_frame blocks */
+    HSZ_FLAG_SEEKABLE = 0x04,   /* ...ending with an index block */
+    HSZ_FLAG_FORMAT = 0x08,     /* format extensions are used */
+} HEATSHRINK_CONTAINER_FLAG;
+
+/* Flag bits this version doesn't know; set means the stream is newer. */
+#define HSZ_FLAG_RESERVED_MASK 0xF0
+
+typedef enum {
+    HSZR_OK,                    /* header was read / written */
+    HSZR_MORE,                  /* more input is needed */
+    HSZR_ERROR_NULL=-1,         /* NULL argument */
+    HSZR_ERROR_BAD_MAGIC=-2,    /* not a container */
+    HSZR_ERROR_UNSUPPORTED=-3,  /* unknown version, flags or settings */
+    HSZR_ERROR_OUTPUT_FULL=-4,  /* output buffer too small */
+} HEATSHRINK_CONTAINER_RES;
+
+typedef struct {
+    uint8_t version;
+    uint8_t flags;              /* HEATSHRINK_CONTAINER_FLAG bits */
+    uint8_t window_sz2;
+    uint8_t lookahead_sz2;
+    uint8_t format;             /* HEATSHRINK_FORMAT_* flags */
+    uint64_t original_size;     /* only meaningful with HSZ_FLAG_HAS_SIZE */
+} heatshrink_container_header;
+
+/* Size of the header described by H. */
+size_t heatshrink_container_header_size(const heatshrink_container_header *h);
+
+/* Write H to BUF, setting *OUTPUT_SIZE to the number of bytes written.
+ * H->version is ignored; the current version is always written, and
+ * HSZ_FLAG_FORMAT is set if H->format is. */
+HEATSHRINK_CONTAINER_RES heatshrink_container_write_header(
+    const heatshrink_container_header *h,
+    uint8_t *buf, size_t buf_size, size_t *output_size);
+
+/* Parse a header from the first SIZE bytes of BUF, setting *HEADER_SIZE
+ * to the number of bytes it used. Returns HSZR_MORE if SIZE is too short,
+ * and HSZR_ERROR_BAD_MAGIC if BUF doesn't start with a container. */
+HEATSHRINK_CONTAINER_RES heatshrink_container_read_header(const uint8_t *buf,
+    size_t size, heatshrink_container_header *h, size_t *header_size);
+
+#if HEATSHRINK_DYNAMIC_ALLOC
+/* Allocate a decoder with H's window and lookahead sizes and format.
+ * Returns NULL on error. (With static allocation, check H against
+ * HEATSHRINK_STATIC_WINDOW_BITS, HEATSHRINK_STATIC_LOOKAHEAD_BITS and
+ * HEATSHRINK_STATIC_FORMAT.) */
+heatshrink_decoder *heatshrink_container_alloc_decoder(
+    const heatshrink_container_header *h, uint16_t input_buffer_size);
+#endif
+
+#endif
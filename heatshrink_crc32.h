@@ -0,0 +1,12 @@
+#ifndef HEATSHRINK_CRC32_H
+#define HEATSHRINK_CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32 (the polynomial used by zlib, PNG, etc.). Start with a CRC of 0
+ * and pass the result of each call into the next, to checksum data that
+ * arrives in pieces. */
+uint32_t heatshrink_crc32(uint32_t crc, const uint8_t *buf, size_t size);
+
+#endif
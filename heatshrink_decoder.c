@@ -1,14 +1,36 @@
+#include "heatshrink_config.h"
+/* Static decoders always keep the window in their buffer. */
+#define MIRRORED_WINDOW (HEATSHRINK_USE_MIRRORED_WINDOW && HEATSHRINK_DYNAMIC_ALLOC)
+#if MIRRORED_WINDOW
+#define _GNU_SOURCE             /* memfd_create */
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #include <stdlib.h>
 #include <string.h>
 #include "heatshrink_decoder.h"
+#include "heatshrink_format.h"
 
 typedef enum {
     HSDS_EMPTY,
     HSDS_INPUT_AVAILABLE,
     HSDS_YIELD_LITERAL,
+    HSDS_BACKREF_REPEAT,
     HSDS_BACKREF_INDEX,
     HSDS_BACKREF_COUNT,
+    HSDS_BACKREF_LONG,
     HSDS_YIELD_BACKREF,
+    HSDS_LITERAL_RUN,
+    HSDS_YIELD_RUN,
+    HSDS_SEQ_TOKEN,
+    HSDS_SEQ_LITERAL_COUNT,
+    HSDS_SEQ_OFFSET,
+    HSDS_SEQ_MATCH_COUNT,
+    HSDS_RC_TAG,
+    HSDS_RC_LITERAL,
+    HSDS_RC_INDEX,
+    HSDS_RC_COUNT,
+    HSDS_RC_END,
     HSDS_CHECK_FOR_MORE_INPUT,
 } HEATSHRINK_DECODER_STATE;
 
@@ -22,9 +44,22 @@ static const char *state_names[] = {
     "empty",
     "input_available",
     "yield_literal",
+    "backref_repeat",
     "backref_index",
     "backref_count",
+    "backref_long",
     "yield_backref",
+    "literal_run",
+    "yield_run",
+    "seq_token",
+    "seq_literal_count",
+    "seq_offset",
+    "seq_match_count",
+    "rc_tag",
+    "rc_literal",
+    "rc_index",
+    "rc_count",
+    "rc_end",
     "check_for_more_input",
 };
 #else
@@ -33,16 +68,95 @@ static const char *state_names[] = {
 #endif
 
 typedef struct {
-    uint8_t *buf;               /* output buffer */
+    uint8_t *buf;               /* output buffer, or NULL to discard */
     size_t buf_size;            /* buffer size */
-    uint16_t *output_size;      /* bytes pushed to buffer, so far */
+    size_t *output_size;        /* bytes pushed to buffer, so far */
 } output_info;
 
+#define NO_BITS ((uint32_t)-1)
+
+#if MIRRORED_WINDOW
+#define WINDOW_IS_MIRRORED(HSD) ((HSD)->mirror != NULL)
+#define WINDOW(HSD) (WINDOW_IS_MIRRORED(HSD) ? (HSD)->mirror \
+        : &(HSD)->buffers[HEATSHRINK_DECODER_INPUT_BUFFER_SIZE(HSD)])
+#else
+#define WINDOW_IS_MIRRORED(HSD) 0
+#define WINDOW(HSD) (&(HSD)->buffers[HEATSHRINK_DECODER_INPUT_BUFFER_SIZE(HSD)])
+#endif
+
+/* Windows at least this large are unlikely to stay in L1, so backref
+ * sources are prefetched as soon as their offset is known. */
+#define PREFETCH_WINDOW_BITS 14
+
+#ifdef __GNUC__
+#define PREFETCH(P) __builtin_prefetch(P)
+#else
+#define PREFETCH(P) ((void)(P))
+#endif
+
+/* Window offset where copies have to wrap around to the start. A mirrored
+ * window can be read or written contiguously past its end. */
+#define WINDOW_END(HSD) \
+    ((size_t)(WINDOW_IS_MIRRORED(HSD) ? 2 : 1) << HEATSHRINK_DECODER_WINDOW_BITS(HSD))
+
 /* Forward references. */
 static uint32_t get_bits(heatshrink_decoder *hsd, uint8_t count);
+static uint8_t read_extended_backref(heatshrink_decoder *hsd, uint64_t bits,
+    uint32_t *neg_offset, uint32_t *count);
+static uint8_t get_varlen(heatshrink_decoder *hsd,
+    uint8_t (*read)(uint64_t, uint8_t, uint8_t, uint32_t *),
+    uint8_t sz2, uint32_t *value);
+static uint8_t get_aligned(heatshrink_decoder *hsd,
+    uint8_t (*read)(uint64_t, uint8_t, uint8_t, uint32_t *),
+    uint8_t width, uint32_t *value);
+static int input_exhausted(heatshrink_decoder *hsd);
+static const uint8_t *raw_input(heatshrink_decoder *hsd, size_t *size);
+static void skip_raw_input(heatshrink_decoder *hsd, size_t n);
+static void refill_bits(heatshrink_decoder *hsd);
+static uint64_t read_be64(const uint8_t *in);
+static size_t load_bits(heatshrink_decoder *hsd, const uint8_t *in, size_t avail);
+static void decode_fast(heatshrink_decoder *hsd, output_info *oi);
+static void decode_aligned(heatshrink_decoder *hsd, output_info *oi);
 static void push_byte(heatshrink_decoder *hsd, output_info *oi, uint8_t byte);
+static void prefetch_backref(heatshrink_decoder *hsd, uint16_t neg_offset);
+static void expand_backref(uint8_t *out, const uint8_t *window, size_t end,
+    uint16_t mask, uint16_t head, uint16_t neg_offset, size_t count);
+static void window_append(uint8_t *window, size_t end, uint16_t mask,
+    uint16_t head, const uint8_t *src, size_t count);
+static void repeat_pattern(uint8_t *out, size_t period, size_t count);
+static void window_repeat(uint8_t *window, size_t end, uint16_t mask,
+    uint16_t head, uint16_t neg_offset, size_t count);
 
 #if HEATSHRINK_DYNAMIC_ALLOC
+#if MIRRORED_WINDOW
+/* Map SIZE bytes of shared memory at two adjacent addresses, so a copy
+ * running off the end of the first view continues at the start of the
+ * window. Returns NULL if that isn't possible. */
+static uint8_t *map_mirrored(size_t size) {
+    long page = sysconf(_SC_PAGESIZE);
+    if (page <= 0 || size < (size_t)page || size % page != 0) return NULL;
+
+    int fd = memfd_create("heatshrink_window", MFD_CLOEXEC);
+    if (fd == -1) return NULL;
+    uint8_t *base = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        /* Reserve both halves, then map the same pages over each. */
+        base = mmap(NULL, 2*size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (base != MAP_FAILED) {
+        int prot = PROT_READ | PROT_WRITE;
+        int flags = MAP_SHARED | MAP_FIXED;
+        if (mmap(base, size, prot, flags, fd, 0) == MAP_FAILED
+            || mmap(base + size, size, prot, flags, fd, 0) == MAP_FAILED) {
+            munmap(base, 2*size);
+            base = MAP_FAILED;
+        }
+    }
+    close(fd);
+    return base == MAP_FAILED ? NULL : base;
+}
+#endif
+
 heatshrink_decoder *heatshrink_decoder_alloc(uint16_t input_buffer_size,
                                              uint8_t window_sz2,
                                              uint8_t lookahead_sz2) {
@@ -53,40 +167,107 @@ heatshrink_decoder *heatshrink_decoder_alloc(uint16_t input_buffer_size,
         (lookahead_sz2 > window_sz2)) {
         return NULL;
     }
-    size_t buffers_sz = (1 << window_sz2) + input_buffer_size;
+    size_t window_sz = 1 << window_sz2;
+#if MIRRORED_WINDOW
+    uint8_t *mirror = map_mirrored(window_sz);
+    if (mirror != NULL) window_sz = 0;  /* not in buffers */
+#endif
+    size_t buffers_sz = window_sz + input_buffer_size;
     size_t sz = sizeof(heatshrink_decoder) + buffers_sz;
     heatshrink_decoder *hsd = HEATSHRINK_MALLOC(sz);
-    if (hsd == NULL) return NULL;
+    if (hsd == NULL) {
+#if MIRRORED_WINDOW
+        if (mirror != NULL) munmap(mirror, 2 << window_sz2);
+#endif
+        return NULL;
+    }
     hsd->input_buffer_size = input_buffer_size;
     hsd->window_sz2 = window_sz2;
     hsd->lookahead_sz2 = lookahead_sz2;
+    hsd->format = HEATSHRINK_FORMAT_CLASSIC;
+#if MIRRORED_WINDOW
+    hsd->mirror = mirror;
+#endif
     heatshrink_decoder_reset(hsd);
     LOG("-- allocated decoder with buffer size of %zu (%zu + %u + %u)\n",
-        sz, sizeof(heatshrink_decoder), (1 << window_sz2), input_buffer_size);
+        sz, sizeof(heatshrink_decoder), window_sz, input_buffer_size);
     return hsd;
 }
 
 void heatshrink_decoder_free(heatshrink_decoder *hsd) {
-    size_t buffers_sz = (1 << hsd->window_sz2) + hsd->input_buffer_size;
+    size_t window_sz = 1 << hsd->window_sz2;
+#if MIRRORED_WINDOW
+    if (hsd->mirror != NULL) {
+        munmap(hsd->mirror, 2*window_sz);
+        window_sz = 0;
+    }
+#endif
+    size_t buffers_sz = window_sz + hsd->input_buffer_size;
     size_t sz = sizeof(heatshrink_decoder) + buffers_sz;
     HEATSHRINK_FREE(hsd, sz);
     (void)sz;   /* may not be used by free */
 }
+
+HEATSHRINK_DECODER_SINK_RES heatshrink_decoder_set_format(
+        heatshrink_decoder *hsd, uint8_t format) {
+    if (hsd == NULL) return HSDR_SINK_ERROR_NULL;
+    if (!heatshrink_format_supported(format)
+        || !heatshrink_format_fits(format, HEATSHRINK_DECODER_WINDOW_BITS(hsd),
+            HEATSHRINK_DECODER_LOOKAHEAD_BITS(hsd))) {
+        return HSDR_SINK_ERROR_MISUSE;
+    }
+    if (hsd->state != HSDS_EMPTY || hsd->input_size > 0 || hsd->bit_count > 0) {
+        return HSDR_SINK_ERROR_MISUSE;
+    }
+    hsd->format = format;
+    return HSDR_SINK_OK;
+}
 #endif
 
 void heatshrink_decoder_reset(heatshrink_decoder *hsd) {
     size_t buf_sz = 1 << HEATSHRINK_DECODER_WINDOW_BITS(hsd);
     size_t input_sz = HEATSHRINK_DECODER_INPUT_BUFFER_SIZE(hsd);
-    memset(hsd->buffers, 0, buf_sz + input_sz);
+    memset(hsd->buffers, 0, input_sz);
+    memset(WINDOW(hsd), 0, buf_sz);
     hsd->state = HSDS_EMPTY;
     hsd->input_size = 0;
     hsd->input_index = 0;
-    hsd->bit_index = 0x00;
-    hsd->current_byte = 0x00;
+    hsd->bit_buffer = 0;
+    hsd->bit_count = 0;
+    hsd->span = NULL;
+    hsd->span_size = 0;
     hsd->output_count = 0;
     hsd->output_index = 0;
+    hsd->last_offset = HEATSHRINK_REPEAT_INITIAL_OFFSET;
+    hsd->literal_streak = 0;
+    hsd->token = 0;
     hsd->head_index = 0;
-    hsd->bit_accumulator = 0x00000000;
+#if HEATSHRINK_USE_ENTROPY_CODER
+    heatshrink_entropy_init(&hsd->model);
+    hsd->rc_low = 0;
+    hsd->rc_range = UINT32_MAX;
+    hsd->rc_code = 0;
+    hsd->rc_field = 0;
+    hsd->rc_field_bits = 0;
+    hsd->rc_loaded = 0;
+#endif
+}
+
+HEATSHRINK_DECODER_SINK_RES heatshrink_decoder_prime(heatshrink_decoder *hsd,
+        const uint8_t *dict, size_t size) {
+    if ((hsd == NULL) || (dict == NULL && size > 0)) return HSDR_SINK_ERROR_NULL;
+    if (hsd->state != HSDS_EMPTY || hsd->head_index != 0) {
+        return HSDR_SINK_ERROR_MISUSE;
+    }
+
+    size_t window_sz = 1 << HEATSHRINK_DECODER_WINDOW_BITS(hsd);
+    if (size > window_sz) {
+        dict += size - window_sz;
+        size = window_sz;
+    }
+    window_append(WINDOW(hsd), WINDOW_END(hsd), window_sz - 1, 0, dict, size);
+    hsd->head_index = size;
+    return HSDR_SINK_OK;
 }
 
 /* Copy SIZE bytes into the decoder's input buffer, if it will fit. */
@@ -121,26 +302,65 @@ HEATSHRINK_DECODER_SINK_RES heatshrink_decoder_sink(heatshrink_decoder *hsd,
 #define BACKREF_COUNT_BITS(HSD) (HEATSHRINK_DECODER_LOOKAHEAD_BITS(HSD))
 #define BACKREF_INDEX_BITS(HSD) (HEATSHRINK_DECODER_WINDOW_BITS(HSD))
 
+#define USES_VARLEN(HSD) (HEATSHRINK_USE_EXTENDED_FORMATS \
+        && (HEATSHRINK_DECODER_FORMAT(HSD) & HEATSHRINK_FORMAT_VARLEN))
+#define USES_REPEAT(HSD) (HEATSHRINK_USE_EXTENDED_FORMATS \
+        && (HEATSHRINK_DECODER_FORMAT(HSD) & HEATSHRINK_FORMAT_REPEAT))
+#define USES_LONG(HSD) (HEATSHRINK_USE_EXTENDED_FORMATS \
+        && (HEATSHRINK_DECODER_FORMAT(HSD) & HEATSHRINK_FORMAT_LONG))
+#define USES_LITERAL_RUNS(HSD) (HEATSHRINK_USE_EXTENDED_FORMATS \
+        && (HEATSHRINK_DECODER_FORMAT(HSD) & HEATSHRINK_FORMAT_LITERAL_RUNS))
+#define USES_ALIGNED(HSD) (HEATSHRINK_USE_EXTENDED_FORMATS \
+        && (HEATSHRINK_DECODER_FORMAT(HSD) & HEATSHRINK_FORMAT_ALIGNED))
+#define USES_ENTROPY(HSD) (HEATSHRINK_USE_EXTENDED_FORMATS \
+        && HEATSHRINK_USE_ENTROPY_CODER \
+        && (HEATSHRINK_DECODER_FORMAT(HSD) & HEATSHRINK_FORMAT_ENTROPY))
+#define USES_EXTENDED(HSD) (HEATSHRINK_USE_EXTENDED_FORMATS \
+        && HEATSHRINK_DECODER_FORMAT(HSD) != HEATSHRINK_FORMAT_CLASSIC)
+
+/* Bits needed to decode any whole token (tag + literal, or tag + index +
+ * count) from one peek. */
+#define LITERAL_TOKEN_BITS 9
+#define BACKREF_TOKEN_BITS(HSD) \
+    (1 + BACKREF_INDEX_BITS(HSD) + BACKREF_COUNT_BITS(HSD))
+#define MAX_BACKREF_TOKEN_BITS(HSD) ((USES_REPEAT(HSD) ? 1 : 0) \
+        + (USES_LONG(HSD) ? HEATSHRINK_LONG_EXTRA_MAX_BITS : 0) \
+        + (USES_VARLEN(HSD) \
+            ? 1 + HEATSHRINK_VARLEN_OFFSET_MAX_BITS(BACKREF_INDEX_BITS(HSD)) \
+                + HEATSHRINK_VARLEN_COUNT_MAX_BITS(BACKREF_COUNT_BITS(HSD)) \
+            : BACKREF_TOKEN_BITS(HSD)))
+#define TOKEN_BITS(HSD) (MAX_BACKREF_TOKEN_BITS(HSD) > LITERAL_TOKEN_BITS \
+        ? MAX_BACKREF_TOKEN_BITS(HSD) : LITERAL_TOKEN_BITS)
+
 // States
-static HEATSHRINK_DECODER_STATE st_input_available(heatshrink_decoder *hsd);
+static HEATSHRINK_DECODER_STATE st_input_available(heatshrink_decoder *hsd,
+    output_info *oi);
 static HEATSHRINK_DECODER_STATE st_yield_literal(heatshrink_decoder *hsd,
     output_info *oi);
+static HEATSHRINK_DECODER_STATE st_backref_repeat(heatshrink_decoder *hsd);
 static HEATSHRINK_DECODER_STATE st_backref_index(heatshrink_decoder *hsd);
 static HEATSHRINK_DECODER_STATE st_backref_count(heatshrink_decoder *hsd);
+static HEATSHRINK_DECODER_STATE st_backref_long(heatshrink_decoder *hsd);
 static HEATSHRINK_DECODER_STATE st_yield_backref(heatshrink_decoder *hsd,
     output_info *oi);
+static HEATSHRINK_DECODER_STATE st_literal_run(heatshrink_decoder *hsd);
+static HEATSHRINK_DECODER_STATE st_yield_run(heatshrink_decoder *hsd,
+    output_info *oi);
+static HEATSHRINK_DECODER_STATE st_seq_token(heatshrink_decoder *hsd);
+static HEATSHRINK_DECODER_STATE st_seq_literal_count(heatshrink_decoder *hsd);
+static HEATSHRINK_DECODER_STATE st_seq_offset(heatshrink_decoder *hsd);
+static HEATSHRINK_DECODER_STATE st_seq_match_count(heatshrink_decoder *hsd);
+static HEATSHRINK_DECODER_STATE st_rc_tag(heatshrink_decoder *hsd);
+static HEATSHRINK_DECODER_STATE st_rc_literal(heatshrink_decoder *hsd,
+    output_info *oi);
+static HEATSHRINK_DECODER_STATE st_rc_index(heatshrink_decoder *hsd);
+static HEATSHRINK_DECODER_STATE st_rc_count(heatshrink_decoder *hsd);
+static HEATSHRINK_DECODER_STATE st_rc_end(heatshrink_decoder *hsd);
+static HEATSHRINK_DECODER_STATE after_literal(heatshrink_decoder *hsd);
 static HEATSHRINK_DECODER_STATE st_check_for_input(heatshrink_decoder *hsd);
 
-HEATSHRINK_DECODER_POLL_RES heatshrink_decoder_poll(heatshrink_decoder *hsd,
-        uint8_t *out_buf, size_t out_buf_size, uint16_t *output_size) {
-    if ((hsd == NULL) || (out_buf == NULL) || (output_size == NULL)) return HSDR_POLL_ERROR_NULL;
-    *output_size = 0;
-
-    output_info oi;
-    oi.buf = out_buf;
-    oi.buf_size = out_buf_size;
-    oi.output_size = output_size;
-
+static HEATSHRINK_DECODER_POLL_RES poll(heatshrink_decoder *hsd,
+        output_info *oi) {
     while (1) {
         LOG("-- poll, state is %d (%s), input_size %d\n",
             hsd->state, state_names[hsd->state], hsd->input_size);
@@ -149,10 +369,14 @@ HEATSHRINK_DECODER_POLL_RES heatshrink_decoder_poll(heatshrink_decoder *hsd,
         case HSDS_EMPTY:
             return HSDR_POLL_EMPTY;
         case HSDS_INPUT_AVAILABLE:
-            hsd->state = st_input_available(hsd);
+            if (oi->buf != NULL) decode_fast(hsd, oi);
+            hsd->state = st_input_available(hsd, oi);
             break;
         case HSDS_YIELD_LITERAL:
-            hsd->state = st_yield_literal(hsd, &oi);
+            hsd->state = st_yield_literal(hsd, oi);
+            break;
+        case HSDS_BACKREF_REPEAT:
+            hsd->state = st_backref_repeat(hsd);
             break;
         case HSDS_BACKREF_INDEX:
             hsd->state = st_backref_index(hsd);
@@ -160,8 +384,44 @@ HEATSHRINK_DECODER_POLL_RES heatshrink_decoder_poll(heatshrink_decoder *hsd,
         case HSDS_BACKREF_COUNT:
             hsd->state = st_backref_count(hsd);
             break;
+        case HSDS_BACKREF_LONG:
+            hsd->state = st_backref_long(hsd);
+            break;
         case HSDS_YIELD_BACKREF:
-            hsd->state = st_yield_backref(hsd, &oi);
+            hsd->state = st_yield_backref(hsd, oi);
+            break;
+        case HSDS_LITERAL_RUN:
+            hsd->state = st_literal_run(hsd);
+            break;
+        case HSDS_YIELD_RUN:
+            hsd->state = st_yield_run(hsd, oi);
+            break;
+        case HSDS_SEQ_TOKEN:
+            hsd->state = st_seq_token(hsd);
+            break;
+        case HSDS_SEQ_LITERAL_COUNT:
+            hsd->state = st_seq_literal_count(hsd);
+            break;
+        case HSDS_SEQ_OFFSET:
+            hsd->state = st_seq_offset(hsd);
+            break;
+        case HSDS_SEQ_MATCH_COUNT:
+            hsd->state = st_seq_match_count(hsd);
+            break;
+        case HSDS_RC_TAG:
+            hsd->state = st_rc_tag(hsd);
+            break;
+        case HSDS_RC_LITERAL:
+            hsd->state = st_rc_literal(hsd, oi);
+            break;
+        case HSDS_RC_INDEX:
+            hsd->state = st_rc_index(hsd);
+            break;
+        case HSDS_RC_COUNT:
+            hsd->state = st_rc_count(hsd);
+            break;
+        case HSDS_RC_END:
+            hsd->state = st_rc_end(hsd);
             break;
         case HSDS_CHECK_FOR_MORE_INPUT:
             hsd->state = st_check_for_input(hsd);
@@ -173,15 +433,325 @@ HEATSHRINK_DECODER_POLL_RES heatshrink_decoder_poll(heatshrink_decoder *hsd,
         /* If the current state cannot advance, check if input or output
          * buffer are exhausted. */
         if (hsd->state == in_state) {
-            if (*output_size == out_buf_size) return HSDR_POLL_MORE;
+            if (*oi->output_size == oi->buf_size) return HSDR_POLL_MORE;
             return HSDR_POLL_EMPTY;
         }
     }
 }
 
-static HEATSHRINK_DECODER_STATE st_input_available(heatshrink_decoder *hsd) {
-    uint32_t bits = get_bits(hsd, 1);  // get tag bit
-    return bits ? HSDS_YIELD_LITERAL : HSDS_BACKREF_INDEX;
+HEATSHRINK_DECODER_POLL_RES heatshrink_decoder_poll(heatshrink_decoder *hsd,
+        uint8_t *out_buf, size_t out_buf_size, uint16_t *output_size) {
+    if ((hsd == NULL) || (out_buf == NULL) || (output_size == NULL)) return HSDR_POLL_ERROR_NULL;
+
+    /* *OUTPUT_SIZE can't count past UINT16_MAX. */
+    if (out_buf_size > UINT16_MAX) out_buf_size = UINT16_MAX;
+
+    size_t produced = 0;
+    output_info oi;
+    oi.buf = out_buf;
+    oi.buf_size = out_buf_size;
+    oi.output_size = &produced;
+
+    HEATSHRINK_DECODER_POLL_RES res = poll(hsd, &oi);
+    *output_size = produced;
+    return res;
+}
+
+HEATSHRINK_DECODER_POLL_RES heatshrink_decoder_skip(heatshrink_decoder *hsd,
+        size_t n, size_t *skipped) {
+    if ((hsd == NULL) || (skipped == NULL)) return HSDR_POLL_ERROR_NULL;
+    *skipped = 0;
+
+    output_info oi;
+    oi.buf = NULL;
+    oi.buf_size = n;
+    oi.output_size = skipped;
+    return poll(hsd, &oi);
+}
+
+HEATSHRINK_DECODER_POLL_RES heatshrink_decoder_poll_span(heatshrink_decoder *hsd,
+        const uint8_t *in_buf, size_t in_size, size_t *input_size,
+        uint8_t *out_buf, size_t out_buf_size, size_t *output_size) {
+    if ((hsd == NULL) || (in_buf == NULL) || (input_size == NULL)
+        || (out_buf == NULL) || (output_size == NULL)) {
+        return HSDR_POLL_ERROR_NULL;
+    }
+    *output_size = 0;
+
+    output_info oi;
+    oi.buf = out_buf;
+    oi.buf_size = out_buf_size;
+    oi.output_size = output_size;
+
+    /* Read straight from the caller's buffer for the duration of the call.
+     * Whatever has been loaded into the bit buffer when it returns (at most
+     * one partial field) carries over to the next call. */
+    hsd->span = in_buf;
+    hsd->span_size = in_size;
+    if (hsd->state == HSDS_EMPTY && in_size > 0) {
+        hsd->state = HSDS_INPUT_AVAILABLE;
+    }
+
+    HEATSHRINK_DECODER_POLL_RES res = poll(hsd, &oi);
+    *input_size = in_size - hsd->span_size;
+    hsd->span = NULL;
+    hsd->span_size = 0;
+    LOG("-- poll_span: consumed %zu of %zu, produced %zu\n",
+        *input_size, in_size, *output_size);
+    return res;
+}
+
+/* Output each stream produces before the next one gets a turn (or a
+ * maximal backref, if that's longer). */
+#define STREAM_TURN_SIZE 4096
+
+HEATSHRINK_DECODER_POLL_RES heatshrink_decoder_poll_streams(
+        heatshrink_decoder_stream *streams, size_t count) {
+    if (streams == NULL) return HSDR_POLL_ERROR_NULL;
+    for (size_t i = 0; i < count; i++) streams[i].res = HSDR_POLL_MORE;
+
+    size_t active;
+    do {
+        active = 0;
+        for (size_t i = 0; i < count; i++) {
+            heatshrink_decoder_stream *s = &streams[i];
+            if (s->res != HSDR_POLL_MORE || s->out_size == 0) continue;
+
+            size_t chunk = STREAM_TURN_SIZE;
+            if (s->hsd != NULL) {
+                size_t max_count = (size_t)1 << BACKREF_COUNT_BITS(s->hsd);
+                if (chunk < max_count) chunk = max_count;
+            }
+            if (chunk > s->out_size) chunk = s->out_size;
+
+            size_t in_count = 0;
+            size_t out_count = 0;
+            s->res = heatshrink_decoder_poll_span(s->hsd, s->in_buf, s->in_size,
+                &in_count, s->out_buf, chunk, &out_count);
+            if (s->res < 0) return s->res;
+            s->in_buf += in_count;
+            s->in_size -= in_count;
+            s->out_buf += out_count;
+            s->out_size -= out_count;
+            if (s->res == HSDR_POLL_MORE && s->out_size > 0) active++;
+        }
+        LOG("-- poll_streams: %zu of %zu streams still active\n", active, count);
+    } while (active > 0);
+
+    for (size_t i = 0; i < count; i++) {
+        if (streams[i].res == HSDR_POLL_MORE) return HSDR_POLL_MORE;
+    }
+    return HSDR_POLL_EMPTY;
+}
+
+static HEATSHRINK_DECODER_STATE st_input_available(heatshrink_decoder *hsd,
+        output_info *oi) {
+    if (USES_ALIGNED(hsd)) {
+        return input_exhausted(hsd) ? HSDS_EMPTY : HSDS_SEQ_TOKEN;
+    }
+    if (USES_ENTROPY(hsd)) return HSDS_RC_TAG;
+    /* The fast path can stop just ahead of a run code. */
+    if (hsd->literal_streak == HEATSHRINK_LITERAL_RUN_AFTER) {
+        return HSDS_LITERAL_RUN;
+    }
+
+    uint8_t token_bits = TOKEN_BITS(hsd);
+    if (hsd->bit_count < token_bits) refill_bits(hsd);
+
+    /* Near the end of the input, step through the fields one at a time. */
+    if (hsd->bit_count < token_bits) {
+        uint32_t bits = get_bits(hsd, 1);  // get tag bit
+        if (bits == NO_BITS) {
+            /* A literal run can take the fast path to the end. */
+            return input_exhausted(hsd) ? HSDS_EMPTY : HSDS_INPUT_AVAILABLE;
+        }
+        if (bits) return HSDS_YIELD_LITERAL;
+        hsd->literal_streak = 0;
+        return USES_REPEAT(hsd) ? HSDS_BACKREF_REPEAT : HSDS_BACKREF_INDEX;
+    }
+
+    /* Otherwise, resolve the whole token from a single peek. */
+    uint64_t peek = hsd->bit_buffer;
+    if (peek >> 63) {           /* literal */
+        if (*oi->output_size == oi->buf_size) {
+            get_bits(hsd, 1);   /* no room yet; wait in yield_literal */
+            return HSDS_YIELD_LITERAL;
+        }
+        uint8_t c = (peek >> (64 - LITERAL_TOKEN_BITS)) & 0xFF;
+        hsd->bit_buffer <<= LITERAL_TOKEN_BITS;
+        hsd->bit_count -= LITERAL_TOKEN_BITS;
+
+        uint8_t *buf = WINDOW(hsd);
+        uint16_t mask = (1 << HEATSHRINK_DECODER_WINDOW_BITS(hsd))  - 1;
+        LOG("-- emitting literal byte 0x%02x ('%c')\n", c, isprint(c) ? c : '.');
+        buf[hsd->head_index++ & mask] = c;
+        push_byte(hsd, oi, c);
+        return after_literal(hsd);
+    }
+    hsd->literal_streak = 0;
+    if (USES_EXTENDED(hsd)) {
+        uint32_t neg_offset = 0, count = 0;
+        uint8_t used = read_extended_backref(hsd, peek, &neg_offset, &count);
+        hsd->last_offset = neg_offset;
+        hsd->output_index = neg_offset;
+        hsd->output_count = count;
+        hsd->bit_buffer <<= used;
+        hsd->bit_count -= used;
+        prefetch_backref(hsd, hsd->output_index);
+        LOG("-- extended backref token, -%u for %u bytes\n",
+            hsd->output_index, hsd->output_count);
+        return HSDS_YIELD_BACKREF;
+    } else {                    /* backref */
+        uint8_t index_bits = BACKREF_INDEX_BITS(hsd);
+        uint8_t count_bits = BACKREF_COUNT_BITS(hsd);
+        hsd->output_index = ((peek << 1) >> (64 - index_bits)) + 1;
+        hsd->output_count = ((peek << (1 + index_bits)) >> (64 - count_bits)) + 1;
+        hsd->bit_buffer <<= BACKREF_TOKEN_BITS(hsd);
+        hsd->bit_count -= BACKREF_TOKEN_BITS(hsd);
+        prefetch_backref(hsd, hsd->output_index);
+        LOG("-- backref token, -%u for %u bytes\n",
+            hsd->output_index, hsd->output_count);
+        return HSDS_YIELD_BACKREF;
+    }
+}
+
+/* Decode tokens back to back while there is enough input for a bulk refill
+ * and enough output room for the longest backref, keeping the bit buffer,
+ * window head and output position in locals. Stops at the buffer edges,
+ * leaving the rest to the suspendable state machine. */
+static void decode_fast(heatshrink_decoder *hsd, output_info *oi) {
+    if (USES_ALIGNED(hsd)) {
+        decode_aligned(hsd, oi);
+        return;
+    }
+    if (USES_ENTROPY(hsd)) return;  /* only the state machine */
+    const uint8_t *in;
+    size_t avail;
+    if (hsd->input_size > 0) {
+        in = &hsd->buffers[hsd->input_index];
+        avail = hsd->input_size - hsd->input_index;
+    } else {
+        in = hsd->span;
+        avail = hsd->span_size;
+    }
+
+    const uint8_t index_bits = BACKREF_INDEX_BITS(hsd);
+    const uint8_t count_bits = BACKREF_COUNT_BITS(hsd);
+    const uint8_t backref_bits = BACKREF_TOKEN_BITS(hsd);
+    const uint8_t token_bits = TOKEN_BITS(hsd);
+    const int extended = USES_EXTENDED(hsd);
+    const int literal_runs = USES_LITERAL_RUNS(hsd);
+    const size_t max_count = (size_t)1 << count_bits;
+    uint8_t *window = WINDOW(hsd);
+    const size_t end = WINDOW_END(hsd);
+    const uint16_t mask = (1 << HEATSHRINK_DECODER_WINDOW_BITS(hsd)) - 1;
+    const int prefetch = HEATSHRINK_DECODER_WINDOW_BITS(hsd) >= PREFETCH_WINDOW_BITS;
+    uint8_t *out = oi->buf;
+    const size_t out_size = oi->buf_size;
+    size_t out_pos = *oi->output_size;
+    uint16_t head = hsd->head_index;
+    uint64_t bits = hsd->bit_buffer;
+    uint8_t bit_count = hsd->bit_count;
+    uint8_t streak = hsd->literal_streak;
+    const uint8_t *start = in;
+
+    /* After an 8-byte refill, at least 56 bits are buffered, which covers
+     * the widest token for all but the widest extended formats. */
+    if (token_bits > 56) avail = 0;
+    while (avail >= 8 && out_size - out_pos >= max_count) {
+        uint8_t take = (63 - bit_count) >> 3;
+        uint8_t filled = bit_count + 8*take;
+        bits |= (read_be64(in) >> bit_count) & ~(UINT64_MAX >> filled);
+        bit_count = filled;
+        in += take;
+        avail -= take;
+
+        /* Drain as many whole tokens as the refill covers. */
+        do {
+            if (bits >> 63) {       /* literal */
+                uint8_t c = bits >> (64 - LITERAL_TOKEN_BITS);
+                bits <<= LITERAL_TOKEN_BITS;
+                bit_count -= LITERAL_TOKEN_BITS;
+                window[head++ & mask] = c;
+                out[out_pos++] = c;
+                if (literal_runs && ++streak == HEATSHRINK_LITERAL_RUN_AFTER) {
+                    /* Copy the whole run straight from the input, or leave
+                     * it to the state machine if it doesn't all fit. */
+                    uint32_t n = 0;
+                    if (bit_count < HEATSHRINK_LITERAL_RUN_MAX_BITS) goto done;
+                    uint8_t used = heatshrink_literal_run_read(bits, bit_count,
+                        0, &n);
+                    uint8_t buffered = (bit_count - used) / 8;
+                    if (n > out_size - out_pos || n > buffered + avail) goto done;
+                    if (n > 0) used += (bit_count - used) % 8;  /* padding */
+                    bits <<= used;
+                    bit_count -= used;
+                    streak = 0;
+                    if (n == 0) continue;
+
+                    uint32_t i = 0;
+                    for (; i < n && bit_count > 0; i++) {
+                        out[out_pos + i] = bits >> 56;
+                        bits <<= 8;
+                        bit_count -= 8;
+                    }
+                    memcpy(&out[out_pos + i], in, n - i);
+                    in += n - i;
+                    avail -= n - i;
+                    window_append(window, end, mask, head, &out[out_pos], n);
+                    head += n;
+                    out_pos += n;
+                }
+            } else {                /* backref */
+                uint16_t neg_offset;
+                size_t count;
+                streak = 0;
+                if (extended) {
+                    uint32_t v_offset = 0, v_count = 0;
+                    uint8_t used = read_extended_backref(hsd, bits,
+                        &v_offset, &v_count);
+                    /* Leave backrefs that don't fit to the state machine. */
+                    if (v_count > out_size - out_pos) goto done;
+                    neg_offset = v_offset;
+                    count = v_count;
+                    hsd->last_offset = v_offset;
+                    bits <<= used;
+                    bit_count -= used;
+                } else {
+                    neg_offset = ((bits << 1) >> (64 - index_bits)) + 1;
+                    count = ((bits << (1 + index_bits)) >> (64 - count_bits)) + 1;
+                    bits <<= backref_bits;
+                    bit_count -= backref_bits;
+                }
+                if (prefetch && !extended && bit_count >= backref_bits
+                    && !(bits >> 63)) {
+                    /* Overlap the next backref's fetch with this copy. */
+                    uint16_t next = ((bits << 1) >> (64 - index_bits)) + 1;
+                    PREFETCH(&window[(head + count - next) & mask]);
+                }
+                expand_backref(&out[out_pos], window, end, mask, head,
+                    neg_offset, count);
+                window_append(window, end, mask, head, &out[out_pos], count);
+                head += count;
+                out_pos += count;
+            }
+        } while (bit_count >= token_bits && out_size - out_pos >= max_count);
+    }
+
+done:
+    LOG("-- fast path: %zu bytes in, %zu bytes out\n",
+        (size_t)(in - start), out_pos - *oi->output_size);
+    hsd->bit_buffer = bits;
+    hsd->bit_count = bit_count;
+    hsd->literal_streak = streak;
+    hsd->head_index = head;
+    *oi->output_size = out_pos;
+    if (hsd->input_size > 0) {
+        skip_raw_input(hsd, in - start);
+    } else {
+        hsd->span = in;
+        hsd->span_size = avail;
+    }
 }
 
 static HEATSHRINK_DECODER_STATE st_yield_literal(heatshrink_decoder *hsd,
@@ -191,32 +761,81 @@ static HEATSHRINK_DECODER_STATE st_yield_literal(heatshrink_decoder *hsd,
      * itself.)*/
     if (*oi->output_size < oi->buf_size) {
         uint32_t byte = get_bits(hsd, 8);
-        if (byte == (uint32_t)-1) return HSDS_YIELD_LITERAL; /* out of input */
-        uint8_t *buf = &hsd->buffers[HEATSHRINK_DECODER_INPUT_BUFFER_SIZE(hsd)];
+        if (byte == NO_BITS) return HSDS_YIELD_LITERAL; /* out of input */
+        uint8_t *buf = WINDOW(hsd);
         uint16_t mask = (1 << HEATSHRINK_DECODER_WINDOW_BITS(hsd))  - 1;
         uint8_t c = byte & 0xFF;
         LOG("-- emitting literal byte 0x%02x ('%c')\n", c, isprint(c) ? c : '.');
         buf[hsd->head_index++ & mask] = c;
         push_byte(hsd, oi, c);
-        return HSDS_CHECK_FOR_MORE_INPUT;
+        return after_literal(hsd);
     } else {
         return HSDS_YIELD_LITERAL;
     }
 }
 
+/* The window offset for a decoded backref OFFSET. Varlen and aligned
+ * codes can express offsets past the window; in corrupt input, those
+ * wrap around rather than read past it. */
+static uint16_t window_offset(heatshrink_decoder *hsd, uint32_t offset) {
+    uint16_t mask = (1 << HEATSHRINK_DECODER_WINDOW_BITS(hsd)) - 1;
+    return ((offset - 1) & mask) + 1;
+}
+
+static HEATSHRINK_DECODER_STATE st_backref_repeat(heatshrink_decoder *hsd) {
+    uint32_t bit = get_bits(hsd, 1);
+    LOG("-- backref repeat bit, got %u\n", bit);
+    if (bit == NO_BITS) return HSDS_BACKREF_REPEAT;
+    if (!bit) return HSDS_BACKREF_INDEX;
+    hsd->output_index = hsd->last_offset;
+    prefetch_backref(hsd, hsd->output_index);
+    return HSDS_BACKREF_COUNT;
+}
+
 static HEATSHRINK_DECODER_STATE st_backref_index(heatshrink_decoder *hsd) {
-    uint32_t bits = get_bits(hsd, BACKREF_INDEX_BITS(hsd));
-    LOG("-- backref index, got 0x%04x (+1)\n", bits);
-    if (bits == (uint32_t)-1) return HSDS_BACKREF_INDEX;
-    hsd->output_index = bits + 1;
+    if (USES_VARLEN(hsd)) {
+        uint32_t neg_offset;
+        uint8_t used = get_varlen(hsd, heatshrink_varlen_read_offset,
+            BACKREF_INDEX_BITS(hsd), &neg_offset);
+        if (used == 0) return HSDS_BACKREF_INDEX;
+        hsd->output_index = window_offset(hsd, neg_offset);
+    } else {
+        uint32_t bits = get_bits(hsd, BACKREF_INDEX_BITS(hsd));
+        LOG("-- backref index, got 0x%04x (+1)\n", bits);
+        if (bits == NO_BITS) return HSDS_BACKREF_INDEX;
+        hsd->output_index = bits + 1;
+    }
+    hsd->last_offset = hsd->output_index;
+    prefetch_backref(hsd, hsd->output_index);
     return HSDS_BACKREF_COUNT;
 }
 
 static HEATSHRINK_DECODER_STATE st_backref_count(heatshrink_decoder *hsd) {
-    uint32_t bits = get_bits(hsd, BACKREF_COUNT_BITS(hsd));
-    LOG("-- backref count, got 0x%04x (+1)\n", bits);
-    if (bits == (uint32_t)-1) return HSDS_BACKREF_COUNT;
-    hsd->output_count = bits + 1;
+    if (USES_VARLEN(hsd)) {
+        uint32_t count;
+        uint8_t used = get_varlen(hsd, heatshrink_varlen_read_count,
+            BACKREF_COUNT_BITS(hsd), &count);
+        if (used == 0) return HSDS_BACKREF_COUNT;
+        hsd->output_count = count;
+    } else {
+        uint32_t bits = get_bits(hsd, BACKREF_COUNT_BITS(hsd));
+        LOG("-- backref count, got 0x%04x (+1)\n", bits);
+        if (bits == NO_BITS) return HSDS_BACKREF_COUNT;
+        hsd->output_count = bits + 1;
+    }
+    if (USES_LONG(hsd) && hsd->output_count == heatshrink_max_count_code(
+            BACKREF_COUNT_BITS(hsd), USES_VARLEN(hsd))) {
+        return HSDS_BACKREF_LONG;
+    }
+    return HSDS_YIELD_BACKREF;
+}
+
+static HEATSHRINK_DECODER_STATE st_backref_long(heatshrink_decoder *hsd) {
+    uint32_t extra;
+    uint8_t used = get_varlen(hsd, heatshrink_long_read_extra, 0, &extra);
+    if (used == 0) return HSDS_BACKREF_LONG;
+    LOG("-- long backref, %u extra bytes\n", extra);
+    hsd->output_count += extra;
     return HSDS_YIELD_BACKREF;
 }
 
@@ -225,76 +844,642 @@ static HEATSHRINK_DECODER_STATE st_yield_backref(heatshrink_decoder *hsd,
     size_t count = oi->buf_size - *oi->output_size;
     if (count > 0) {
         if (hsd->output_count < count) count = hsd->output_count;
-        uint8_t *buf = &hsd->buffers[HEATSHRINK_DECODER_INPUT_BUFFER_SIZE(hsd)];
+        uint8_t *buf = WINDOW(hsd);
+        size_t end = WINDOW_END(hsd);
         uint16_t mask = (1 << HEATSHRINK_DECODER_WINDOW_BITS(hsd)) - 1;
         uint16_t neg_offset = hsd->output_index;
-        LOG("-- emitting %u bytes from -%u bytes back\n", count, neg_offset);
-        ASSERT(neg_offset < mask + 1);
-        ASSERT(count <= 1 << BACKREF_COUNT_BITS(hsd));
-
-        for (int i=0; i<count; i++) {
-            uint8_t c = buf[(hsd->head_index - neg_offset) & mask];
-            push_byte(hsd, oi, c);
-            buf[hsd->head_index & mask] = c;
-            hsd->head_index++;
-            LOG("  -- ++ 0x%02x\n", c);
+        LOG("-- emitting %zu bytes from -%u bytes back\n", count, neg_offset);
+
+        if (oi->buf == NULL) {  /* skipping: only the window changes */
+            window_repeat(buf, end, mask, hsd->head_index, neg_offset, count);
+        } else {
+            /* Expand into the caller's buffer, then append to the window. */
+            uint8_t *out = &oi->buf[*oi->output_size];
+            expand_backref(out, buf, end, mask, hsd->head_index, neg_offset, count);
+            window_append(buf, end, mask, hsd->head_index, out, count);
         }
+        hsd->head_index += count;
+        *oi->output_size += count;
+
         hsd->output_count -= count;
         if (hsd->output_count == 0) return HSDS_CHECK_FOR_MORE_INPUT;
     }
     return HSDS_YIELD_BACKREF;
 }
 
-static HEATSHRINK_DECODER_STATE st_check_for_input(heatshrink_decoder *hsd) {
-    return (hsd->input_size == 0) ? HSDS_EMPTY : HSDS_INPUT_AVAILABLE;
+/* With HEATSHRINK_FORMAT_LITERAL_RUNS, every few literals in a row are
+ * followed by a run code. */
+static HEATSHRINK_DECODER_STATE after_literal(heatshrink_decoder *hsd) {
+    if (USES_LITERAL_RUNS(hsd)
+        && ++hsd->literal_streak == HEATSHRINK_LITERAL_RUN_AFTER) {
+        return HSDS_LITERAL_RUN;
+    }
+    return HSDS_CHECK_FOR_MORE_INPUT;
 }
-    
-/* Get the next COUNT bits from the input buffer, saving incremental progress.
- * Returns (uint32_t)-1 on end of input, or if more than 31 bits are requested. */
-static uint32_t get_bits(heatshrink_decoder *hsd, uint8_t count) {
-    if (count > 31) return (uint32_t)-1;
-    LOG("-- popping %u bit(s)\n", count);
 
-    /* If we aren't able to get COUNT bits, suspend immediately, because we
-     * don't track how many bits of COUNT we've accumulated before suspend. */
-    if (hsd->input_size == 0) {
-        if (hsd->bit_index < (1 << (count - 1))) return -1;
-    }
+static HEATSHRINK_DECODER_STATE st_literal_run(heatshrink_decoder *hsd) {
+    uint32_t length;
+    uint8_t used = get_varlen(hsd, heatshrink_literal_run_read, 0, &length);
+    if (used == 0) return HSDS_LITERAL_RUN;
+    LOG("-- literal run of %u bytes\n", length);
+    hsd->literal_streak = 0;
+    if (length == 0) return HSDS_CHECK_FOR_MORE_INPUT;
 
-    for (int i = 0; i < count; i++) {
-        if (hsd->bit_index == 0x00) {
-            if (hsd->input_size == 0) {
-                LOG("  -- out of bits, suspending w/ accumulator of %u\n",
-                    hsd->bit_accumulator);
-                return (uint32_t)-1;
-            }
-            hsd->current_byte = hsd->buffers[hsd->input_index++];
-            LOG("  -- pulled byte 0x%02x\n", hsd->current_byte);
-            if (hsd->input_index == hsd->input_size) {
-                hsd->input_index = 0; /* input is exhausted */
-                hsd->input_size = 0;
+    /* The bit buffer only ever takes whole bytes, so the padding is
+     * whatever is left of the current one. */
+    uint8_t padding = hsd->bit_count % 8;
+    hsd->bit_buffer <<= padding;
+    hsd->bit_count -= padding;
+    hsd->output_count = length;
+    return HSDS_YIELD_RUN;
+}
+
+static HEATSHRINK_DECODER_STATE st_yield_run(heatshrink_decoder *hsd,
+        output_info *oi) {
+    uint8_t *window = WINDOW(hsd);
+    size_t end = WINDOW_END(hsd);
+    uint16_t mask = (1 << HEATSHRINK_DECODER_WINDOW_BITS(hsd)) - 1;
+    while (hsd->output_count > 0 && *oi->output_size < oi->buf_size) {
+        /* Bytes already in the bit buffer go first, then the rest are
+         * copied straight from the input. */
+        uint8_t byte;
+        const uint8_t *src = &byte;
+        size_t n = 1;
+        if (hsd->bit_count > 0) {
+            byte = get_bits(hsd, 8);
+        } else {
+            src = raw_input(hsd, &n);
+            if (n == 0) return HSDS_YIELD_RUN;  /* out of input */
+            if (n > hsd->output_count) n = hsd->output_count;
+            if (n > oi->buf_size - *oi->output_size) {
+                n = oi->buf_size - *oi->output_size;
             }
-            hsd->bit_index = 0x80;
         }
-        hsd->bit_accumulator <<= 1;
-        if (hsd->current_byte & hsd->bit_index) {
-            hsd->bit_accumulator |= 0x01;
-            if (0) LOG("  -- got 1, accumulator 0x%04x, bit_index 0x%02x\n",
-                hsd->bit_accumulator, hsd->bit_index);
+        LOG("-- emitting %zu literal run bytes\n", n);
+        window_append(window, end, mask, hsd->head_index, src, n);
+        if (oi->buf != NULL) memcpy(&oi->buf[*oi->output_size], src, n);
+        if (src != &byte) skip_raw_input(hsd, n);
+        hsd->head_index += n;
+        *oi->output_size += n;
+        hsd->output_count -= n;
+    }
+    if (hsd->output_count > 0) return HSDS_YIELD_RUN;
+    return USES_ALIGNED(hsd) ? HSDS_SEQ_OFFSET : HSDS_CHECK_FOR_MORE_INPUT;
+}
+
+/* Read a WIDTH-bit field, for get_aligned. */
+static uint8_t read_fixed(uint64_t bits, uint8_t avail, uint8_t width,
+        uint32_t *value) {
+    if (avail < width) return 0;
+    *value = (uint32_t)(bits >> (64 - width));
+    return width;
+}
+
+static HEATSHRINK_DECODER_STATE st_seq_token(heatshrink_decoder *hsd) {
+    uint32_t token;
+    if (get_aligned(hsd, read_fixed, 8, &token) == 0) return HSDS_SEQ_TOKEN;
+    LOG("-- sequence token 0x%02x\n", token);
+    hsd->token = token;
+    hsd->output_count = token >> 4;
+    if (hsd->output_count == HEATSHRINK_ALIGNED_NIBBLE_MAX) {
+        return HSDS_SEQ_LITERAL_COUNT;
+    }
+    return hsd->output_count > 0 ? HSDS_YIELD_RUN : HSDS_SEQ_OFFSET;
+}
+
+static HEATSHRINK_DECODER_STATE st_seq_literal_count(heatshrink_decoder *hsd) {
+    uint32_t ext;
+    if (get_aligned(hsd, heatshrink_aligned_read_ext, 0, &ext) == 0) {
+        return HSDS_SEQ_LITERAL_COUNT;
+    }
+    hsd->output_count += ext;
+    return HSDS_YIELD_RUN;
+}
+
+static HEATSHRINK_DECODER_STATE st_seq_offset(heatshrink_decoder *hsd) {
+    uint32_t offset;
+    if (get_aligned(hsd, read_fixed, 16, &offset) == 0) return HSDS_SEQ_OFFSET;
+    if (offset == 0) return HSDS_CHECK_FOR_MORE_INPUT;  /* literals only */
+    hsd->output_index = window_offset(hsd, offset);
+    hsd->output_count = (hsd->token & 0x0F) + HEATSHRINK_ALIGNED_MIN_MATCH;
+    prefetch_backref(hsd, hsd->output_index);
+    LOG("-- sequence match at -%u\n", hsd->output_index);
+    if ((hsd->token & 0x0F) == HEATSHRINK_ALIGNED_NIBBLE_MAX) {
+        return HSDS_SEQ_MATCH_COUNT;
+    }
+    return HSDS_YIELD_BACKREF;
+}
+
+static HEATSHRINK_DECODER_STATE st_seq_match_count(heatshrink_decoder *hsd) {
+    uint32_t ext;
+    if (get_aligned(hsd, heatshrink_aligned_read_ext, 0, &ext) == 0) {
+        return HSDS_SEQ_MATCH_COUNT;
+    }
+    hsd->output_count += ext;
+    return HSDS_YIELD_BACKREF;
+}
+
+/* Read an extension from *P (but not past LIM), advancing *P past it.
+ * Returns 0 if it's cut off. */
+static int read_ext(const uint8_t **p, const uint8_t *lim, uint32_t *value) {
+    uint64_t bits = 0;
+    uint8_t n = 0;
+    while (n < HEATSHRINK_ALIGNED_EXT_MAX_BYTES && *p + n < lim) {
+        bits |= (uint64_t)(*p)[n] << (56 - 8*n);
+        n++;
+    }
+    uint8_t used = heatshrink_aligned_read_ext(bits, 8*n, 0, value);
+    *p += used / 8;
+    return used > 0;
+}
+
+#if HEATSHRINK_USE_ENTROPY_CODER
+/* Catch the range decoder up with the encoder's state after the last bit
+ * it coded, reading input as needed. Returns 0 if it needs more. */
+static int rc_normalize(heatshrink_decoder *hsd) {
+    while (hsd->rc_loaded < HEATSHRINK_ENTROPY_FINAL_BYTES
+        || heatshrink_entropy_needs_shift(hsd->rc_low, &hsd->rc_range)) {
+        size_t avail;
+        const uint8_t *in = raw_input(hsd, &avail);
+        if (avail == 0) return 0;
+        hsd->rc_code = (hsd->rc_code << 8) | in[0];
+        skip_raw_input(hsd, 1);
+        if (hsd->rc_loaded < HEATSHRINK_ENTROPY_FINAL_BYTES) {
+            hsd->rc_loaded++;   /* the first bytes fill rc_code */
         } else {
-            if (0) LOG("  -- got 0, accumulator 0x%04x, bit_index 0x%02x\n",
-                hsd->bit_accumulator, hsd->bit_index);
+            hsd->rc_low <<= 8;
+            hsd->rc_range <<= 8;
         }
-        hsd->bit_index >>= 1;
     }
+    return 1;
+}
+
+/* Decode a bit with the adaptive probability PROB. Returns -1 if that
+ * needs more input. */
+static int rc_get_bit(heatshrink_decoder *hsd, uint16_t *prob) {
+    if (!rc_normalize(hsd)) return -1;
+    uint32_t bound = heatshrink_entropy_bound(hsd->rc_range, *prob);
+    int bit = hsd->rc_code - hsd->rc_low >= bound;
+    if (bit) {
+        hsd->rc_low += bound;
+        hsd->rc_range -= bound;
+    } else {
+        hsd->rc_range = bound;
+    }
+    heatshrink_entropy_update(prob, bit);
+    return bit;
+}
+
+/* Decode a BITS-bit field with the field model PROBS (see
+ * heatshrink_entropy_prob), keeping the bits so far if it runs out of
+ * input partway. Returns 0 until the field is complete. */
+static int rc_get_field(heatshrink_decoder *hsd, uint16_t *probs,
+        uint8_t tree_bits, uint8_t bits, uint32_t *value) {
+    while (hsd->rc_field_bits < bits) {
+        uint16_t *prob = heatshrink_entropy_prob(probs, tree_bits,
+            hsd->rc_field_bits, hsd->rc_field);
+        int bit = rc_get_bit(hsd, prob);
+        if (bit < 0) return 0;
+        hsd->rc_field = (hsd->rc_field << 1) | bit;
+        hsd->rc_field_bits++;
+    }
+    *value = hsd->rc_field;
+    hsd->rc_field = 0;
+    hsd->rc_field_bits = 0;
+    return 1;
+}
+
+static HEATSHRINK_DECODER_STATE st_rc_tag(heatshrink_decoder *hsd) {
+    heatshrink_entropy_model *m = &hsd->model;
+    /* rc_field_bits is 1 once the end flag is known to be 0. */
+    if (hsd->rc_field_bits == 0) {
+        int end = rc_get_bit(hsd, &m->end);
+        if (end < 0) return HSDS_RC_TAG;
+        if (end) return HSDS_RC_END;
+        hsd->rc_field_bits = 1;
+    }
+    int tag = rc_get_bit(hsd, &m->tag[m->last_tag]);
+    if (tag < 0) return HSDS_RC_TAG;
+    hsd->rc_field_bits = 0;
+    m->last_tag = tag;
+    return tag == HEATSHRINK_LITERAL_MARKER ? HSDS_RC_LITERAL : HSDS_RC_INDEX;
+}
+
+static HEATSHRINK_DECODER_STATE st_rc_literal(heatshrink_decoder *hsd,
+        output_info *oi) {
+    if (*oi->output_size == oi->buf_size) return HSDS_RC_LITERAL;
+    uint32_t c;
+    if (!rc_get_field(hsd, hsd->model.literal, 8, 8, &c)) {
+        return HSDS_RC_LITERAL;
+    }
+    uint16_t mask = (1 << HEATSHRINK_DECODER_WINDOW_BITS(hsd)) - 1;
+    LOG("-- emitting literal byte 0x%02x ('%c')\n", c, isprint(c) ? c : '.');
+    WINDOW(hsd)[hsd->head_index++ & mask] = c;
+    push_byte(hsd, oi, c);
+    return HSDS_CHECK_FOR_MORE_INPUT;
+}
 
-    uint32_t res = 0;
-    res = hsd->bit_accumulator;
-    hsd->bit_accumulator = 0x00000000;
+static HEATSHRINK_DECODER_STATE st_rc_index(heatshrink_decoder *hsd) {
+    uint8_t bits = BACKREF_INDEX_BITS(hsd);
+    uint32_t index;
+    if (!rc_get_field(hsd, hsd->model.index,
+            heatshrink_entropy_tree_bits(bits), bits, &index)) {
+        return HSDS_RC_INDEX;
+    }
+    hsd->output_index = index + 1;
+    prefetch_backref(hsd, hsd->output_index);
+    return HSDS_RC_COUNT;
+}
+
+static HEATSHRINK_DECODER_STATE st_rc_count(heatshrink_decoder *hsd) {
+    uint8_t bits = BACKREF_COUNT_BITS(hsd);
+    uint32_t count;
+    if (!rc_get_field(hsd, hsd->model.count,
+            heatshrink_entropy_tree_bits(bits), bits, &count)) {
+        return HSDS_RC_COUNT;
+    }
+    hsd->output_count = count + 1;
+    LOG("-- range coded backref, -%u for %u bytes\n",
+        hsd->output_index, hsd->output_count);
+    return HSDS_YIELD_BACKREF;
+}
+
+/* After the end flag, only the bytes the encoder shifted out along with
+ * it are left. */
+static HEATSHRINK_DECODER_STATE st_rc_end(heatshrink_decoder *hsd) {
+    return rc_normalize(hsd) ? HSDS_EMPTY : HSDS_RC_END;
+}
+#else
+/* Never reached: USES_ENTROPY is always false without the coder. */
+static HEATSHRINK_DECODER_STATE st_rc_tag(heatshrink_decoder *hsd) {
+    (void)hsd;
+    return HSDS_RC_TAG;
+}
+static HEATSHRINK_DECODER_STATE st_rc_literal(heatshrink_decoder *hsd,
+        output_info *oi) {
+    (void)hsd; (void)oi;
+    return HSDS_RC_LITERAL;
+}
+static HEATSHRINK_DECODER_STATE st_rc_index(heatshrink_decoder *hsd) {
+    (void)hsd;
+    return HSDS_RC_INDEX;
+}
+static HEATSHRINK_DECODER_STATE st_rc_count(heatshrink_decoder *hsd) {
+    (void)hsd;
+    return HSDS_RC_COUNT;
+}
+static HEATSHRINK_DECODER_STATE st_rc_end(heatshrink_decoder *hsd) {
+    (void)hsd;
+    return HSDS_RC_END;
+}
+#endif
+
+/* Decode whole aligned sequences straight from the input, while they fit
+ * in the input and output. A sequence that doesn't is left entirely to the
+ * state machine, so nothing is ever half done here. */
+static void decode_aligned(heatshrink_decoder *hsd, output_info *oi) {
+    if (hsd->bit_count > 0) return;
+    size_t avail;
+    const uint8_t *in = raw_input(hsd, &avail);
+    const uint8_t *start = in;
+    uint8_t *window = WINDOW(hsd);
+    const size_t end = WINDOW_END(hsd);
+    const uint16_t mask = (1 << HEATSHRINK_DECODER_WINDOW_BITS(hsd)) - 1;
+    uint8_t *out = oi->buf;
+    size_t out_pos = *oi->output_size;
+    uint16_t head = hsd->head_index;
+
+    while (avail > 0) {
+        const uint8_t *p = in;
+        const uint8_t *lim = in + avail;
+        uint8_t token = *p++;
+        uint32_t ext;
+        size_t literals = token >> 4;
+        if (literals == HEATSHRINK_ALIGNED_NIBBLE_MAX) {
+            if (!read_ext(&p, lim, &ext)) break;
+            literals += ext;
+        }
+        /* The last sequence has no offset, so it goes the slow way. */
+        if (literals + 2 > (size_t)(lim - p)) break;
+        const uint8_t *lit = p;
+        p += literals;
+        uint16_t offset = (p[0] << 8) | p[1];
+        p += 2;
+        size_t count = 0;
+        if (offset > 0) {
+            count = (token & 0x0F) + HEATSHRINK_ALIGNED_MIN_MATCH;
+            if ((token & 0x0F) == HEATSHRINK_ALIGNED_NIBBLE_MAX) {
+                if (!read_ext(&p, lim, &ext)) break;
+                count += ext;
+            }
+        }
+        if (literals + count > oi->buf_size - out_pos) break;
+
+        memcpy(&out[out_pos], lit, literals);
+        window_append(window, end, mask, head, lit, literals);
+        head += literals;
+        out_pos += literals;
+        if (count > 0) {
+            uint16_t neg_offset = window_offset(hsd, offset);
+            expand_backref(&out[out_pos], window, end, mask, head,
+                neg_offset, count);
+            window_append(window, end, mask, head, &out[out_pos], count);
+            head += count;
+            out_pos += count;
+        }
+        avail -= p - in;
+        in = p;
+    }
+
+    LOG("-- aligned fast path: %zu bytes in, %zu bytes out\n",
+        (size_t)(in - start), out_pos - *oi->output_size);
+    hsd->head_index = head;
+    *oi->output_size = out_pos;
+    skip_raw_input(hsd, in - start);
+}
+
+static void prefetch_backref(heatshrink_decoder *hsd, uint16_t neg_offset) {
+    if (HEATSHRINK_DECODER_WINDOW_BITS(hsd) < PREFETCH_WINDOW_BITS) return;
+    uint16_t mask = (1 << HEATSHRINK_DECODER_WINDOW_BITS(hsd)) - 1;
+    PREFETCH(&WINDOW(hsd)[(hsd->head_index - neg_offset) & mask]);
+}
+
+/* Copy N bytes forward from SRC to DST, 16 and then 8 bytes at a time.
+ * The regions may only overlap if DST is at least 16 bytes past SRC. */
+static void copy_wide(uint8_t *dst, const uint8_t *src, size_t n) {
+    while (n >= 16) {
+        memcpy(dst, src, 16);
+        dst += 16; src += 16; n -= 16;
+    }
+    if (n >= 8) {
+        memcpy(dst, src, 8);
+        dst += 8; src += 8; n -= 8;
+    }
+    while (n--) *dst++ = *src++;
+}
+
+/* Write the COUNT bytes of a backref NEG_OFFSET bytes back from HEAD to
+ * OUT. The bytes still in the window are copied out first (splitting where
+ * they pass END, see WINDOW_END), and any self-overlapping remainder is
+ * filled in by replicating the OUT prefix. */
+static void expand_backref(uint8_t *out, const uint8_t *window, size_t end,
+        uint16_t mask, uint16_t head, uint16_t neg_offset, size_t count) {
+    size_t from_window = neg_offset < count ? neg_offset : count;
+    uint16_t src = (head - neg_offset) & mask;
+    size_t first = end - src;
+    if (first > from_window) first = from_window;
+    copy_wide(out, &window[src], first);
+    copy_wide(&out[first], window, from_window - first);
+
+    if (from_window < count) repeat_pattern(out, neg_offset, count);
+}
+
+/* Fill OUT[PERIOD..COUNT) by repeating the PERIOD bytes at OUT. */
+static void repeat_pattern(uint8_t *out, size_t period, size_t count) {
+    if (period == 1) {          /* run of a single byte */
+        memset(&out[1], out[0], count - 1);
+    } else if (period >= 16) {
+        copy_wide(&out[period], out, count - period);
+    } else {                    /* short period: double the pattern */
+        size_t filled = period;
+        while (filled < count) {
+            size_t n = count - filled < filled ? count - filled : filled;
+            memcpy(&out[filled], out, n);
+            filled += n;
+        }
+    }
+}
+
+/* Append COUNT bytes from SRC to the window at HEAD, wrapping around at
+ * END. */
+static void window_append(uint8_t *window, size_t end, uint16_t mask,
+        uint16_t head, const uint8_t *src, size_t count) {
+    size_t window_sz = (size_t)mask + 1;
+    if (count > window_sz) {    /* only the last window's worth stays */
+        src += count - window_sz;
+        head += count - window_sz;
+        count = window_sz;
+    }
+    uint16_t dst = head & mask;
+    size_t first = end - dst;
+    if (first > count) first = count;
+    copy_wide(&window[dst], src, first);
+    copy_wide(window, &src[first], count - first);
+}
+
+/* Expand a backref within the window itself, for skipped output. Each
+ * chunk is at most NEG_OFFSET bytes, so a chunk never reads bytes it is
+ * writing, and stops at END on either side. */
+static void window_repeat(uint8_t *window, size_t end, uint16_t mask,
+        uint16_t head, uint16_t neg_offset, size_t count) {
+    while (count > 0) {
+        uint16_t src = (head - neg_offset) & mask;
+        uint16_t dst = head & mask;
+        size_t n = count < neg_offset ? count : neg_offset;
+        if (n > end - src) n = end - src;
+        if (n > end - dst) n = end - dst;
+        memmove(&window[dst], &window[src], n);
+        head += n;
+        count -= n;
+    }
+}
+
+static HEATSHRINK_DECODER_STATE st_check_for_input(heatshrink_decoder *hsd) {
+    /* The range decoder may have whole tokens without more input. */
+    if (USES_ENTROPY(hsd)) return HSDS_RC_TAG;
+    /* A repeat can be shorter than a byte, so the last byte may hold
+     * whole tokens. heatshrink_format_fits keeps the padding from
+     * holding a whole backref, so it still ends as an unfinished one. */
+    if (USES_REPEAT(hsd) && hsd->bit_count > 0) return HSDS_INPUT_AVAILABLE;
+    return input_exhausted(hsd) ? HSDS_EMPTY : HSDS_INPUT_AVAILABLE;
+}
+
+/* Is the remaining input only the unused bits of the last byte? */
+static int input_exhausted(heatshrink_decoder *hsd) {
+    return (hsd->input_size == 0) && (hsd->span_size == 0)
+        && (hsd->bit_count < 8);
+}
+
+/* The input past the bit buffer: the rest of the sunk input, then the
+ * caller's span. Sets *SIZE to how much is there. */
+static const uint8_t *raw_input(heatshrink_decoder *hsd, size_t *size) {
+    if (hsd->input_index < hsd->input_size) {
+        *size = hsd->input_size - hsd->input_index;
+        return &hsd->buffers[hsd->input_index];
+    }
+    hsd->input_index = 0;       /* input is exhausted */
+    hsd->input_size = 0;
+    *size = hsd->span_size;
+    return hsd->span;
+}
+
+/* Consume N bytes from raw_input. */
+static void skip_raw_input(heatshrink_decoder *hsd, size_t n) {
+    if (hsd->input_size > 0) {
+        hsd->input_index += n;
+        if (hsd->input_index == hsd->input_size) {
+            hsd->input_index = 0;   /* input is exhausted */
+            hsd->input_size = 0;
+        }
+    } else {
+        hsd->span += n;
+        hsd->span_size -= n;
+    }
+}
+
+/* Load big-endian bytes from IN into the bit buffer, until it holds at
+ * least 57 bits or AVAIL bytes have been taken. Bits below bit_count are
+ * always kept zeroed, so loads can be OR'd in. Returns the bytes taken. */
+static size_t load_bits(heatshrink_decoder *hsd, const uint8_t *in, size_t avail) {
+    if (avail >= 8) {           /* fast path: one 8-byte load */
+        uint64_t v = read_be64(in);
+        uint8_t take = (63 - hsd->bit_count) >> 3;
+        uint8_t filled = hsd->bit_count + 8*take;
+        hsd->bit_buffer |= (v >> hsd->bit_count) & ~(UINT64_MAX >> filled);
+        hsd->bit_count = filled;
+        return take;
+    }
+
+    size_t taken = 0;
+    while (hsd->bit_count <= 56 && taken < avail) {
+        uint64_t byte = in[taken++];
+        hsd->bit_buffer |= byte << (56 - hsd->bit_count);
+        hsd->bit_count += 8;
+    }
+    return taken;
+}
+
+static uint64_t read_be64(const uint8_t *in) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v = (v << 8) | in[i];
+    return v;
+}
+
+/* Refill the bit buffer from the sunk input, then from the caller's span
+ * (during heatshrink_decoder_poll_span). */
+static void refill_bits(heatshrink_decoder *hsd) {
+    if (hsd->input_size > 0) {
+        hsd->input_index += load_bits(hsd, &hsd->buffers[hsd->input_index],
+            hsd->input_size - hsd->input_index);
+        if (hsd->input_index == hsd->input_size) {
+            hsd->input_index = 0;   /* input is exhausted */
+            hsd->input_size = 0;
+        }
+    }
+    if (hsd->bit_count <= 56 && hsd->span_size > 0) {
+        size_t taken = load_bits(hsd, hsd->span, hsd->span_size);
+        hsd->span += taken;
+        hsd->span_size -= taken;
+    }
+    LOG("  -- refilled bit buffer, %u bits buffered\n", hsd->bit_count);
+}
+
+/* Get the next COUNT bits from the input, as a single field.
+ * Returns NO_BITS on end of input, or if more than 31 bits are requested.
+ * If fewer than COUNT bits are available, nothing is consumed, so a field
+ * that straddles the end of the sunk input is re-read in full once more
+ * input arrives. */
+static uint32_t get_bits(heatshrink_decoder *hsd, uint8_t count) {
+    if (count > 31) return NO_BITS;
+    ASSERT(count > 0);
+    LOG("-- popping %u bit(s)\n", count);
+
+    if (hsd->bit_count < count) {
+        refill_bits(hsd);
+        if (hsd->bit_count < count) {
+            LOG("  -- out of bits, suspending w/ %u bits buffered\n",
+                hsd->bit_count);
+            return NO_BITS;
+        }
+    }
+
+    uint32_t res = (uint32_t)(hsd->bit_buffer >> (64 - count));
+    hsd->bit_buffer <<= count;
+    hsd->bit_count -= count;
     if (count > 1) LOG("  -- accumulated %08x\n", res);
     return res;
 }
 
+/* Resolve the backref token at the top of BITS (tag bit included) in
+ * an extended format, setting *NEG_OFFSET and *COUNT. BITS must hold the
+ * whole token. Returns the bits it used, without consuming them. */
+static uint8_t read_extended_backref(heatshrink_decoder *hsd, uint64_t bits,
+        uint32_t *neg_offset, uint32_t *count) {
+    uint8_t index_bits = BACKREF_INDEX_BITS(hsd);
+    uint8_t count_bits = BACKREF_COUNT_BITS(hsd);
+    uint8_t used = 1;
+    int repeat = 0;
+    if (USES_REPEAT(hsd)) {
+        repeat = (bits << 1) >> 63;
+        used++;
+    }
+
+    if (repeat) {
+        *neg_offset = hsd->last_offset;
+    } else if (USES_VARLEN(hsd)) {
+        used += heatshrink_varlen_read_offset(bits << used, 64 - used,
+            index_bits, neg_offset);
+        *neg_offset = window_offset(hsd, *neg_offset);
+    } else {
+        *neg_offset = ((bits << used) >> (64 - index_bits)) + 1;
+        used += index_bits;
+    }
+
+    if (USES_VARLEN(hsd)) {
+        used += heatshrink_varlen_read_count(bits << used, 64 - used,
+            count_bits, count);
+    } else {
+        *count = ((bits << used) >> (64 - count_bits)) + 1;
+        used += count_bits;
+    }
+
+    if (USES_LONG(hsd)
+        && *count == heatshrink_max_count_code(count_bits, USES_VARLEN(hsd))) {
+        uint32_t extra = 0;
+        used += heatshrink_long_read_extra(bits << used, 64 - used, 0, &extra);
+        *count += extra;
+    }
+    return used;
+}
+
+/* Get the next field of an aligned sequence with READ, loading only
+ * the bytes it needs, so the bit buffer is empty between fields and the
+ * fast path can read sequences straight from the input. Returns the bits
+ * used, or 0 if the whole field isn't there yet. */
+static uint8_t get_aligned(heatshrink_decoder *hsd,
+        uint8_t (*read)(uint64_t, uint8_t, uint8_t, uint32_t *),
+        uint8_t width, uint32_t *value) {
+    uint8_t used;
+    while ((used = read(hsd->bit_buffer, hsd->bit_count, width, value)) == 0) {
+        size_t avail;
+        const uint8_t *in = raw_input(hsd, &avail);
+        if (avail == 0 || hsd->bit_count > 56) return 0;
+        hsd->bit_buffer |= (uint64_t)in[0] << (56 - hsd->bit_count);
+        hsd->bit_count += 8;
+        skip_raw_input(hsd, 1);
+    }
+    hsd->bit_buffer <<= used;
+    hsd->bit_count -= used;
+    return used;
+}
+
+/* Get the next variable-length field with READ (see heatshrink_format.h).
+ * As with get_bits, nothing is consumed if the whole field isn't there
+ * yet. Returns the bits used, or 0. */
+static uint8_t get_varlen(heatshrink_decoder *hsd,
+        uint8_t (*read)(uint64_t, uint8_t, uint8_t, uint32_t *),
+        uint8_t sz2, uint32_t *value) {
+    uint8_t used = read(hsd->bit_buffer, hsd->bit_count, sz2, value);
+    if (used == 0) {
+        refill_bits(hsd);
+        used = read(hsd->bit_buffer, hsd->bit_count, sz2, value);
+        if (used == 0) return 0;
+    }
+    hsd->bit_buffer <<= used;
+    hsd->bit_count -= used;
+    return used;
+}
+
 HEATSHRINK_DECODER_FINISH_RES heatshrink_decoder_finish(heatshrink_decoder *hsd) {
     if (hsd == NULL) return HSDR_FINISH_ERROR_NULL;
     switch (hsd->state) {
@@ -304,9 +1489,15 @@ HEATSHRINK_DECODER_FINISH_RES heatshrink_decoder_finish(heatshrink_decoder *hsd)
     /* If we want to finish with no input, but are in these two states, it's
      * because the 0-bit padding to the last byte looks like a backref
      * marker bit followed by all 0s for index and count bits. */
+    case HSDS_BACKREF_REPEAT:
     case HSDS_BACKREF_INDEX:
     case HSDS_BACKREF_COUNT:
-        return hsd->input_size == 0 ? HSDR_FINISH_DONE : HSDR_FINISH_MORE;
+    case HSDS_LITERAL_RUN:
+    /* Likewise, aligned streams end between sequences, or after the
+     * last one's literals. */
+    case HSDS_SEQ_TOKEN:
+    case HSDS_SEQ_OFFSET:
+        return input_exhausted(hsd) ? HSDR_FINISH_DONE : HSDR_FINISH_MORE;
     /* fall through */
     default:
         return HSDR_FINISH_MORE;
@@ -315,5 +1506,138 @@ HEATSHRINK_DECODER_FINISH_RES heatshrink_decoder_finish(heatshrink_decoder *hsd)
 
 static void push_byte(heatshrink_decoder *hsd, output_info *oi, uint8_t byte) {
     LOG(" -- pushing byte: 0x%02x ('%c')\n", byte, isprint(byte) ? byte : '.');
-    oi->buf[(*oi->output_size)++] = byte;
+    if (oi->buf != NULL) oi->buf[*oi->output_size] = byte;
+    (*oi->output_size)++;
+}
+
+
+/**************************
+ * In-place decompression *
+ **************************/
+
+/* A minimal bit reader over a whole compressed stream. */
+typedef struct {
+    const uint8_t *buf;
+    size_t pos;                 /* next byte to load */
+    size_t end;
+    uint64_t bits;
+    uint8_t count;
+} bit_reader;
+
+static uint32_t read_bits(bit_reader *br, uint8_t count) {
+    while (br->count <= 56 && br->pos < br->end) {
+        br->bits |= (uint64_t)br->buf[br->pos++] << (56 - br->count);
+        br->count += 8;
+    }
+    if (br->count < count) return NO_BITS;
+    uint32_t res = (uint32_t)(br->bits >> (64 - count));
+    br->bits <<= count;
+    br->count -= count;
+    return res;
+}
+
+/* Bits left in the stream, including any 0-bit padding. */
+static size_t bits_left(const bit_reader *br) {
+    return br->count + 8*(br->end - br->pos);
+}
+
+static int in_place_args_ok(uint8_t window_sz2, uint8_t lookahead_sz2) {
+    return (window_sz2 >= HEATSHRINK_MIN_WINDOW_BITS)
+        && (window_sz2 <= HEATSHRINK_MAX_WINDOW_BITS)
+        && (lookahead_sz2 >= HEATSHRINK_MIN_LOOKAHEAD_BITS)
+        && (lookahead_sz2 <= window_sz2);
+}
+
+/* Decode the next token, setting *LITERAL or *NEG_OFFSET and *COUNT.
+ * Returns 0 at the end of the stream, 1 for a token, or -1 if it's
+ * truncated. As in the streaming decoder, fewer than 8 remaining bits are
+ * just the last byte's padding. */
+static int next_token(bit_reader *br, uint8_t window_sz2, uint8_t lookahead_sz2,
+        uint8_t *literal, uint32_t *neg_offset, size_t *count) {
+    if (bits_left(br) < 8) return 0;
+    uint32_t tag = read_bits(br, 1);
+    if (tag == HEATSHRINK_LITERAL_MARKER) {
+        uint32_t byte = read_bits(br, 8);
+        if (byte == NO_BITS) return -1;
+        *literal = byte;
+        *count = 1;
+        *neg_offset = 0;
+        return 1;
+    }
+    uint32_t index = read_bits(br, window_sz2);
+    if (index == NO_BITS) return -1;
+    uint32_t length = read_bits(br, lookahead_sz2);
+    if (length == NO_BITS) return -1;
+    *neg_offset = index + 1;
+    *count = length + 1;
+    return 1;
+}
+
+HEATSHRINK_DECODER_IN_PLACE_RES heatshrink_decoder_in_place_scan(
+        const uint8_t *in_buf, size_t in_size, uint8_t window_sz2,
+        uint8_t lookahead_sz2, size_t *output_size, size_t *margin) {
+    if ((in_buf == NULL) || (output_size == NULL) || (margin == NULL)) {
+        return HSDR_IN_PLACE_ERROR_NULL;
+    }
+    if (!in_place_args_ok(window_sz2, lookahead_sz2)) {
+        return HSDR_IN_PLACE_ERROR_MISUSE;
+    }
+
+    bit_reader br = { in_buf, 0, in_size, 0, 0 };
+    size_t out = 0;
+    size_t lead = 0;            /* max. output past the input consumed */
+    uint8_t literal;
+    uint32_t neg_offset;
+    size_t count;
+    int res;
+    while ((res = next_token(&br, window_sz2, lookahead_sz2,
+                &literal, &neg_offset, &count)) > 0) {
+        if (neg_offset > out) return HSDR_IN_PLACE_ERROR_CORRUPT;
+        out += count;
+        size_t consumed = (8*in_size - bits_left(&br)) / 8;
+        if (out > consumed && out - consumed > lead) lead = out - consumed;
+    }
+    if (res < 0) return HSDR_IN_PLACE_ERROR_CORRUPT;
+
+    /* The input starts IN_SIZE bytes before the end of a buffer of
+     * OUT + MARGIN bytes, and output must never pass the input consumed. */
+    *output_size = out;
+    *margin = in_size + lead > out ? in_size + lead - out : 0;
+    LOG("-- in-place scan: %zu -> %zu bytes, margin %zu\n", in_size, out, *margin);
+    return HSDR_IN_PLACE_OK;
+}
+
+HEATSHRINK_DECODER_IN_PLACE_RES heatshrink_decoder_in_place(uint8_t *buf,
+        size_t buf_size, size_t in_offset, uint8_t window_sz2,
+        uint8_t lookahead_sz2, size_t *output_size) {
+    if ((buf == NULL) || (output_size == NULL)) return HSDR_IN_PLACE_ERROR_NULL;
+    if (!in_place_args_ok(window_sz2, lookahead_sz2) || in_offset > buf_size) {
+        return HSDR_IN_PLACE_ERROR_MISUSE;
+    }
+
+    bit_reader br = { buf, in_offset, buf_size, 0, 0 };
+    size_t out = 0;
+    uint8_t literal;
+    uint32_t neg_offset;
+    size_t count;
+    int res;
+    while ((res = next_token(&br, window_sz2, lookahead_sz2,
+                &literal, &neg_offset, &count)) > 0) {
+        /* Only bytes already loaded into the bit reader may be overwritten. */
+        if (out + count > br.pos) return HSDR_IN_PLACE_ERROR_MARGIN;
+        uint8_t *dst = &buf[out];
+        if (neg_offset == 0) {
+            *dst = literal;
+        } else if (neg_offset > out) {
+            return HSDR_IN_PLACE_ERROR_CORRUPT;
+        } else {
+            memcpy(dst, dst - neg_offset, neg_offset < count ? neg_offset : count);
+            if (neg_offset < count) repeat_pattern(dst, neg_offset, count);
+        }
+        out += count;
+    }
+    if (res < 0) return HSDR_IN_PLACE_ERROR_CORRUPT;
+
+    *output_size = out;
+    return HSDR_IN_PLACE_OK;
 }
@@ -1,14 +1,17 @@
 #ifndef HEATSHRINK_DECODER_H
 #define HEATSHRINK_DECODER_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include "heatshrink.h"
 #include "heatshrink_config.h"
+#include "heatshrink_entropy.h"
 
 typedef enum {
     HSDR_SINK_OK,               /* data sunk, ready to poll */
     HSDR_SINK_FULL,             /* out of space in internal buffer */
     HSDR_SINK_ERROR_NULL=-1,    /* NULL argument */
+    HSDR_SINK_ERROR_MISUSE=-2,  /* API misuse */
 } HEATSHRINK_DECODER_SINK_RES;
 
 typedef enum {
@@ -18,6 +21,15 @@ typedef enum {
     HSDR_POLL_ERROR_UNKNOWN=-2,
 } HEATSHRINK_DECODER_POLL_RES;
 
+typedef enum {
+    HSDR_IN_PLACE_OK,           /* whole stream decoded / scanned */
+    HSDR_IN_PLACE_ERROR_NULL=-1,    /* NULL arguments */
+    HSDR_IN_PLACE_ERROR_MISUSE=-2,  /* bad window or lookahead bits */
+    HSDR_IN_PLACE_ERROR_MARGIN=-3,  /* output would overwrite unread input */
+    HSDR_IN_PLACE_ERROR_CORRUPT=-4, /* truncated stream, or a backref
+                                     * from before the start of output */
+} HEATSHRINK_DECODER_IN_PLACE_RES;
+
 typedef enum {
     HSDR_FINISH_DONE,           /* output is done */
     HSDR_FINISH_MORE,           /* more output remains */
@@ -31,6 +43,8 @@ typedef enum {
     ((BUF)->window_sz2)
 #define HEATSHRINK_DECODER_LOOKAHEAD_BITS(BUF) \
     ((BUF)->lookahead_sz2)
+#define HEATSHRINK_DECODER_FORMAT(BUF) \
+    ((BUF)->format)
 #else
 #define HEATSHRINK_DECODER_INPUT_BUFFER_SIZE(_) \
     HEATSHRINK_STATIC_INPUT_BUFFER_SIZE
@@ -38,26 +52,45 @@ typedef enum {
     (HEATSHRINK_STATIC_WINDOW_BITS)
 #define HEATSHRINK_DECODER_LOOKAHEAD_BITS(BUF) \
     (HEATSHRINK_STATIC_LOOKAHEAD_BITS)
+#define HEATSHRINK_DECODER_FORMAT(_) \
+    (HEATSHRINK_STATIC_FORMAT)
 #endif
 
 typedef struct {
+    uint64_t bit_buffer;        /* buffered input bits, next bit in the MSB */
     uint16_t input_size;        /* bytes in input buffer */
     uint16_t input_index;       /* offset to next unprocessed input byte */
-    uint16_t output_count;      /* how many bytes to output */
+    uint32_t output_count;      /* how many bytes to output */
     uint16_t output_index;      /* index for bytes to output */
+    uint16_t last_offset;       /* previous backref's offset, for repeats */
+    uint8_t literal_streak;     /* literals in a row, for literal runs */
+    uint8_t token;              /* current aligned sequence's token */
     uint16_t head_index;        /* head of window buffer */
-    uint16_t bit_accumulator;
     uint8_t state;              /* current state machine node */
-    uint8_t current_byte;       /* current byte of input */
-    uint8_t bit_index;          /* current bit index */
+    uint8_t bit_count;          /* number of valid bits in bit_buffer */
+    const uint8_t *span;        /* caller's input, during poll_span */
+    size_t span_size;           /* unread bytes at span */
+#if HEATSHRINK_USE_ENTROPY_CODER
+    heatshrink_entropy_model model; /* for HEATSHRINK_FORMAT_ENTROPY */
+    uint32_t rc_low;            /* range decoder's interval */
+    uint32_t rc_range;
+    uint32_t rc_code;           /* coded input, lined up with rc_low */
+    uint32_t rc_field;          /* bits of the field being decoded */
+    uint8_t rc_field_bits;      /* how many */
+    uint8_t rc_loaded;          /* bytes of rc_code read at the start */
+#endif
 
 #if HEATSHRINK_DYNAMIC_ALLOC
     /* Fields that are only used if dynamically allocated. */
     uint8_t window_sz2;         /* window buffer bits */
     uint8_t lookahead_sz2;      /* lookahead bits */
+    uint8_t format;             /* HEATSHRINK_FORMAT_* flags */
     uint16_t input_buffer_size; /* input buffer size */
+#if HEATSHRINK_USE_MIRRORED_WINDOW
+    uint8_t *mirror;            /* doubly-mapped window, or NULL */
+#endif
 
-    /* Input buffer, then expansion window buffer */
+    /* Input buffer, then expansion window buffer (unless mirrored) */
     uint8_t buffers[];
 #else
     /* Input buffer, then expansion window buffer */
@@ -77,11 +110,24 @@ heatshrink_decoder *heatshrink_decoder_alloc(uint16_t input_buffer_size,
 
 /* Free a decoder. */
 void heatshrink_decoder_free(heatshrink_decoder *hsd);
+
+/* Decode the format extensions FORMAT (HEATSHRINK_FORMAT_* flags), as
+ * used by the encoder. This lasts across resets, and is only allowed
+ * before any input. (With static allocation, set HEATSHRINK_STATIC_FORMAT
+ * instead.) */
+HEATSHRINK_DECODER_SINK_RES heatshrink_decoder_set_format(
+    heatshrink_decoder *hsd, uint8_t format);
 #endif
 
 /* Reset a decoder. */
 void heatshrink_decoder_reset(heatshrink_decoder *hsd);
 
+/* Prime a freshly reset decoder's window with the last window's worth
+ * of DICT, to decode output from an encoder primed with the same bytes.
+ * DICT itself is not output. */
+HEATSHRINK_DECODER_SINK_RES heatshrink_decoder_prime(heatshrink_decoder *hsd,
+    const uint8_t *dict, size_t size);
+
 /* Sink at most SIZE bytes from IN_BUF into the decoder. *INPUT_SIZE is set to
  * indicate how many bytes were actually sunk (in case a buffer was filled). */
 HEATSHRINK_DECODER_SINK_RES heatshrink_decoder_sink(heatshrink_decoder *hsd,
@@ -92,6 +138,70 @@ HEATSHRINK_DECODER_SINK_RES heatshrink_decoder_sink(heatshrink_decoder *hsd,
 HEATSHRINK_DECODER_POLL_RES heatshrink_decoder_poll(heatshrink_decoder *hsd,
     uint8_t *out_buf, size_t out_buf_size, uint16_t *output_size);
 
+/* Advance the decoder by up to N bytes of output without copying them
+ * anywhere, for seeking forward. Only the window is updated. *SKIPPED is
+ * set to how many bytes were skipped; like heatshrink_decoder_poll, this
+ * returns HSDR_POLL_MORE once all N have been skipped, or HSDR_POLL_EMPTY
+ * if the sunk input ran out first. */
+HEATSHRINK_DECODER_POLL_RES heatshrink_decoder_skip(heatshrink_decoder *hsd,
+    size_t n, size_t *skipped);
+
+/* Decode directly from the caller's IN_BUF, without copying it into the
+ * decoder's input buffer, writing at most OUT_BUF_SIZE bytes into OUT_BUF.
+ * *INPUT_SIZE is set to how much of IN_BUF was consumed, and *OUTPUT_SIZE
+ * to the amount written. Bits of a field that is split across two spans
+ * are carried over inside the decoder, so IN_BUF can be reused as soon as
+ * this returns. On HSDR_POLL_MORE, call again with the rest of IN_BUF and
+ * a fresh output buffer; on HSDR_POLL_EMPTY, all of IN_BUF was consumed.
+ * A decoder only used this way can be allocated with a 1-byte input
+ * buffer. */
+HEATSHRINK_DECODER_POLL_RES heatshrink_decoder_poll_span(heatshrink_decoder *hsd,
+    const uint8_t *in_buf, size_t in_size, size_t *input_size,
+    uint8_t *out_buf, size_t out_buf_size, size_t *output_size);
+
+/* One of several independent streams decoded together by
+ * heatshrink_decoder_poll_streams. The buffer pointers and sizes are
+ * advanced past the input consumed and output written. */
+typedef struct {
+    heatshrink_decoder *hsd;
+    const uint8_t *in_buf;      /* unread input */
+    size_t in_size;
+    uint8_t *out_buf;           /* free output space */
+    size_t out_size;
+    HEATSHRINK_DECODER_POLL_RES res; /* result of the stream's last poll */
+} heatshrink_decoder_stream;
+
+/* Decode COUNT independent streams with heatshrink_decoder_poll_span,
+ * giving each a turn of a few KB of output at a time. This only saves
+ * the caller the per-stream bookkeeping: it decodes each turn exactly as
+ * poll_span would, so it's no faster than calling that on each stream.
+ * Each stream stops when its input is used up (res is HSDR_POLL_EMPTY)
+ * or its output space is full (res is HSDR_POLL_MORE). Returns
+ * HSDR_POLL_MORE if any stream ran out of output space, or the first
+ * error any stream hit. */
+HEATSHRINK_DECODER_POLL_RES heatshrink_decoder_poll_streams(
+    heatshrink_decoder_stream *streams, size_t count);
+
+/* In-place decompression (classic format only): the IN_SIZE compressed
+ * bytes sit at the end of BUF, starting at IN_OFFSET, and are
+ * decompressed toward the start of BUF, using the output decoded so far
+ * as the window. BUF needs to be the decompressed size plus a margin, as
+ * reported by
+ * heatshrink_encoder_in_place_margin or heatshrink_decoder_in_place_scan.
+ * No decoder state is needed. *OUTPUT_SIZE is set to the decompressed
+ * size. If the margin is too small, this fails with
+ * HSDR_IN_PLACE_ERROR_MARGIN before overwriting any unread input. */
+HEATSHRINK_DECODER_IN_PLACE_RES heatshrink_decoder_in_place(uint8_t *buf,
+    size_t buf_size, size_t in_offset, uint8_t window_sz2,
+    uint8_t lookahead_sz2, size_t *output_size);
+
+/* Walk the compressed stream IN_BUF without expanding it, setting
+ * *OUTPUT_SIZE to its decompressed size and *MARGIN to how many bytes
+ * past that heatshrink_decoder_in_place needs. */
+HEATSHRINK_DECODER_IN_PLACE_RES heatshrink_decoder_in_place_scan(
+    const uint8_t *in_buf, size_t in_size, uint8_t window_sz2,
+    uint8_t lookahead_sz2, size_t *output_size, size_t *margin);
+
 /* Notify the dencoder that the input stream is finished.
  * If the return value is HSDR_FINISH_MORE, there is still more output, so
  * call heatshrink_decoder_poll and repeat. */
@@ -2,6 +2,8 @@
 #include <string.h>
 #include <stdbool.h>
 #include "heatshrink_encoder.h"
+#include "heatshrink_format.h"
+#include "heatshrink_kernels.h"
 
 typedef enum {
     HSES_NOT_FULL,              /* input buffer not full enough */
@@ -11,6 +13,10 @@ typedef enum {
     HSES_YIELD_LITERAL,         /* emit literal byte */
     HSES_YIELD_BR_INDEX,        /* yielding backref index */
     HSES_YIELD_BR_LENGTH,       /* yielding backref length */
+    HSES_YIELD_RUN_CODE,        /* yielding literal run code */
+    HSES_YIELD_RUN,             /* copying literal run bytes */
+    HSES_YIELD_SEQ_HEAD,        /* yielding aligned token, literal count */
+    HSES_YIELD_SEQ_TAIL,        /* yielding aligned offset, match count */
     HSES_SAVE_BACKLOG,          /* copying buffer to backlog */
     HSES_FLUSH_BITS,            /* flush bit buffer */
     HSES_DONE,                  /* done */
@@ -32,6 +38,10 @@ static const char *state_names[] = {
     "yield_literal",
     "yield_br_index",
     "yield_br_length",
+    "yield_run_code",
+    "yield_run",
+    "yield_seq_head",
+    "yield_seq_tail",
     "save_backlog",
     "flush_bits",
     "done",
@@ -47,6 +57,9 @@ typedef enum {
     FLAG_ON_FINAL_LITERAL = 0x04,
     FLAG_BACKLOG_IS_PARTIAL = 0x08,
     FLAG_BACKLOG_IS_FILLED = 0x10,
+    FLAG_MATCH_PENDING = 0x20,  /* long match may go on in the next input */
+    FLAG_MATCH_SCANNED = 0x40,  /* match_scan_index is already past it */
+    FLAG_CODER_FLUSHED = 0x80,  /* range coder's final bytes are queued */
 } ENCODER_FLAGS;
 
 typedef struct {
@@ -57,11 +70,26 @@ typedef struct {
 
 #define MATCH_NOT_FOUND ((uint16_t)-1)
 
+#define USES_VARLEN(HSE) (HEATSHRINK_USE_EXTENDED_FORMATS \
+        && (HEATSHRINK_ENCODER_FORMAT(HSE) & HEATSHRINK_FORMAT_VARLEN))
+#define USES_REPEAT(HSE) (HEATSHRINK_USE_EXTENDED_FORMATS \
+        && (HEATSHRINK_ENCODER_FORMAT(HSE) & HEATSHRINK_FORMAT_REPEAT))
+#define USES_LONG(HSE) (HEATSHRINK_USE_EXTENDED_FORMATS \
+        && (HEATSHRINK_ENCODER_FORMAT(HSE) & HEATSHRINK_FORMAT_LONG))
+#define USES_LITERAL_RUNS(HSE) (HEATSHRINK_USE_EXTENDED_FORMATS \
+        && (HEATSHRINK_ENCODER_FORMAT(HSE) & HEATSHRINK_FORMAT_LITERAL_RUNS))
+#define USES_ALIGNED(HSE) (HEATSHRINK_USE_EXTENDED_FORMATS \
+        && (HEATSHRINK_ENCODER_FORMAT(HSE) & HEATSHRINK_FORMAT_ALIGNED))
+#define USES_ENTROPY(HSE) (HEATSHRINK_USE_EXTENDED_FORMATS \
+        && HEATSHRINK_USE_ENTROPY_CODER \
+        && (HEATSHRINK_ENCODER_FORMAT(HSE) & HEATSHRINK_FORMAT_ENTROPY))
+
 static uint16_t get_input_offset(heatshrink_encoder *hse);
 static uint16_t get_input_buffer_size(heatshrink_encoder *hse);
 static uint16_t get_lookahead_size(heatshrink_encoder *hse);
 static void add_tag_bit(heatshrink_encoder *hse, output_info *oi, uint8_t tag);
 static int can_take_byte(output_info *oi);
+static int can_code(heatshrink_encoder *hse, output_info *oi);
 static int is_finishing(heatshrink_encoder *hse);
 static int backlog_is_partial(heatshrink_encoder *hse);
 static int backlog_is_filled(heatshrink_encoder *hse);
@@ -74,6 +102,17 @@ static void push_bits(heatshrink_encoder *hse, uint8_t count, uint8_t bits,
     output_info *oi);
 static uint8_t push_outgoing_bits(heatshrink_encoder *hse, output_info *oi);
 static void push_literal_byte(heatshrink_encoder *hse, output_info *oi);
+static void note_token(heatshrink_encoder *hse, uint32_t length);
+static uint8_t count_code(heatshrink_encoder *hse, uint32_t count,
+    uint64_t *code);
+
+/* With HEATSHRINK_FORMAT_ENTROPY, range code the tokens' fields instead
+ * of pushing their bits (see heatshrink_entropy.h). */
+static void code_tag(heatshrink_encoder *hse, uint8_t tag);
+static void code_literal(heatshrink_encoder *hse, uint8_t c);
+static void code_outgoing(heatshrink_encoder *hse, bool is_count);
+static void code_end(heatshrink_encoder *hse);
+static uint8_t output_coded(heatshrink_encoder *hse, output_info *oi);
 
 #if HEATSHRINK_DYNAMIC_ALLOC
 heatshrink_encoder *heatshrink_encoder_alloc(uint8_t window_sz2,
@@ -89,6 +128,7 @@ heatshrink_encoder *heatshrink_encoder_alloc(uint8_t window_sz2,
     if (hse == NULL) return NULL;
     hse->window_sz2 = window_sz2;
     hse->lookahead_sz2 = lookahead_sz2;
+    hse->format = HEATSHRINK_FORMAT_CLASSIC;
     heatshrink_encoder_reset(hse);
 
 #if HEATSHRINK_USE_INDEX
@@ -116,6 +156,22 @@ void heatshrink_encoder_free(heatshrink_encoder *hse) {
     HEATSHRINK_FREE(hse, sizeof(heatshrink_encoder) + buf_sz);
     (void)buf_sz;
 }
+
+HEATSHRINK_ENCODER_SINK_RES heatshrink_encoder_set_format(
+        heatshrink_encoder *hse, uint8_t format) {
+    if (hse == NULL) return HSER_SINK_ERROR_NULL;
+    if (!heatshrink_format_supported(format)
+        || !heatshrink_format_fits(format, HEATSHRINK_ENCODER_WINDOW_BITS(hse),
+            HEATSHRINK_ENCODER_LOOKAHEAD_BITS(hse))) {
+        return HSER_SINK_ERROR_MISUSE;
+    }
+    if (hse->state != HSES_NOT_FULL || hse->input_size > 0
+        || (hse->flags & ~FLAG_BACKLOG_IS_FILLED)) {
+        return HSER_SINK_ERROR_MISUSE;
+    }
+    hse->format = format;
+    return HSER_SINK_OK;
+}
 #endif
 
 void heatshrink_encoder_reset(heatshrink_encoder *hse) {
@@ -128,15 +184,51 @@ void heatshrink_encoder_reset(heatshrink_encoder *hse) {
     hse->bit_index = 0x80;
     hse->current_byte = 0x00;
     hse->match_length = 0;
+    hse->last_offset = HEATSHRINK_REPEAT_INITIAL_OFFSET;
+    hse->run_length = 0;
+    hse->known_literals = 0;
+    hse->literal_streak = 0;
 
     hse->outgoing_bits = 0x0000;
     hse->outgoing_bits_count = 0;
+    hse->bytes_in = 0;
+    hse->bytes_out = 0;
+    hse->max_lead = 0;
+#if HEATSHRINK_USE_ENTROPY_CODER
+    heatshrink_entropy_init(&hse->model);
+    hse->rc_low = 0;
+    hse->rc_range = UINT32_MAX;
+    hse->rc_queued = 0;
+#endif
 
     #ifdef LOOP_DETECT
     hse->loop_detect = (uint32_t)-1;
     #endif
 }
 
+HEATSHRINK_ENCODER_SINK_RES heatshrink_encoder_prime(heatshrink_encoder *hse,
+        const uint8_t *dict, size_t size) {
+    if ((hse == NULL) || (dict == NULL && size > 0)) return HSER_SINK_ERROR_NULL;
+
+    /* Only before any input, while the backlog is still empty. */
+    if (hse->state != HSES_NOT_FULL || hse->input_size > 0 || hse->flags != 0) {
+        return HSER_SINK_ERROR_MISUSE;
+    }
+    if (size == 0) return HSER_SINK_OK;
+
+    uint16_t window_sz = get_input_buffer_size(hse);
+    if (size > window_sz) {
+        dict += size - window_sz;
+        size = window_sz;
+    }
+    /* The dictionary ends where input starts. Anything before it stays
+     * zero, which matches a freshly reset decoder's window. */
+    memcpy(&hse->buffer[window_sz - size], dict, size);
+    hse->flags |= FLAG_BACKLOG_IS_FILLED;
+    LOG("-- primed encoder with %zu bytes\n", size);
+    return HSER_SINK_OK;
+}
+
 HEATSHRINK_ENCODER_SINK_RES heatshrink_encoder_sink(heatshrink_encoder *hse,
         uint8_t *in_buf, size_t size, uint16_t *input_size) {
     if ((hse == NULL) || (in_buf == NULL) || (input_size == NULL))
@@ -174,7 +266,17 @@ HEATSHRINK_ENCODER_SINK_RES heatshrink_encoder_sink(heatshrink_encoder *hse,
 
 static uint16_t find_longest_match(heatshrink_encoder *hse, uint16_t start,
     uint16_t end, uint16_t maxlen, uint16_t *match_length);
+static uint16_t search_at(heatshrink_encoder *hse, uint16_t msi,
+    uint16_t *match_length);
+static uint16_t search_limit(heatshrink_encoder *hse);
+static HEATSHRINK_ENCODER_STATE plan_literal_run(heatshrink_encoder *hse);
 static void do_indexing(heatshrink_encoder *hse);
+static uint16_t extend_match(heatshrink_encoder *hse, uint16_t end);
+static HEATSHRINK_ENCODER_STATE continue_long_match(heatshrink_encoder *hse);
+static HEATSHRINK_ENCODER_STATE step_aligned(heatshrink_encoder *hse,
+    uint16_t match_pos, uint16_t match_length);
+static HEATSHRINK_ENCODER_STATE queue_sequence_head(heatshrink_encoder *hse);
+static void queue_sequence_tail(heatshrink_encoder *hse);
 
 static HEATSHRINK_ENCODER_STATE st_step_search(heatshrink_encoder *hse);
 static HEATSHRINK_ENCODER_STATE st_yield_tag_bit(heatshrink_encoder *hse,
@@ -185,6 +287,14 @@ static HEATSHRINK_ENCODER_STATE st_yield_br_index(heatshrink_encoder *hse,
     output_info *oi);
 static HEATSHRINK_ENCODER_STATE st_yield_br_length(heatshrink_encoder *hse,
     output_info *oi);
+static HEATSHRINK_ENCODER_STATE st_yield_run_code(heatshrink_encoder *hse,
+    output_info *oi);
+static HEATSHRINK_ENCODER_STATE st_yield_run(heatshrink_encoder *hse,
+    output_info *oi);
+static HEATSHRINK_ENCODER_STATE st_yield_seq_head(heatshrink_encoder *hse,
+    output_info *oi);
+static HEATSHRINK_ENCODER_STATE st_yield_seq_tail(heatshrink_encoder *hse,
+    output_info *oi);
 static HEATSHRINK_ENCODER_STATE st_save_backlog(heatshrink_encoder *hse);
 static HEATSHRINK_ENCODER_STATE st_flush_bit_buffer(heatshrink_encoder *hse,
     output_info *oi);
@@ -231,6 +341,18 @@ HEATSHRINK_ENCODER_POLL_RES heatshrink_encoder_poll(heatshrink_encoder *hse,
         case HSES_YIELD_BR_LENGTH:
             hse->state = st_yield_br_length(hse, &oi);
             break;
+        case HSES_YIELD_RUN_CODE:
+            hse->state = st_yield_run_code(hse, &oi);
+            break;
+        case HSES_YIELD_RUN:
+            hse->state = st_yield_run(hse, &oi);
+            break;
+        case HSES_YIELD_SEQ_HEAD:
+            hse->state = st_yield_seq_head(hse, &oi);
+            break;
+        case HSES_YIELD_SEQ_TAIL:
+            hse->state = st_yield_seq_tail(hse, &oi);
+            break;
         case HSES_SAVE_BACKLOG:
             hse->state = st_save_backlog(hse);
             break;
@@ -250,6 +372,17 @@ HEATSHRINK_ENCODER_POLL_RES heatshrink_encoder_poll(heatshrink_encoder *hse,
     }
 }
 
+size_t heatshrink_encoder_in_place_margin(heatshrink_encoder *hse) {
+    if (hse == NULL) return 0;
+    /* The compressed data ends the buffer, and the output written after
+     * any token must not pass the input bytes consumed so far. */
+    uint64_t need = hse->bytes_out + hse->max_lead;
+    if (need <= hse->bytes_in) return 0;
+    /* Only a stream too big for memory could need more than a size_t. */
+    return need - hse->bytes_in > SIZE_MAX ? SIZE_MAX
+        : (size_t)(need - hse->bytes_in);
+}
+
 HEATSHRINK_ENCODER_FINISH_RES heatshrink_encoder_finish(heatshrink_encoder *hse) {
     if (hse == NULL) return HSER_FINISH_ERROR_NULL;
     LOG("-- setting is_finishing flag\n");
@@ -259,41 +392,31 @@ HEATSHRINK_ENCODER_FINISH_RES heatshrink_encoder_finish(heatshrink_encoder *hse)
 }
 
 static HEATSHRINK_ENCODER_STATE st_step_search(heatshrink_encoder *hse) {
-    uint16_t window_length = get_input_buffer_size(hse);
     uint16_t lookahead_sz = get_lookahead_size(hse);
     uint16_t msi = hse->match_scan_index;
     LOG("## step_search, scan @ +%d (%d/%d), input size %d\n",
-        msi, hse->input_size + msi, 2*window_length, hse->input_size);
+        msi, hse->input_size + msi, 2*get_input_buffer_size(hse),
+        hse->input_size);
+
+    if (hse->flags & FLAG_MATCH_PENDING) return continue_long_match(hse);
 
     bool fin = is_finishing(hse);
-    if (msi >= hse->input_size - (fin ? 0 : lookahead_sz)) {
+    if (msi >= search_limit(hse)) {
         /* Current search buffer is exhausted, copy it into the
          * backlog and await more input. */
         LOG("-- end of search @ %d, saving backlog\n", msi);
         return HSES_SAVE_BACKLOG;
     }
 
-    uint16_t input_offset = get_input_offset(hse);
-    uint16_t end = input_offset + msi;
-
-    uint16_t start = 0;
-    if (backlog_is_filled(hse)) { /* last WINDOW_LENGTH bytes */
-        start = end - window_length + 1;
-    } else if (backlog_is_partial(hse)) { /* clamp to available data */
-        start = end - window_length + 1;
-        if (start < lookahead_sz) start = lookahead_sz;
-    } else {              /* only scan available input */
-        start = input_offset;
-    }
-
-    uint16_t max_possible = lookahead_sz;
-    if (hse->input_size - msi < lookahead_sz) {
-        max_possible = hse->input_size - msi;
-    }
-    
+    uint16_t end = get_input_offset(hse) + msi;
     uint16_t match_length = 0;
-    uint16_t match_pos = find_longest_match(hse,
-        start, end, max_possible, &match_length);
+    uint16_t match_pos = MATCH_NOT_FOUND;
+    if (hse->known_literals > 0) {
+        hse->known_literals--;  /* searched while planning a literal run */
+    } else {
+        match_pos = search_at(hse, msi, &match_length);
+    }
+    if (USES_ALIGNED(hse)) return step_aligned(hse, match_pos, match_length);
     
     if (match_pos == MATCH_NOT_FOUND) {
         LOG("ss Match not found\n");
@@ -307,6 +430,20 @@ static HEATSHRINK_ENCODER_STATE st_step_search(heatshrink_encoder *hse) {
         hse->match_length = match_length;
         ASSERT(match_pos < 1 << hse->window_sz2 /*window_length*/);
 
+        if (USES_LONG(hse) && match_length == lookahead_sz) {
+            /* Carry it on past the lookahead, as far as the input goes. */
+            uint16_t len = extend_match(hse, end + match_length);
+            hse->match_length += len;
+            hse->match_scan_index += match_length + len;
+            hse->flags |= FLAG_MATCH_SCANNED;
+            if (!fin && hse->match_scan_index == hse->input_size) {
+                LOG("-- long match of %u bytes so far, awaiting input\n",
+                    hse->match_length);
+                hse->flags |= FLAG_MATCH_PENDING;
+                return HSES_SAVE_BACKLOG;
+            }
+        }
+
         #if 0 /* log match */
         printf("E match %d %d '", match_pos, match_length);
         for (int i=0; i<match_length; i++) {
@@ -321,14 +458,30 @@ static HEATSHRINK_ENCODER_STATE st_step_search(heatshrink_encoder *hse) {
 
 static HEATSHRINK_ENCODER_STATE st_yield_tag_bit(heatshrink_encoder *hse,
         output_info *oi) {
-    if (can_take_byte(oi)) {
+    if (can_code(hse, oi)) {
         if (hse->match_length == 0) {
             add_tag_bit(hse, oi, HEATSHRINK_LITERAL_MARKER);
             return HSES_YIELD_LITERAL;
         } else {
             add_tag_bit(hse, oi, HEATSHRINK_BACKREF_MARKER);
-            hse->outgoing_bits = hse->match_pos - 1;
-            hse->outgoing_bits_count = HEATSHRINK_ENCODER_WINDOW_BITS(hse);
+            hse->literal_streak = 0;
+            if (USES_REPEAT(hse) && hse->match_pos == hse->last_offset) {
+                hse->outgoing_bits = 1;     /* same offset as last time */
+                hse->outgoing_bits_count = 1;
+                return HSES_YIELD_BR_INDEX;
+            }
+            if (USES_VARLEN(hse)) {
+                uint32_t code;
+                hse->outgoing_bits_count = heatshrink_varlen_offset_code(
+                    HEATSHRINK_ENCODER_WINDOW_BITS(hse), hse->match_pos, &code);
+                hse->outgoing_bits = code;
+            } else {
+                hse->outgoing_bits = hse->match_pos - 1;
+                hse->outgoing_bits_count = HEATSHRINK_ENCODER_WINDOW_BITS(hse);
+            }
+            /* A 0 bit ahead of the offset says it isn't a repeat. */
+            if (USES_REPEAT(hse)) hse->outgoing_bits_count++;
+            hse->last_offset = hse->match_pos;
             return HSES_YIELD_BR_INDEX;
         }
     } else {
@@ -338,10 +491,15 @@ static HEATSHRINK_ENCODER_STATE st_yield_tag_bit(heatshrink_encoder *hse,
 
 static HEATSHRINK_ENCODER_STATE st_yield_literal(heatshrink_encoder *hse,
         output_info *oi) {
-    if (can_take_byte(oi)) {
+    if (can_code(hse, oi)) {
         push_literal_byte(hse, oi);
+        note_token(hse, 1);
         hse->flags &= ~FLAG_HAS_LITERAL;
         if (on_final_literal(hse)) return HSES_FLUSH_BITS;
+        if (USES_LITERAL_RUNS(hse)
+            && ++hse->literal_streak == HEATSHRINK_LITERAL_RUN_AFTER) {
+            return plan_literal_run(hse);
+        }
         return hse->match_length > 0 ? HSES_YIELD_TAG_BIT : HSES_SEARCH;
     } else {
         return HSES_YIELD_LITERAL;
@@ -350,15 +508,16 @@ static HEATSHRINK_ENCODER_STATE st_yield_literal(heatshrink_encoder *hse,
 
 static HEATSHRINK_ENCODER_STATE st_yield_br_index(heatshrink_encoder *hse,
         output_info *oi) {
-    if (can_take_byte(oi)) {
+    if (can_code(hse, oi)) {
         LOG("-- yielding backref index %u\n", hse->match_pos);
-        if (push_outgoing_bits(hse, oi) > 0) {
+        if (USES_ENTROPY(hse)) {
+            code_outgoing(hse, false);  /* all at once */
+        } else if (push_outgoing_bits(hse, oi) > 0) {
             return HSES_YIELD_BR_INDEX; /* continue */
-        } else {
-            hse->outgoing_bits = hse->match_length - 1;
-            hse->outgoing_bits_count = HEATSHRINK_ENCODER_LOOKAHEAD_BITS(hse);
-            return HSES_YIELD_BR_LENGTH; /* done */
         }
+        hse->outgoing_bits_count = count_code(hse, hse->match_length,
+            &hse->outgoing_bits);
+        return HSES_YIELD_BR_LENGTH; /* done */
     } else {
         return HSES_YIELD_BR_INDEX; /* continue */
     }
@@ -366,22 +525,103 @@ static HEATSHRINK_ENCODER_STATE st_yield_br_index(heatshrink_encoder *hse,
 
 static HEATSHRINK_ENCODER_STATE st_yield_br_length(heatshrink_encoder *hse,
         output_info *oi) {
-    if (can_take_byte(oi)) {
+    if (can_code(hse, oi)) {
         LOG("-- yielding backref length %u\n", hse->match_length);
-        if (push_outgoing_bits(hse, oi) > 0) {
+        if (USES_ENTROPY(hse)) {
+            code_outgoing(hse, true);
+        } else if (push_outgoing_bits(hse, oi) > 0) {
             return HSES_YIELD_BR_LENGTH;
+        }
+        note_token(hse, hse->match_length);
+        if (hse->flags & FLAG_MATCH_SCANNED) {
+            hse->flags &= ~FLAG_MATCH_SCANNED;
         } else {
             hse->match_scan_index += hse->match_length;
-            hse->match_length = 0;
-            return HSES_SEARCH;
         }
+        hse->match_length = 0;
+        return HSES_SEARCH;
     } else {
         return HSES_YIELD_BR_LENGTH;
     }
 }
 
+static HEATSHRINK_ENCODER_STATE st_yield_run_code(heatshrink_encoder *hse,
+        output_info *oi) {
+    if (can_take_byte(oi)) {
+        LOG("-- yielding literal run code, %u bytes\n", hse->run_length);
+        if (push_outgoing_bits(hse, oi) > 0) return HSES_YIELD_RUN_CODE;
+        return hse->run_length > 0 ? HSES_YIELD_RUN : HSES_SEARCH;
+    } else {
+        return HSES_YIELD_RUN_CODE;
+    }
+}
+
+static HEATSHRINK_ENCODER_STATE st_yield_run(heatshrink_encoder *hse,
+        output_info *oi) {
+    if (!can_take_byte(oi)) return HSES_YIELD_RUN;
+    if (hse->bit_index != 0x80) {   /* pad to the byte boundary */
+        oi->buf[(*oi->output_size)++] = hse->current_byte;
+        hse->current_byte = 0x00;
+        hse->bit_index = 0x80;
+        hse->bytes_out++;
+        if (!can_take_byte(oi)) return HSES_YIELD_RUN;
+    }
+
+    size_t n = oi->buf_size - *oi->output_size;
+    if (n > hse->run_length) n = hse->run_length;
+    uint16_t input_offset = get_input_offset(hse) + hse->match_scan_index;
+    /* Aligned sequences' literals were already scanned past. */
+    bool aligned = USES_ALIGNED(hse);
+    if (aligned) input_offset -= hse->run_length;
+    LOG("-- copying %zu literal run bytes from +%d\n", n, input_offset);
+    memcpy(&oi->buf[*oi->output_size], &hse->buffer[input_offset], n);
+    *oi->output_size += n;
+    hse->bytes_out += n;
+    note_token(hse, n);
+    if (!aligned) hse->match_scan_index += n;
+    hse->run_length -= n;
+    if (hse->run_length > 0) return HSES_YIELD_RUN;
+    if (aligned) {
+        if (on_final_literal(hse)) return HSES_FLUSH_BITS;
+        queue_sequence_tail(hse);
+        return HSES_YIELD_SEQ_TAIL;
+    }
+    return HSES_SEARCH;
+}
+
+static HEATSHRINK_ENCODER_STATE st_yield_seq_head(heatshrink_encoder *hse,
+        output_info *oi) {
+    if (!can_take_byte(oi)) return HSES_YIELD_SEQ_HEAD;
+    LOG("-- yielding sequence head, %u literals\n", hse->run_length);
+    if (push_outgoing_bits(hse, oi) > 0) return HSES_YIELD_SEQ_HEAD;
+    if (hse->run_length > 0) return HSES_YIELD_RUN;
+    if (on_final_literal(hse)) return HSES_FLUSH_BITS;
+    queue_sequence_tail(hse);
+    return HSES_YIELD_SEQ_TAIL;
+}
+
+static HEATSHRINK_ENCODER_STATE st_yield_seq_tail(heatshrink_encoder *hse,
+        output_info *oi) {
+    if (!can_take_byte(oi)) return HSES_YIELD_SEQ_TAIL;
+    LOG("-- yielding sequence tail, %u bytes at -%u\n",
+        hse->match_length, hse->match_pos);
+    if (push_outgoing_bits(hse, oi) > 0) return HSES_YIELD_SEQ_TAIL;
+    if (hse->match_length > 0) {
+        note_token(hse, hse->match_length);
+        hse->match_scan_index += hse->match_length;
+        hse->match_length = 0;
+    }
+    return HSES_SEARCH;
+}
+
 static HEATSHRINK_ENCODER_STATE st_save_backlog(heatshrink_encoder *hse) {
     if (is_finishing(hse)) {
+        if (USES_ALIGNED(hse) && hse->run_length > 0) {
+            /* The last sequence is just its literals. */
+            hse->flags |= FLAG_ON_FINAL_LITERAL;
+            hse->match_length = 0;
+            return queue_sequence_head(hse);
+        }
         /* copy remaining literal (if necessary) */
         if (has_literal(hse)) {
             hse->flags |= FLAG_ON_FINAL_LITERAL;
@@ -398,12 +638,21 @@ static HEATSHRINK_ENCODER_STATE st_save_backlog(heatshrink_encoder *hse) {
 
 static HEATSHRINK_ENCODER_STATE st_flush_bit_buffer(heatshrink_encoder *hse,
         output_info *oi) {
+    if (USES_ENTROPY(hse)) {
+        if (!(hse->flags & FLAG_CODER_FLUSHED)) {
+            if (!can_code(hse, oi)) return HSES_FLUSH_BITS;
+            code_end(hse);
+            hse->flags |= FLAG_CODER_FLUSHED;
+        }
+        return output_coded(hse, oi) == 0 ? HSES_DONE : HSES_FLUSH_BITS;
+    }
     if (hse->bit_index == 0x80) {
         LOG("-- done!\n");
         return HSES_DONE;
     } else if (can_take_byte(oi)) {
         LOG("-- flushing remaining byte (bit_index == 0x%02x)\n", hse->bit_index);
         oi->buf[(*oi->output_size)++] = hse->current_byte;
+        hse->bytes_out++;
         LOG("-- done!\n");
         return HSES_DONE;
     } else {
@@ -413,6 +662,10 @@ static HEATSHRINK_ENCODER_STATE st_flush_bit_buffer(heatshrink_encoder *hse,
 
 static void add_tag_bit(heatshrink_encoder *hse, output_info *oi, uint8_t tag) {
     LOG("-- adding tag bit: %d\n", tag);
+    if (USES_ENTROPY(hse)) {
+        code_tag(hse, tag);
+        return;
+    }
     push_bits(hse, 1, tag, oi);
 }
 
@@ -478,13 +731,52 @@ static int can_take_byte(output_info *oi) {
     return *oi->output_size < oi->buf_size;
 }
 
-/* Return the longest match for the bytes at buf[end:end+maxlen] between
- * buf[start] and buf[end-1]. If no match is found, return -1. */
+/* Is there room for the next field? With HEATSHRINK_FORMAT_ENTROPY, that
+ * means every byte coded so far has gone out. */
+static int can_code(heatshrink_encoder *hse, output_info *oi) {
+    if (USES_ENTROPY(hse)) return output_coded(hse, oi) == 0;
+    return can_take_byte(oi);
+}
+
+/* The length in bits of a backref of LEN bytes at NEG_OFFSET. */
+static uint32_t backref_bits(heatshrink_encoder *hse, uint16_t neg_offset,
+        uint16_t len) {
+    uint32_t code;
+    uint64_t long_code;
+    uint32_t cost = USES_REPEAT(hse) ? 2 : 1;
+    if (USES_REPEAT(hse) && neg_offset == hse->last_offset) {
+        /* no offset */
+    } else if (USES_VARLEN(hse)) {
+        cost += heatshrink_varlen_offset_code(
+            HEATSHRINK_ENCODER_WINDOW_BITS(hse), neg_offset, &code);
+    } else {
+        cost += HEATSHRINK_ENCODER_WINDOW_BITS(hse);
+    }
+    return cost + count_code(hse, len, &long_code);
+}
+
+/* How much a match of LEN bytes at NEG_OFFSET is worth: its length in
+ * the classic format, where every backref costs the same, or else the
+ * bits it saves over literals (0 if none). */
+static uint32_t match_gain(heatshrink_encoder *hse, uint16_t neg_offset,
+        uint16_t len) {
+    if (!USES_VARLEN(hse) && !USES_REPEAT(hse)) return len;
+    uint32_t cost = backref_bits(hse, neg_offset, len);
+    uint32_t literal_cost = 9 * (uint32_t)len;
+    return literal_cost > cost ? literal_cost - cost : 0;
+}
+
+/* Return the best match for the bytes at buf[end:end+maxlen] between
+ * buf[start] and buf[end-1] (see match_gain). The previous offset is
+ * tried first with HEATSHRINK_FORMAT_REPEAT, then the rest nearest
+ * first, so ties go to the repeat, then the nearest. If no match is
+ * found, return -1. */
 static uint16_t find_longest_match(heatshrink_encoder *hse, uint16_t start,
         uint16_t end, uint16_t maxlen, uint16_t *match_length) {
     LOG("-- scanning for match of buf[%u:%u] between buf[%u:%u] (max %u bytes)\n",
         end, end + maxlen, start, end + maxlen - 1, maxlen);
     uint8_t *buf = hse->buffer;
+    const heatshrink_kernels *k = heatshrink_kernels_get();
 
     /* Skip search at self. */
     if (start == end) return MATCH_NOT_FOUND;
@@ -493,42 +785,64 @@ static uint16_t find_longest_match(heatshrink_encoder *hse, uint16_t start,
     uint16_t match_index = MATCH_NOT_FOUND;
     uint16_t needle_index = end;
     uint16_t break_even_point = 2;
+    if (USES_ALIGNED(hse)) {
+        break_even_point = HEATSHRINK_ALIGNED_MIN_MATCH - 1;
+    } else if (USES_VARLEN(hse)) {
+        break_even_point = HEATSHRINK_VARLEN_MIN_COUNT - 1;
+    } else if (USES_REPEAT(hse)) {
+        break_even_point = 0;   /* match_gain decides */
+    }
+    uint32_t best_gain = 0;
     uint16_t len = 0;
+
+    if (USES_REPEAT(hse) && hse->last_offset <= end - start) {
+        uint16_t pos = end - hse->last_offset;
+        len = k->match_length(&buf[pos], &buf[needle_index], maxlen);
+        if (len > break_even_point) best_gain = match_gain(hse, hse->last_offset, len);
+        if (best_gain > 0) {
+            match_maxlen = len;
+            match_index = pos;
+            /* Nothing else can be longer or cheaper. */
+            if (len == maxlen) {
+                LOG("-- repeat match: %u bytes at -%u\n", len, hse->last_offset);
+                *match_length = len;
+                return hse->last_offset;
+            }
+        }
+    }
+
 #if HEATSHRINK_USE_INDEX
     struct hs_index *hsi = HEATSHRINK_ENCODER_INDEX(hse);
     uint16_t pos = hsi->index[end];
 
-    if (pos < start) return MATCH_NOT_FOUND;
+    if (pos < start) pos = MATCH_NOT_FOUND;
     while (pos != MATCH_NOT_FOUND) {
-        for (len=0; len<maxlen; len++) {
-            if (0) LOG("    -- checking char %c at %d against %c at %d\n",
-                buf[pos + len], pos + len, buf[needle_index + len],
-                needle_index + len);
-            if (buf[pos + len] != buf[needle_index + len]) break;
-        }
+        len = k->match_length(&buf[pos], &buf[needle_index], maxlen);
         if (len > break_even_point) {
-            if (len > match_maxlen) {
+            uint32_t gain = match_gain(hse, needle_index - pos, len);
+            if (gain > best_gain) {
+                best_gain = gain;
                 match_maxlen = len;
                 match_index = pos;
-                if (len == maxlen) break; /* don't keep searching */
             }
+            /* Anything further back is no longer, and costs no less. */
+            if (len == maxlen) break;
         }
         pos = hsi->index[pos];
         if (pos < start) break;
     }
 #else    
     for (uint16_t pos=end - 1; ; pos--) {
-        for (len=0; len<maxlen; len++) {
-            if (0) LOG("  --> cmp buf[%d] == 0x%02x against %02x (start %u)\n",
-                pos + len, buf[pos + len], buf[needle_index + len], start);
-            if (buf[pos + len] != buf[needle_index + len]) break;
-        }
+        len = k->match_length(&buf[pos], &buf[needle_index], maxlen);
         if (len > break_even_point) {
-            if (len > match_maxlen) {
+            uint32_t gain = match_gain(hse, needle_index - pos, len);
+            if (gain > best_gain) {
+                best_gain = gain;
                 match_maxlen = len;
                 match_index = pos;
-                if (len == maxlen) break; /* don't keep searching */
             }
+            /* Anything further back is no longer, and costs no less. */
+            if (len == maxlen) break;
         }
         /* start may be 0, so can't use i >= start */
         if (pos == start) break;
@@ -545,6 +859,203 @@ static uint16_t find_longest_match(heatshrink_encoder *hse, uint16_t start,
     return MATCH_NOT_FOUND;
 }
 
+/* Where the search for the current input stops: a full lookahead from
+ * its end, unless it's the last. */
+static uint16_t search_limit(heatshrink_encoder *hse) {
+    if (is_finishing(hse)) return hse->input_size;
+    return hse->input_size - get_lookahead_size(hse);
+}
+
+/* Search for the best match for the input at match scan index MSI. */
+static uint16_t search_at(heatshrink_encoder *hse, uint16_t msi,
+        uint16_t *match_length) {
+    uint16_t window_length = get_input_buffer_size(hse);
+    uint16_t lookahead_sz = get_lookahead_size(hse);
+    uint16_t input_offset = get_input_offset(hse);
+    uint16_t end = input_offset + msi;
+
+    uint16_t start = 0;
+    if (backlog_is_filled(hse)) { /* last WINDOW_LENGTH bytes */
+        start = end - window_length + 1;
+    } else if (backlog_is_partial(hse)) { /* clamp to available data */
+        start = end - window_length + 1;
+        if (start < lookahead_sz) start = lookahead_sz;
+    } else {              /* only scan available input */
+        start = input_offset;
+    }
+
+    uint16_t max_possible = lookahead_sz;
+    if (hse->input_size - msi < lookahead_sz) {
+        max_possible = hse->input_size - msi;
+    }
+    return find_longest_match(hse, start, end, max_possible, match_length);
+}
+
+/* What it costs to end a literal run if more incompressible bytes follow
+ * the match: the literals before the next run code cost a bit more each
+ * than raw bytes. (The next run code isn't counted, since the data after
+ * a match is often compressible too.) */
+#define RUN_RESTART_BITS HEATSHRINK_LITERAL_RUN_AFTER
+
+/* After HEATSHRINK_LITERAL_RUN_AFTER literals in a row, look ahead for
+ * how many more bytes are cheaper raw than as backrefs (counting what it
+ * costs to end the run), and queue the run code: those bytes
+ * go out raw if that saves bits over literals, else a 0 bit says there is
+ * no run. Bytes with no match at all won't be searched again. */
+static HEATSHRINK_ENCODER_STATE plan_literal_run(heatshrink_encoder *hse) {
+    uint16_t msi = hse->match_scan_index;
+    uint16_t limit = search_limit(hse);
+    uint32_t run = 0;
+    uint32_t unmatched = 0;     /* leading bytes with no match */
+    uint16_t match_length;
+    while (msi + run < limit && run < HEATSHRINK_LITERAL_RUN_MAX) {
+        uint16_t pos = search_at(hse, msi + run, &match_length);
+        if (pos != MATCH_NOT_FOUND) {
+            uint32_t cost = backref_bits(hse, pos, match_length);
+            if (cost + RUN_RESTART_BITS < 8 * (uint32_t)match_length) break;
+        } else if (unmatched == run) {
+            unmatched++;
+        }
+        run++;
+    }
+
+    uint32_t code = 0;
+    uint8_t bits = heatshrink_literal_run_code(run, &code);
+    uint8_t filled = bits;      /* bits in the last byte before the run */
+    for (uint8_t b = hse->bit_index; b != 0x80; b <<= 1) filled++;
+    uint8_t padding = (8 - filled % 8) % 8;
+    /* A run costs BITS + PADDING + 8 bits per byte, instead of 1 + 9. */
+    if (run + 1 <= (uint32_t)bits + padding) {
+        hse->known_literals = unmatched;
+        run = 0;
+        bits = heatshrink_literal_run_code(0, &code);
+    }
+    LOG("-- literal run of %u bytes\n", run);
+    hse->literal_streak = 0;
+    hse->run_length = run;
+    hse->outgoing_bits = code;
+    hse->outgoing_bits_count = bits;
+    return HSES_YIELD_RUN_CODE;
+}
+
+/* Set *CODE to the count field for COUNT, returning its length in bits.
+ * With HEATSHRINK_FORMAT_LONG, counts from the largest count code on
+ * are followed by an extra count. */
+static uint8_t count_code(heatshrink_encoder *hse, uint32_t count,
+        uint64_t *code) {
+    uint8_t lookahead_sz2 = HEATSHRINK_ENCODER_LOOKAHEAD_BITS(hse);
+    uint32_t max = heatshrink_max_count_code(lookahead_sz2, USES_VARLEN(hse));
+    uint32_t base = count < max ? count : max;
+    uint32_t c;
+    uint8_t bits;
+    if (USES_VARLEN(hse)) {
+        bits = heatshrink_varlen_count_code(lookahead_sz2, base, &c);
+    } else {
+        c = base - 1;
+        bits = lookahead_sz2;
+    }
+    *code = c;
+    if (USES_LONG(hse) && count >= max) {
+        uint32_t extra;
+        uint8_t extra_bits = heatshrink_long_extra_code(count - max, &extra);
+        *code = (*code << extra_bits) | extra;
+        bits += extra_bits;
+    }
+    return bits;
+}
+
+/* How far the match at match_pos goes on from buf[end], within the input
+ * and the longest count HEATSHRINK_FORMAT_LONG can code. */
+static uint16_t extend_match(heatshrink_encoder *hse, uint16_t end) {
+    uint16_t avail = get_input_offset(hse) + hse->input_size - end;
+    uint32_t room = heatshrink_max_count_code(
+        HEATSHRINK_ENCODER_LOOKAHEAD_BITS(hse), USES_VARLEN(hse))
+        + HEATSHRINK_LONG_EXTRA_MAX - hse->match_length;
+    if (room < avail) avail = room;
+    if (avail == 0) return 0;
+    const heatshrink_kernels *k = heatshrink_kernels_get();
+    return k->match_length(&hse->buffer[end - hse->match_pos],
+        &hse->buffer[end], avail);
+}
+
+/* Carry on with a long match that ran to the end of the last input, now
+ * that there is more (or there won't be). */
+static HEATSHRINK_ENCODER_STATE continue_long_match(heatshrink_encoder *hse) {
+    uint16_t end = get_input_offset(hse) + hse->match_scan_index;
+    uint16_t len = extend_match(hse, end);
+    hse->match_length += len;
+    hse->match_scan_index += len;
+    if (!is_finishing(hse) && hse->match_scan_index == hse->input_size
+        && len > 0) {
+        return HSES_SAVE_BACKLOG;   /* still going */
+    }
+    LOG("-- long match of %u bytes at -%u\n", hse->match_length, hse->match_pos);
+    hse->flags &= ~FLAG_MATCH_PENDING;
+    return HSES_YIELD_TAG_BIT;
+}
+
+/* With HEATSHRINK_FORMAT_ALIGNED, bytes with no match pile up behind the
+ * match scan index until a match (or a full buffer's worth of them) ends
+ * the sequence. */
+static HEATSHRINK_ENCODER_STATE step_aligned(heatshrink_encoder *hse,
+        uint16_t match_pos, uint16_t match_length) {
+    if (match_pos == MATCH_NOT_FOUND) {
+        hse->match_scan_index++;
+        if (++hse->run_length < get_input_buffer_size(hse)) return HSES_SEARCH;
+        hse->match_length = 0;
+        return queue_sequence_head(hse);
+    }
+    LOG("ss Found match of %d bytes at %d\n", match_length, match_pos);
+    hse->match_pos = match_pos;
+    hse->match_length = match_length;
+    if (match_length == get_lookahead_size(hse)) {
+        /* Counts aren't limited to the lookahead, so go on in the input. */
+        uint16_t end = get_input_offset(hse) + hse->match_scan_index;
+        hse->match_length += extend_match(hse, end + match_length);
+    }
+    return queue_sequence_head(hse);
+}
+
+/* Queue the token and literal count extension for the sequence of
+ * run_length literals and the match_length byte match (if any). */
+static HEATSHRINK_ENCODER_STATE queue_sequence_head(heatshrink_encoder *hse) {
+    const uint32_t nibble_max = HEATSHRINK_ALIGNED_NIBBLE_MAX;
+    uint32_t literals = hse->run_length;
+    uint32_t count = 0;
+    if (hse->match_length > 0) {
+        count = hse->match_length - HEATSHRINK_ALIGNED_MIN_MATCH;
+    }
+    uint64_t bits = ((literals < nibble_max ? literals : nibble_max) << 4)
+        | (count < nibble_max ? count : nibble_max);
+    uint8_t count_bits = 8;
+    if (literals >= nibble_max) {
+        uint32_t ext;
+        uint8_t ext_bits = heatshrink_aligned_ext_code(literals - nibble_max,
+            &ext);
+        bits = (bits << ext_bits) | ext;
+        count_bits += ext_bits;
+    }
+    hse->outgoing_bits = bits;
+    hse->outgoing_bits_count = count_bits;
+    return HSES_YIELD_SEQ_HEAD;
+}
+
+/* Queue the offset (0 for none) and match count extension. */
+static void queue_sequence_tail(heatshrink_encoder *hse) {
+    uint64_t bits = hse->match_length > 0 ? hse->match_pos : 0;
+    uint8_t count_bits = 16;
+    uint32_t count = hse->match_length - HEATSHRINK_ALIGNED_MIN_MATCH;
+    if (hse->match_length > 0 && count >= HEATSHRINK_ALIGNED_NIBBLE_MAX) {
+        uint32_t ext;
+        uint8_t ext_bits = heatshrink_aligned_ext_code(
+            count - HEATSHRINK_ALIGNED_NIBBLE_MAX, &ext);
+        bits = (bits << ext_bits) | ext;
+        count_bits += ext_bits;
+    }
+    hse->outgoing_bits = bits;
+    hse->outgoing_bits_count = count_bits;
+}
+
 static uint8_t push_outgoing_bits(heatshrink_encoder *hse, output_info *oi) {
     uint8_t count = 0;
     uint8_t bits = 0;
@@ -577,6 +1088,7 @@ static void push_bits(heatshrink_encoder *hse, uint8_t count, uint8_t bits,
             LOG(" > pushing byte 0x%02x\n", hse->current_byte);
             oi->buf[(*oi->output_size)++] = hse->current_byte;
             hse->current_byte = 0x00;
+            hse->bytes_out++;
         }
     }
 }
@@ -587,9 +1099,106 @@ static void push_literal_byte(heatshrink_encoder *hse, output_info *oi) {
     uint8_t c = hse->buffer[input_offset];
     LOG("-- yielded literal byte 0x%02x ('%c') from +%d\n",
         c, isprint(c) ? c : '.', input_offset);
-    push_bits(hse, 8, c, oi);
+    if (USES_ENTROPY(hse)) {
+        code_literal(hse, c);
+    } else {
+        push_bits(hse, 8, c, oi);
+    }
+}
+
+#if HEATSHRINK_USE_ENTROPY_CODER
+/* Range code BIT with the adaptive probability PROB, queueing any bytes
+ * that are settled. */
+static void code_bit(heatshrink_encoder *hse, uint16_t *prob, int bit) {
+    uint32_t bound = heatshrink_entropy_bound(hse->rc_range, *prob);
+    if (bit) {
+        hse->rc_low += bound;
+        hse->rc_range -= bound;
+    } else {
+        hse->rc_range = bound;
+    }
+    heatshrink_entropy_update(prob, bit);
+    while (heatshrink_entropy_needs_shift(hse->rc_low, &hse->rc_range)) {
+        ASSERT(hse->rc_queued < sizeof(hse->rc_queue));
+        hse->rc_queue[hse->rc_queued++] = hse->rc_low >> 24;
+        hse->rc_low <<= 8;
+        hse->rc_range <<= 8;
+    }
 }
 
+/* Range code the low BITS bits of VALUE, from the top, with the field
+ * model PROBS (see heatshrink_entropy_prob). */
+static void code_field(heatshrink_encoder *hse, uint16_t *probs,
+        uint8_t tree_bits, uint8_t bits, uint32_t value) {
+    for (uint8_t done = 0; done < bits; done++) {
+        uint32_t prefix = value >> (bits - done);
+        int bit = (value >> (bits - done - 1)) & 1;
+        code_bit(hse, heatshrink_entropy_prob(probs, tree_bits, done, prefix),
+            bit);
+    }
+}
+
+static void code_tag(heatshrink_encoder *hse, uint8_t tag) {
+    heatshrink_entropy_model *m = &hse->model;
+    code_bit(hse, &m->end, 0);
+    code_bit(hse, &m->tag[m->last_tag], tag);
+    m->last_tag = tag;
+}
+
+static void code_literal(heatshrink_encoder *hse, uint8_t c) {
+    code_field(hse, hse->model.literal, 8, 8, c);
+}
+
+/* Code the queued backref index or count. */
+static void code_outgoing(heatshrink_encoder *hse, bool is_count) {
+    uint16_t *probs = is_count ? hse->model.count : hse->model.index;
+    uint8_t bits = hse->outgoing_bits_count;
+    code_field(hse, probs, heatshrink_entropy_tree_bits(bits), bits,
+        hse->outgoing_bits);
+    hse->outgoing_bits_count = 0;
+}
+
+/* Code the end flag, and queue the coder's final bytes. */
+static void code_end(heatshrink_encoder *hse) {
+    code_bit(hse, &hse->model.end, 1);
+    for (int i = 0; i < HEATSHRINK_ENTROPY_FINAL_BYTES; i++) {
+        hse->rc_queue[hse->rc_queued++] = hse->rc_low >> 24;
+        hse->rc_low <<= 8;
+    }
+}
+
+/* Move as many queued bytes to the output as fit, returning how many
+ * are left. */
+static uint8_t output_coded(heatshrink_encoder *hse, output_info *oi) {
+    size_t n = oi->buf_size - *oi->output_size;
+    if (n > hse->rc_queued) n = hse->rc_queued;
+    memcpy(&oi->buf[*oi->output_size], hse->rc_queue, n);
+    memmove(hse->rc_queue, &hse->rc_queue[n], hse->rc_queued - n);
+    *oi->output_size += n;
+    hse->bytes_out += n;
+    hse->rc_queued -= n;
+    return hse->rc_queued;
+}
+#else
+/* Never called: USES_ENTROPY is always false without the coder. */
+static void code_tag(heatshrink_encoder *hse, uint8_t tag) {
+    (void)hse; (void)tag;
+}
+static void code_literal(heatshrink_encoder *hse, uint8_t c) {
+    (void)hse; (void)c;
+}
+static void code_outgoing(heatshrink_encoder *hse, bool is_count) {
+    (void)hse; (void)is_count;
+}
+static void code_end(heatshrink_encoder *hse) {
+    (void)hse;
+}
+static uint8_t output_coded(heatshrink_encoder *hse, output_info *oi) {
+    (void)hse; (void)oi;
+    return 0;
+}
+#endif
+
 static void save_backlog(heatshrink_encoder *hse) {
     size_t input_buf_sz = get_input_buffer_size(hse);
     
@@ -617,3 +1226,13 @@ static void save_backlog(heatshrink_encoder *hse) {
     hse->match_scan_index = 0;
     hse->input_size -= input_buf_sz - rem;
 }
+
+/* Track how far the decompressed output runs ahead of the compressed
+ * input, for heatshrink_encoder_in_place_margin. */
+static void note_token(heatshrink_encoder *hse, uint32_t length) {
+    hse->bytes_in += length;
+    if (hse->bytes_in > hse->bytes_out
+        && hse->bytes_in - hse->bytes_out > hse->max_lead) {
+        hse->max_lead = hse->bytes_in - hse->bytes_out;
+    }
+}
@@ -1,9 +1,11 @@
 #ifndef HEATSHRINK_ENCODER_H
 #define HEATSHRINK_ENCODER_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include "heatshrink.h"
 #include "heatshrink_config.h"
+#include "heatshrink_entropy.h"
 
 typedef enum {
     HSER_SINK_OK,               /* data sunk into input buffer */
@@ -29,6 +31,8 @@ typedef enum {
     ((HSE)->window_sz2)
 #define HEATSHRINK_ENCODER_LOOKAHEAD_BITS(HSE) \
     ((HSE)->lookahead_sz2)
+#define HEATSHRINK_ENCODER_FORMAT(HSE) \
+    ((HSE)->format)
 #define HEATSHRINK_ENCODER_INDEX(HSE) \
     ((HSE)->search_index)
 struct hs_index {
@@ -40,6 +44,8 @@ struct hs_index {
     (HEATSHRINK_STATIC_WINDOW_BITS)
 #define HEATSHRINK_ENCODER_LOOKAHEAD_BITS(_) \
     (HEATSHRINK_STATIC_LOOKAHEAD_BITS)
+#define HEATSHRINK_ENCODER_FORMAT(_) \
+    (HEATSHRINK_STATIC_FORMAT)
 #define HEATSHRINK_ENCODER_INDEX(HSE) \
     (&(HSE)->search_index)
 struct hs_index {
@@ -51,17 +57,33 @@ struct hs_index {
 typedef struct {
     uint16_t input_size;        /* bytes in input buffer */
     uint16_t match_scan_index;
-    uint16_t match_length;
+    uint32_t match_length;
     uint16_t match_pos;
-    uint16_t outgoing_bits;     /* enqueued outgoing bits */
+    uint16_t last_offset;       /* previous backref's offset, for repeats */
+    uint16_t run_length;        /* raw bytes left in a literal run */
+    uint16_t known_literals;    /* bytes ahead already searched in vain */
+    uint8_t literal_streak;     /* literals in a row, for literal runs */
+    uint64_t outgoing_bits;     /* enqueued outgoing bits */
     uint8_t outgoing_bits_count;
     uint8_t flags;
     uint8_t state;              /* current state machine node */
     uint8_t current_byte;       /* current byte of output */
     uint8_t bit_index;          /* current bit index */
+    uint64_t bytes_in;          /* input bytes encoded so far */
+    uint64_t bytes_out;         /* whole output bytes emitted so far */
+    uint64_t max_lead;          /* max. bytes_in - bytes_out after a token */
+#if HEATSHRINK_USE_ENTROPY_CODER
+    heatshrink_entropy_model model; /* for HEATSHRINK_FORMAT_ENTROPY */
+    uint32_t rc_low;            /* range coder's interval */
+    uint32_t rc_range;
+    uint8_t rc_queued;          /* coded bytes not yet output */
+    uint8_t rc_queue[HEATSHRINK_MAX_WINDOW_BITS
+        * HEATSHRINK_ENTROPY_MAX_BYTES_PER_BIT];
+#endif
 #if HEATSHRINK_DYNAMIC_ALLOC
     uint8_t window_sz2;         /* 2^n size of window */
     uint8_t lookahead_sz2;      /* 2^n size of lookahead */
+    uint8_t format;             /* HEATSHRINK_FORMAT_* flags */
 #if HEATSHRINK_USE_INDEX
     struct hs_index *search_index;
 #endif
@@ -84,11 +106,25 @@ heatshrink_encoder *heatshrink_encoder_alloc(uint8_t window_sz2,
 
 /* Free an encoder. */
 void heatshrink_encoder_free(heatshrink_encoder *hse);
+
+/* Encode with the format extensions FORMAT (HEATSHRINK_FORMAT_* flags),
+ * which the decoder also needs to be set to. This lasts across resets,
+ * and is only allowed before any input. (With static allocation, set
+ * HEATSHRINK_STATIC_FORMAT instead.) */
+HEATSHRINK_ENCODER_SINK_RES heatshrink_encoder_set_format(
+    heatshrink_encoder *hse, uint8_t format);
 #endif
 
 /* Reset an encoder. */
 void heatshrink_encoder_reset(heatshrink_encoder *hse);
 
+/* Prime a freshly reset encoder with the last window's worth of DICT,
+ * as if it had just been compressed, so the first input can match
+ * against it. Decoding the output needs a decoder primed with the same
+ * bytes (see heatshrink_decoder_prime). */
+HEATSHRINK_ENCODER_SINK_RES heatshrink_encoder_prime(heatshrink_encoder *hse,
+    const uint8_t *dict, size_t size);
+
 /* Sink up to SIZE bytes from IN_BUF into the encoder.
  * INPUT_SIZE is set to the number of bytes actually sunk (in case a
  * buffer was filled.). */
@@ -100,6 +136,11 @@ HEATSHRINK_ENCODER_SINK_RES heatshrink_encoder_sink(heatshrink_encoder *hse,
 HEATSHRINK_ENCODER_POLL_RES heatshrink_encoder_poll(heatshrink_encoder *hse,
     uint8_t *out_buf, size_t out_buf_size, uint16_t *output_size);
 
+/* Once the encoder has finished, get how many bytes beyond the
+ * decompressed size a buffer needs so the output can be decompressed in
+ * place with heatshrink_decoder_in_place. */
+size_t heatshrink_encoder_in_place_margin(heatshrink_encoder *hse);
+
 /* Notify the encoder that the input stream is finished.
  * If the return value is HSER_FINISH_MORE, there is still more output, so
  * call heatshrink_encoder_poll and repeat. */
@@ -0,0 +1,105 @@
+#ifndef HEATSHRINK_ENTROPY_H
+#define HEATSHRINK_ENTROPY_H
+
+#include <stdint.h>
+#include "heatshrink.h"
+
+/* With HEATSHRINK_FORMAT_ENTROPY, the classic tokens are range coded
+ * instead of written out bit for bit. Each token starts with an end flag
+ * (1 only after the last token), then the tag bit, and the literal byte
+ * or the backref index and count, all as usual. Every bit is coded with
+ * an adaptive probability picked by where it is:
+ *
+ *     end flag        one probability
+ *     tag bit         by whether the last token was a backref
+ *     literal         a bit tree, by the bits of the byte so far
+ *     index, count    a bit tree for the top HEATSHRINK_ENTROPY_TREE_BITS
+ *                     bits, then one probability per bit below those
+ *
+ * so literals cost about their order-0 entropy, and near offsets and
+ * short counts cost less than their width. The coder is carryless, so
+ * every coded byte can go out as soon as it's known, and it ends with
+ * the 4 bytes of the coder's low end after the end flag. Both sides
+ * need the model, about 1 KB, which heatshrink_config.h's
+ * HEATSHRINK_USE_ENTROPY_CODER can leave out. */
+
+#define HEATSHRINK_ENTROPY_PROB_BITS 11
+#define HEATSHRINK_ENTROPY_PROB_INIT (1 << (HEATSHRINK_ENTROPY_PROB_BITS - 1))
+#define HEATSHRINK_ENTROPY_MOVE_BITS 5
+#define HEATSHRINK_ENTROPY_TREE_BITS 6
+#define HEATSHRINK_ENTROPY_RANGE_TOP (1UL << 24)
+#define HEATSHRINK_ENTROPY_RANGE_BOT (1UL << 16)
+#define HEATSHRINK_ENTROPY_FINAL_BYTES 4
+
+/* Most bytes coding one bit can take, for the encoder's queue. */
+#define HEATSHRINK_ENTROPY_MAX_BYTES_PER_BIT 4
+
+typedef struct {
+    uint16_t end;
+    uint16_t tag[2];
+    uint16_t literal[256];
+    uint16_t index[(1 << HEATSHRINK_ENTROPY_TREE_BITS)
+        + HEATSHRINK_MAX_WINDOW_BITS];
+    uint16_t count[(1 << HEATSHRINK_ENTROPY_TREE_BITS)
+        + HEATSHRINK_MAX_WINDOW_BITS];
+    uint8_t last_tag;           /* previous token's tag bit */
+} heatshrink_entropy_model;
+
+static inline void heatshrink_entropy_init(heatshrink_entropy_model *m) {
+    uint16_t *probs[] = { &m->end, m->tag, m->literal, m->index, m->count };
+    uint16_t counts[] = { 1, 2, 256, sizeof(m->index) / sizeof(m->index[0]),
+        sizeof(m->count) / sizeof(m->count[0]) };
+    for (int f = 0; f < 5; f++) {
+        for (uint16_t i = 0; i < counts[f]; i++) {
+            probs[f][i] = HEATSHRINK_ENTROPY_PROB_INIT;
+        }
+    }
+    m->last_tag = HEATSHRINK_LITERAL_MARKER;
+}
+
+/* The probability for the next bit of a field in PROBS, which codes its
+ * top TREE_BITS bits with a bit tree, after DONE bits, which were
+ * PREFIX. */
+static inline uint16_t *heatshrink_entropy_prob(uint16_t *probs,
+        uint8_t tree_bits, uint8_t done, uint32_t prefix) {
+    if (done < tree_bits) return &probs[(1UL << done) | prefix];
+    return &probs[(1UL << tree_bits) + done - tree_bits];
+}
+
+/* How many of a BITS-bit index or count field's bits go in the tree. */
+static inline uint8_t heatshrink_entropy_tree_bits(uint8_t bits) {
+    return bits < HEATSHRINK_ENTROPY_TREE_BITS
+        ? bits : HEATSHRINK_ENTROPY_TREE_BITS;
+}
+
+/* Where a bit with probability PROB (of a 0) splits RANGE. */
+static inline uint32_t heatshrink_entropy_bound(uint32_t range, uint16_t prob) {
+    return (range >> HEATSHRINK_ENTROPY_PROB_BITS) * prob;
+}
+
+/* Adapt PROB to having seen BIT. */
+static inline void heatshrink_entropy_update(uint16_t *prob, int bit) {
+    if (bit) {
+        *prob -= *prob >> HEATSHRINK_ENTROPY_MOVE_BITS;
+    } else {
+        *prob += ((1 << HEATSHRINK_ENTROPY_PROB_BITS) - *prob)
+            >> HEATSHRINK_ENTROPY_MOVE_BITS;
+    }
+}
+
+/* Should the coder shift out its top byte? That's once it is settled, or
+ * once *RANGE is too small to go on, in which case *RANGE is cut back to
+ * end at the next multiple of HEATSHRINK_ENTROPY_RANGE_BOT. (Cutting it
+ * again changes nothing, so the decoder can re-check this while it waits
+ * for input.) */
+static inline int heatshrink_entropy_needs_shift(uint32_t low,
+        uint32_t *range) {
+    if ((low ^ (low + *range)) < HEATSHRINK_ENTROPY_RANGE_TOP) return 1;
+    if (*range < HEATSHRINK_ENTROPY_RANGE_BOT) {
+        *range = -low & (HEATSHRINK_ENTROPY_RANGE_BOT - 1);
+        return 1;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,286 @@
+#ifndef HEATSHRINK_FORMAT_H
+#define HEATSHRINK_FORMAT_H
+
+#include <stdint.h>
+#include "heatshrink.h"
+#include "heatshrink_config.h"
+
+/* Format extensions this build can encode and decode. */
+#if HEATSHRINK_USE_EXTENDED_FORMATS && HEATSHRINK_USE_ENTROPY_CODER
+#define HEATSHRINK_FORMATS_SUPPORTED (HEATSHRINK_FORMAT_VARLEN \
+        | HEATSHRINK_FORMAT_REPEAT | HEATSHRINK_FORMAT_LONG \
+        | HEATSHRINK_FORMAT_LITERAL_RUNS | HEATSHRINK_FORMAT_ALIGNED \
+        | HEATSHRINK_FORMAT_ENTROPY)
+#elif HEATSHRINK_USE_EXTENDED_FORMATS
+#define HEATSHRINK_FORMATS_SUPPORTED (HEATSHRINK_FORMAT_VARLEN \
+        | HEATSHRINK_FORMAT_REPEAT | HEATSHRINK_FORMAT_LONG \
+        | HEATSHRINK_FORMAT_LITERAL_RUNS | HEATSHRINK_FORMAT_ALIGNED)
+#else
+#define HEATSHRINK_FORMATS_SUPPORTED HEATSHRINK_FORMAT_CLASSIC
+#endif
+
+/* Can FORMAT be encoded and decoded? HEATSHRINK_FORMAT_ALIGNED and
+ * HEATSHRINK_FORMAT_ENTROPY replace the bit-packed tokens the others
+ * extend, so they only go alone. */
+static inline int heatshrink_format_supported(uint8_t format) {
+    if (format & ~HEATSHRINK_FORMATS_SUPPORTED) return 0;
+    return !(format & (HEATSHRINK_FORMAT_ALIGNED | HEATSHRINK_FORMAT_ENTROPY))
+        || format == HEATSHRINK_FORMAT_ALIGNED
+        || format == HEATSHRINK_FORMAT_ENTROPY;
+}
+
+/* With HEATSHRINK_FORMAT_VARLEN, a backref is
+ *
+ *     [0] [bucket:2] [offset - 1 - bucket base:bucket width] [count code]
+ *
+ * The four buckets are W-6, W-4, W-2 and W bits wide (but at least 3),
+ * each starting where the one before it ends. COUNT - 2 is coded as
+ *
+ *     0   + 1 bit      0..1
+ *     10  + 2 bits     2..5
+ *     110 + 3 bits     6..13
+ *     111 + L bits     14..
+ *
+ * so near, short matches (the common case) are cheap, and the worst case
+ * costs 5 bits more than the classic format. The shortest backref is 8
+ * bits, so the last byte's padding still can't be mistaken for one.
+ *
+ * With HEATSHRINK_FORMAT_REPEAT, every backref's tag bit is followed by
+ * one more bit: 1 reuses the previous backref's offset, and only the
+ * count follows; 0 means the offset and count follow as usual. Fixed-size
+ * records tend to match at the same distance over and over, so such
+ * matches cost a few bits instead of a whole offset. The previous offset
+ * starts out as 1 after a reset. The last byte's padding is all 0s,
+ * which reads as a backref with an explicit offset, so without varlen
+ * the window and lookahead must be too big for one to fit in 7 bits. */
+
+#define HEATSHRINK_REPEAT_INITIAL_OFFSET 1
+
+/* Can FORMAT be used with a window of 2^WINDOW_SZ2 bytes and a
+ * lookahead of 2^LOOKAHEAD_SZ2? */
+static inline int heatshrink_format_fits(uint8_t format,
+        uint8_t window_sz2, uint8_t lookahead_sz2) {
+    if ((format & HEATSHRINK_FORMAT_REPEAT)
+        && !(format & HEATSHRINK_FORMAT_VARLEN)) {
+        return 2 + window_sz2 + lookahead_sz2 > 7;
+    }
+    return 1;
+}
+
+/* With HEATSHRINK_FORMAT_LONG, the largest count code (all 1s) is
+ * followed by an extra count, coded like a varlen offset in buckets 4,
+ * 8, 12 and 16 bits wide, and the backref is that much longer. The
+ * encoder carries a match on past the lookahead, and across refills of
+ * its input buffer, so a long run or repeat (a run of one byte is just
+ * a repeat at offset 1) costs one backref per ~68 KB instead of one per
+ * lookahead. */
+
+#define HEATSHRINK_LONG_EXTRA_MAX_BITS 18
+#define HEATSHRINK_LONG_EXTRA_MAX (16 + 256 + 4096 + 65536 - 1)
+
+/* The count coded by the largest count code, in the classic or varlen
+ * format. */
+static inline uint32_t heatshrink_max_count_code(uint8_t lookahead_sz2,
+        int varlen) {
+    return varlen ? (1UL << lookahead_sz2) + 15 : 1UL << lookahead_sz2;
+}
+
+/* Set *CODE to EXTRA's code, returning its length in bits. */
+static inline uint8_t heatshrink_long_extra_code(uint32_t extra,
+        uint32_t *code) {
+    uint8_t bucket = 0;
+    while (bucket < 3 && extra >= (1UL << (4 + 4*bucket))) {
+        extra -= 1UL << (4 + 4*bucket);
+        bucket++;
+    }
+    *code = ((uint32_t)bucket << (4 + 4*bucket)) | extra;
+    return 2 + 4 + 4*bucket;
+}
+
+/* Read an extra count code from the top of BITS, of which AVAIL are
+ * valid. (UNUSED is for the same signature as the varlen readers.)
+ * Returns the bits it used, or 0 if it needs more. */
+static inline uint8_t heatshrink_long_read_extra(uint64_t bits,
+        uint8_t avail, uint8_t unused, uint32_t *extra) {
+    (void)unused;
+    if (avail < 2) return 0;
+    uint8_t bucket = bits >> 62;
+    uint8_t width = 4 + 4*bucket;
+    if (avail < 2 + width) return 0;
+    uint32_t v = (uint32_t)((bits << 2) >> (64 - width));
+    for (uint8_t b = 0; b < bucket; b++) v += 1UL << (4 + 4*b);
+    *extra = v;
+    return 2 + width;
+}
+
+/* With HEATSHRINK_FORMAT_LITERAL_RUNS, every HEATSHRINK_LITERAL_RUN_AFTER
+ * literals in a row (with no backref in between) are followed by a run
+ * code: a 0 bit for no run, or
+ *
+ *     [1] [run length - 1, coded like a long extra count] [padding] [bytes]
+ *
+ * where the padding (0s) goes up to the next byte boundary, and that many
+ * raw bytes follow. Incompressible stretches then cost 8 bits a byte
+ * instead of 9, and are copied straight through by both sides. */
+
+#define HEATSHRINK_LITERAL_RUN_AFTER 8
+#define HEATSHRINK_LITERAL_RUN_MAX (HEATSHRINK_LONG_EXTRA_MAX + 1)
+#define HEATSHRINK_LITERAL_RUN_MAX_BITS (1 + HEATSHRINK_LONG_EXTRA_MAX_BITS)
+
+/* Set *CODE to the run code for a run of LENGTH bytes (0 for none),
+ * returning its length in bits, not counting the padding. */
+static inline uint8_t heatshrink_literal_run_code(uint32_t length,
+        uint32_t *code) {
+    if (length == 0) {
+        *code = 0;
+        return 1;
+    }
+    uint8_t bits = heatshrink_long_extra_code(length - 1, code);
+    *code |= 1UL << bits;
+    return 1 + bits;
+}
+
+/* Read a run code from the top of BITS, of which AVAIL are valid.
+ * (UNUSED is for the same signature as the varlen readers.) Returns the
+ * bits it used, or 0 if it needs more. */
+static inline uint8_t heatshrink_literal_run_read(uint64_t bits,
+        uint8_t avail, uint8_t unused, uint32_t *length) {
+    if (avail < 1) return 0;
+    if (!(bits >> 63)) {
+        *length = 0;
+        return 1;
+    }
+    uint8_t used = heatshrink_long_read_extra(bits << 1, avail - 1, unused,
+        length);
+    if (used == 0) return 0;
+    *length += 1;
+    return 1 + used;
+}
+
+/* HEATSHRINK_FORMAT_ALIGNED drops the bit packing for whole bytes, like
+ * LZ4, so neither side has to shift bits around. The stream is a series
+ * of sequences:
+ *
+ *     [token] [literal count ext] [literals] [offset:16] [match count ext]
+ *
+ * The token's high nibble is the literal count, and its low nibble the
+ * match count minus HEATSHRINK_ALIGNED_MIN_MATCH. A nibble of 15 is
+ * followed by an extension that adds to it: 7 bits a byte, most
+ * significant first, with the top bit set on all but the last byte.
+ * The offset is big-endian; 0 means the sequence has no match. The last
+ * sequence ends after its literals. */
+
+#define HEATSHRINK_ALIGNED_MIN_MATCH 4
+#define HEATSHRINK_ALIGNED_NIBBLE_MAX 15
+#define HEATSHRINK_ALIGNED_EXT_MAX_BYTES 3
+
+/* Set *CODE to the extension for VALUE, returning its length in bits. */
+static inline uint8_t heatshrink_aligned_ext_code(uint32_t value,
+        uint32_t *code) {
+    uint8_t bytes = 1;
+    uint32_t c = value & 0x7F;
+    while ((value >>= 7) > 0 && bytes < HEATSHRINK_ALIGNED_EXT_MAX_BYTES) {
+        c |= ((value & 0x7F) | 0x80) << (8 * bytes);
+        bytes++;
+    }
+    *code = c;
+    return 8 * bytes;
+}
+
+/* Read an extension from the top of BITS, of which AVAIL are valid.
+ * (UNUSED is for the same signature as the varlen readers.) Returns the
+ * bits it used, or 0 if it needs more. */
+static inline uint8_t heatshrink_aligned_read_ext(uint64_t bits,
+        uint8_t avail, uint8_t unused, uint32_t *value) {
+    (void)unused;
+    uint32_t v = 0;
+    uint8_t bytes = 0;
+    while (bytes < HEATSHRINK_ALIGNED_EXT_MAX_BYTES) {
+        if (avail < 8 * (bytes + 1)) return 0;
+        uint8_t byte = bits >> (56 - 8 * bytes);
+        v = (v << 7) | (byte & 0x7F);
+        bytes++;
+        if (!(byte & 0x80)) break;
+    }
+    *value = v;
+    return 8 * bytes;
+}
+
+#define HEATSHRINK_VARLEN_MIN_COUNT 2
+#define HEATSHRINK_VARLEN_OFFSET_MAX_BITS(W) (2 + (W))
+#define HEATSHRINK_VARLEN_COUNT_MAX_BITS(L) (3 + (L))
+
+static inline uint8_t heatshrink_varlen_bucket_width(uint8_t window_sz2,
+        uint8_t bucket) {
+    int width = bucket == 3 ? window_sz2 : window_sz2 - 6 + 2*bucket;
+    return width < 3 ? 3 : width;
+}
+
+/* Set *CODE to NEG_OFFSET's code, returning its length in bits. */
+static inline uint8_t heatshrink_varlen_offset_code(uint8_t window_sz2,
+        uint32_t neg_offset, uint32_t *code) {
+    uint32_t v = neg_offset - 1;
+    uint8_t bucket = 0;
+    uint8_t width = heatshrink_varlen_bucket_width(window_sz2, 0);
+    while (bucket < 3 && v >= (1UL << width)) {
+        v -= 1UL << width;
+        width = heatshrink_varlen_bucket_width(window_sz2, ++bucket);
+    }
+    *code = ((uint32_t)bucket << width) | v;
+    return 2 + width;
+}
+
+/* Set *CODE to COUNT's code, returning its length in bits. */
+static inline uint8_t heatshrink_varlen_count_code(uint8_t lookahead_sz2,
+        uint32_t count, uint32_t *code) {
+    uint32_t n = count - HEATSHRINK_VARLEN_MIN_COUNT;
+    if (n < 2) {
+        *code = n;
+        return 2;
+    } else if (n < 6) {
+        *code = 0x08 | (n - 2);
+        return 4;
+    } else if (n < 14) {
+        *code = 0x30 | (n - 6);
+        return 6;
+    }
+    *code = (0x07UL << lookahead_sz2) | (n - 14);
+    return 3 + lookahead_sz2;
+}
+
+/* Read an offset code from the top of BITS, of which AVAIL are valid.
+ * Returns the bits it used, or 0 if it needs more. */
+static inline uint8_t heatshrink_varlen_read_offset(uint64_t bits,
+        uint8_t avail, uint8_t window_sz2, uint32_t *neg_offset) {
+    if (avail < 2) return 0;
+    uint8_t bucket = bits >> 62;
+    uint8_t width = heatshrink_varlen_bucket_width(window_sz2, bucket);
+    if (avail < 2 + width) return 0;
+    uint32_t v = (uint32_t)((bits << 2) >> (64 - width));
+    for (uint8_t b = 0; b < bucket; b++) {
+        v += 1UL << heatshrink_varlen_bucket_width(window_sz2, b);
+    }
+    *neg_offset = v + 1;
+    return 2 + width;
+}
+
+/* Read a count code from the top of BITS, of which AVAIL are valid.
+ * Returns the bits it used, or 0 if it needs more. */
+static inline uint8_t heatshrink_varlen_read_count(uint64_t bits,
+        uint8_t avail, uint8_t lookahead_sz2, uint32_t *count) {
+    static const uint8_t base[] = { 0, 2, 6, 14 };
+    uint8_t ones = 0;
+    while (ones < 3) {
+        if (ones >= avail) return 0;
+        if (!((bits << ones) >> 63)) break;
+        ones++;
+    }
+    uint8_t prefix = ones < 3 ? ones + 1 : 3;
+    uint8_t width = ones < 3 ? ones + 1 : lookahead_sz2;
+    if (avail < prefix + width) return 0;
+    *count = (uint32_t)((bits << prefix) >> (64 - width))
+        + base[ones] + HEATSHRINK_VARLEN_MIN_COUNT;
+    return prefix + width;
+}
+
+#endif
@@ -0,0 +1,320 @@
+#include <stdlib.h>
+#include <string.h>
+#include "heatshrink_frame.h"
+
+#if HEATSHRINK_DEBUGGING_LOGS
+#include <stdio.h>
+#define LOG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define LOG(...) /* no-op */
+#endif
+
+/* The encoder reports progress in uint16_t, so never offer it more than
+ * this per call. */
+#define MAX_CHUNK 0xFFFF
+
+static void write_u32le(uint8_t *buf, uint32_t v) {
+    buf[0] = v & 0xFF;
+    buf[1] = (v >> 8) & 0xFF;
+    buf[2] = (v >> 16) & 0xFF;
+    buf[3] = (v >> 24) & 0xFF;
+}
+
+static uint32_t read_u32le(const uint8_t *buf) {
+    return (uint32_t)buf[0] | ((uint32_t)buf[1] << 8)
+        | ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static void write_header(uint8_t *buf, uint8_t type,
+        uint32_t raw_size, uint32_t payload_size, uint32_t crc) {
+    buf[0] = type | HSF_BLOCK_CHECKED;
+    write_u32le(&buf[1], raw_size);
+    write_u32le(&buf[5], payload_size);
+    write_u32le(&buf[9], crc);
+}
+
+/* Compress IN into OUT, giving up once the output reaches LIMIT bytes.
+ * Returns the compressed size, or LIMIT if it didn't fit. */
+static size_t compress_bounded(heatshrink_encoder *hse,
+        const uint8_t *dict, size_t dict_size,
+        uint8_t *in, size_t in_size, uint8_t *out, size_t limit) {
+    size_t sunk = 0;
+    size_t polled = 0;
+    uint16_t count = 0;
+    heatshrink_encoder_reset(hse);
+    if (heatshrink_encoder_prime(hse, dict, dict_size) < 0) return limit;
+
+    for (;;) {
+        if (sunk < in_size) {
+            size_t rem = in_size - sunk;
+            if (rem > MAX_CHUNK) rem = MAX_CHUNK;
+            if (heatshrink_encoder_sink(hse, &in[sunk], rem, &count) < 0) {
+                return limit;
+            }
+            sunk += count;
+        } else if (heatshrink_encoder_finish(hse) == HSER_FINISH_DONE) {
+            return polled;
+        }
+
+        HEATSHRINK_ENCODER_POLL_RES pres;
+        do {
+            size_t room = limit - polled;
+            if (room == 0) return limit;
+            if (room > MAX_CHUNK) room = MAX_CHUNK;
+            pres = heatshrink_encoder_poll(hse, &out[polled], room, &count);
+            if (pres < 0) return limit;
+            polled += count;
+        } while (pres == HSER_POLL_MORE);
+    }
+}
+
+HEATSHRINK_FRAME_RES heatshrink_frame_encode_block(heatshrink_encoder *hse,
+        uint8_t *in_buf, size_t in_size,
+        uint8_t *out_buf, size_t out_buf_size, size_t *output_size) {
+    return heatshrink_frame_encode_block_primed(hse, NULL, 0,
+        in_buf, in_size, out_buf, out_buf_size, output_size);
+}
+
+HEATSHRINK_FRAME_RES heatshrink_frame_encode_block_primed(
+        heatshrink_encoder *hse, const uint8_t *dict, size_t dict_size,
+        uint8_t *in_buf, size_t in_size,
+        uint8_t *out_buf, size_t out_buf_size, size_t *output_size) {
+    if ((hse == NULL) || (in_buf == NULL) || (out_buf == NULL)
+        || (output_size == NULL) || (dict == NULL && dict_size > 0)) {
+        return HSFR_ERROR_NULL;
+    }
+    if (in_size > HEATSHRINK_FRAME_MAX_BLOCK_SIZE) return HSFR_ERROR_CORRUPT;
+
+    size_t hdr_sz = HEATSHRINK_FRAME_MAX_HEADER_SIZE;
+    if (out_buf_size < hdr_sz) return HSFR_ERROR_OUTPUT_FULL;
+    uint32_t crc = heatshrink_crc32(0, in_buf, in_size);
+
+    /* Only keep the compressed form if it's strictly smaller. */
+    size_t limit = out_buf_size - hdr_sz;
+    if (limit > in_size) limit = in_size;
+    size_t comp_sz = compress_bounded(hse, dict, dict_size, in_buf, in_size,
+        &out_buf[hdr_sz], limit);
+
+    if (comp_sz < in_size) {
+        LOG("-- frame: compressed block %zu -> %zu\n", in_size, comp_sz);
+        uint8_t type = HSF_BLOCK_COMPRESSED;
+        if (dict_size > 0) type |= HSF_BLOCK_PRIMED;
+        write_header(out_buf, type, in_size, comp_sz, crc);
+        *output_size = hdr_sz + comp_sz;
+        return HSFR_OK;
+    }
+
+    if (out_buf_size - hdr_sz < in_size) return HSFR_ERROR_OUTPUT_FULL;
+    LOG("-- frame: storing incompressible block of %zu\n", in_size);
+    write_header(out_buf, HSF_BLOCK_STORED, in_size, in_size, crc);
+    memcpy(&out_buf[hdr_sz], in_buf, in_size);
+    *output_size = hdr_sz + in_size;
+    return HSFR_OK;
+}
+
+static const uint8_t index_magic[] = { 'H', 'S', 'Z', 'X' };
+
+HEATSHRINK_FRAME_RES heatshrink_frame_write_index(const uint64_t *offsets,
+        uint32_t count, uint32_t block_size,
+        uint8_t *out_buf, size_t out_buf_size, size_t *output_size) {
+    if ((offsets == NULL && count > 0) || (out_buf == NULL)
+        || (output_size == NULL)) {
+        return HSFR_ERROR_NULL;
+    }
+    size_t index_sz = HEATSHRINK_FRAME_INDEX_BOUND(count);
+    if (index_sz > UINT32_MAX) return HSFR_ERROR_CORRUPT;
+    if (out_buf_size < index_sz) return HSFR_ERROR_OUTPUT_FULL;
+
+    size_t hdr_sz = HEATSHRINK_FRAME_HEADER_SIZE;
+    out_buf[0] = HSF_BLOCK_INDEX;
+    write_u32le(&out_buf[1], 0);
+    write_u32le(&out_buf[5], index_sz - hdr_sz);
+    uint8_t *p = &out_buf[hdr_sz];
+    for (uint32_t i = 0; i < count; i++) {
+        write_u32le(p, offsets[i] & 0xFFFFFFFF);
+        write_u32le(&p[4], offsets[i] >> 32);
+        p += 8;
+    }
+    write_u32le(p, block_size);
+    write_u32le(&p[4], count);
+    write_u32le(&p[8], index_sz);
+    memcpy(&p[12], index_magic, sizeof(index_magic));
+    *output_size = index_sz;
+    return HSFR_OK;
+}
+
+HEATSHRINK_FRAME_RES heatshrink_frame_write_end(uint64_t raw_total,
+        uint8_t *out_buf, size_t out_buf_size, size_t *output_size) {
+    if ((out_buf == NULL) || (output_size == NULL)) return HSFR_ERROR_NULL;
+    if (out_buf_size < HEATSHRINK_FRAME_END_SIZE) return HSFR_ERROR_OUTPUT_FULL;
+    out_buf[0] = HSF_BLOCK_END;
+    write_u32le(&out_buf[1], 0);
+    write_u32le(&out_buf[5], 8);
+    write_u32le(&out_buf[9], raw_total & 0xFFFFFFFF);
+    write_u32le(&out_buf[13], raw_total >> 32);
+    *output_size = HEATSHRINK_FRAME_END_SIZE;
+    return HSFR_OK;
+}
+
+HEATSHRINK_FRAME_RES heatshrink_frame_read_end(const uint8_t *in_buf,
+        size_t size, uint64_t *raw_total) {
+    if ((in_buf == NULL) || (raw_total == NULL)) return HSFR_ERROR_NULL;
+    heatshrink_frame_header h;
+    HEATSHRINK_FRAME_RES res = heatshrink_frame_read_header(in_buf, size, &h);
+    if (res != HSFR_OK) return res;
+    if (h.type != HSF_BLOCK_END) return HSFR_ERROR_CORRUPT;
+    if (size < HEATSHRINK_FRAME_END_SIZE) return HSFR_MORE;
+    *raw_total = read_u32le(&in_buf[9])
+        | ((uint64_t)read_u32le(&in_buf[13]) << 32);
+    return HSFR_OK;
+}
+
+HEATSHRINK_FRAME_RES heatshrink_frame_read_index_trailer(const uint8_t *buf,
+        heatshrink_frame_index_trailer *trailer) {
+    if ((buf == NULL) || (trailer == NULL)) return HSFR_ERROR_NULL;
+    if (0 != memcmp(&buf[12], index_magic, sizeof(index_magic))) {
+        return HSFR_ERROR_CORRUPT;
+    }
+    trailer->block_size = read_u32le(buf);
+    trailer->block_count = read_u32le(&buf[4]);
+    trailer->index_size = read_u32le(&buf[8]);
+    if (trailer->index_size != HEATSHRINK_FRAME_INDEX_BOUND(trailer->block_count)
+        || trailer->block_size == 0
+        || trailer->block_size > HEATSHRINK_FRAME_MAX_BLOCK_SIZE) {
+        return HSFR_ERROR_CORRUPT;
+    }
+    return HSFR_OK;
+}
+
+HEATSHRINK_FRAME_RES heatshrink_frame_read_header(const uint8_t *in_buf,
+        size_t size, heatshrink_frame_header *header) {
+    if ((in_buf == NULL) || (header == NULL)) return HSFR_ERROR_NULL;
+    if (size < HEATSHRINK_FRAME_HEADER_SIZE) return HSFR_MORE;
+
+    header->type = in_buf[0];
+    header->raw_size = read_u32le(&in_buf[1]);
+    header->payload_size = read_u32le(&in_buf[5]);
+    header->crc = 0;
+    header->header_size = HEATSHRINK_FRAME_HEADER_SIZE;
+
+    if (header->raw_size > HEATSHRINK_FRAME_MAX_BLOCK_SIZE) return HSFR_ERROR_CORRUPT;
+    uint8_t flags = header->type & ~HSF_BLOCK_TYPE_MASK;
+    if (flags & ~(HSF_BLOCK_PRIMED | HSF_BLOCK_CHECKED)) return HSFR_ERROR_CORRUPT;
+    switch (header->type & HSF_BLOCK_TYPE_MASK) {
+    case HSF_BLOCK_COMPRESSED:
+        if (header->payload_size >= header->raw_size) return HSFR_ERROR_CORRUPT;
+        break;
+    case HSF_BLOCK_STORED:
+        if (header->payload_size != header->raw_size) return HSFR_ERROR_CORRUPT;
+        if (flags & HSF_BLOCK_PRIMED) return HSFR_ERROR_CORRUPT;
+        break;
+    case HSF_BLOCK_END:
+        if (flags != 0 || header->raw_size != 0) return HSFR_ERROR_CORRUPT;
+        if (header->payload_size != 8) return HSFR_ERROR_CORRUPT;
+        break;
+    case HSF_BLOCK_INDEX:
+        if (flags != 0 || header->raw_size != 0) return HSFR_ERROR_CORRUPT;
+        if (header->payload_size < HEATSHRINK_FRAME_INDEX_TRAILER_SIZE
+            || header->payload_size % 8 != 0) {
+            return HSFR_ERROR_CORRUPT;
+        }
+        break;
+    default:
+        return HSFR_ERROR_CORRUPT;
+    }
+
+    if (flags & HSF_BLOCK_CHECKED) {
+        header->header_size = HEATSHRINK_FRAME_MAX_HEADER_SIZE;
+        if (size < header->header_size) return HSFR_MORE;
+        header->crc = read_u32le(&in_buf[9]);
+    }
+    return HSFR_OK;
+}
+
+/* Expand exactly RAW_SIZE bytes from the compressed payload IN. */
+static HEATSHRINK_FRAME_RES decompress_exact(heatshrink_decoder *hsd,
+        const uint8_t *dict, size_t dict_size,
+        uint8_t *in, size_t in_size, uint8_t *out, size_t raw_size) {
+    size_t used = 0;
+    size_t polled = 0;
+    size_t in_count = 0;
+    size_t out_count = 0;
+    heatshrink_decoder_reset(hsd);
+    if (heatshrink_decoder_prime(hsd, dict, dict_size) < 0) {
+        return HSFR_ERROR_NULL;
+    }
+
+    HEATSHRINK_DECODER_POLL_RES pres;
+    do {
+        pres = heatshrink_decoder_poll_span(hsd, &in[used], in_size - used,
+            &in_count, &out[polled], raw_size - polled, &out_count);
+        if (pres < 0) return HSFR_ERROR_CORRUPT;
+        used += in_count;
+        polled += out_count;
+    } while (pres == HSDR_POLL_MORE && polled < raw_size);
+
+    if (pres == HSDR_POLL_MORE) {
+        /* Any output past RAW_SIZE means the header lied. */
+        uint8_t extra = 0;
+        pres = heatshrink_decoder_poll_span(hsd, &in[used], in_size - used,
+            &in_count, &extra, 1, &out_count);
+        if (pres < 0 || out_count > 0) return HSFR_ERROR_CORRUPT;
+        used += in_count;
+    }
+
+    if (used != in_size || polled != raw_size) return HSFR_ERROR_CORRUPT;
+    if (heatshrink_decoder_finish(hsd) != HSDR_FINISH_DONE) {
+        return HSFR_ERROR_CORRUPT;
+    }
+    return HSFR_OK;
+}
+
+HEATSHRINK_FRAME_RES heatshrink_frame_decode_block(heatshrink_decoder *hsd,
+        uint8_t *in_buf, size_t in_size, size_t *input_size,
+        uint8_t *out_buf, size_t out_buf_size, size_t *output_size) {
+    return heatshrink_frame_decode_block_primed(hsd, NULL, 0,
+        in_buf, in_size, input_size, out_buf, out_buf_size, output_size);
+}
+
+HEATSHRINK_FRAME_RES heatshrink_frame_decode_block_primed(
+        heatshrink_decoder *hsd, const uint8_t *dict, size_t dict_size,
+        uint8_t *in_buf, size_t in_size, size_t *input_size,
+        uint8_t *out_buf, size_t out_buf_size, size_t *output_size) {
+    if ((hsd == NULL) || (in_buf == NULL) || (input_size == NULL)
+        || (out_buf == NULL) || (output_size == NULL)
+        || (dict == NULL && dict_size > 0)) {
+        return HSFR_ERROR_NULL;
+    }
+
+    heatshrink_frame_header h;
+    HEATSHRINK_FRAME_RES res = heatshrink_frame_read_header(in_buf, in_size, &h);
+    if (res != HSFR_OK) return res;
+
+    size_t hdr_sz = h.header_size;
+    if (in_size - hdr_sz < h.payload_size) return HSFR_MORE;
+    if (out_buf_size < h.raw_size) return HSFR_ERROR_OUTPUT_FULL;
+    if (!(h.type & HSF_BLOCK_PRIMED)) {
+        dict_size = 0;
+    } else if (dict_size == 0) {
+        return HSFR_ERROR_NO_DICTIONARY;
+    }
+
+    uint8_t *payload = &in_buf[hdr_sz];
+    if (h.raw_size == 0) {
+        /* index and end blocks have nothing to output */
+    } else if ((h.type & HSF_BLOCK_TYPE_MASK) == HSF_BLOCK_STORED) {
+        memcpy(out_buf, payload, h.raw_size);
+    } else {
+        res = decompress_exact(hsd, dict, dict_size, payload, h.payload_size,
+            out_buf, h.raw_size);
+        if (res != HSFR_OK) return res;
+    }
+    if ((h.type & HSF_BLOCK_CHECKED)
+        && heatshrink_crc32(0, out_buf, h.raw_size) != h.crc) {
+        return HSFR_ERROR_CHECKSUM;
+    }
+
+    *input_size = hdr_sz + h.payload_size;
+    *output_size = h.raw_size;
+    return HSFR_OK;
+}
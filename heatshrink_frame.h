@@ -0,0 +1,156 @@
+#ifndef HEATSHRINK_FRAME_H
+#define HEATSHRINK_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "heatshrink.h"
+#include "heatshrink_config.h"
+#include "heatshrink_encoder.h"
+#include "heatshrink_decoder.h"
+#include "heatshrink_crc32.h"
+
+/* Block framing: the input is split into blocks, each of which is
+ * compressed independently and prefixed with a small header:
+ *
+ *     [type:u8] [raw size:u32le] [payload size:u32le]
+ *     [CRC-32 of raw block:u32le, if HSF_BLOCK_CHECKED] [payload...]
+ *
+ * Blocks that don't shrink when compressed are stored as-is, so
+ * incompressible data expands by at most HEATSHRINK_FRAME_MAX_HEADER_SIZE
+ * bytes per block.
+ *
+ * A block can be primed with the end of the block before it as a
+ * dictionary (see heatshrink_encoder_prime), which costs less ratio
+ * than starting from an empty window, but then needs that block's
+ * output to decode. */
+
+#define HEATSHRINK_FRAME_HEADER_SIZE 9
+#define HEATSHRINK_FRAME_MAX_HEADER_SIZE 13
+
+typedef enum {
+    HSF_BLOCK_COMPRESSED = 0x01, /* heatshrink-compressed payload */
+    HSF_BLOCK_STORED = 0x02,     /* payload is the raw block */
+    HSF_BLOCK_INDEX = 0x03,      /* seek index; decodes to nothing */
+    HSF_BLOCK_END = 0x04,        /* end of stream; decodes to nothing */
+} HEATSHRINK_FRAME_BLOCK_TYPE;
+
+#define HSF_BLOCK_TYPE_MASK 0x0F
+#define HSF_BLOCK_PRIMED 0x40   /* decode with the previous block's tail */
+#define HSF_BLOCK_CHECKED 0x80  /* header ends with the raw block's CRC */
+
+typedef enum {
+    HSFR_OK,                    /* block was encoded / decoded */
+    HSFR_MORE,                  /* more input is needed */
+    HSFR_ERROR_NULL=-1,         /* NULL argument */
+    HSFR_ERROR_OUTPUT_FULL=-2,  /* output buffer too small */
+    HSFR_ERROR_CORRUPT=-3,      /* malformed or inconsistent block */
+    HSFR_ERROR_NO_DICTIONARY=-4, /* primed block, but no dictionary given */
+    HSFR_ERROR_CHECKSUM=-5,     /* decoded block doesn't match its CRC */
+} HEATSHRINK_FRAME_RES;
+
+typedef struct {
+    uint8_t type;               /* HEATSHRINK_FRAME_BLOCK_TYPE */
+    uint32_t raw_size;          /* size of the block once decoded */
+    uint32_t payload_size;      /* bytes following the header */
+    uint32_t crc;               /* only meaningful with HSF_BLOCK_CHECKED */
+    uint8_t header_size;
+} heatshrink_frame_header;
+
+/* Largest raw block size, so a decoder can trust a header's raw size
+ * enough to allocate for it. */
+#define HEATSHRINK_FRAME_MAX_BLOCK_SIZE (1UL << 24)
+
+/* Worst-case framed size for a block of SIZE bytes. */
+#define HEATSHRINK_FRAME_BLOCK_BOUND(SIZE) \
+    (HEATSHRINK_FRAME_MAX_HEADER_SIZE + (SIZE))
+
+/* Compress IN_SIZE bytes from IN_BUF as a single block, writing the
+ * header and payload to OUT_BUF and setting *OUTPUT_SIZE to the number of
+ * bytes written. HSE is reset first. If compressing doesn't save any space,
+ * a stored block is written instead. IN_SIZE can be at most
+ * HEATSHRINK_FRAME_MAX_BLOCK_SIZE, and OUT_BUF_SIZE should be at least
+ * HEATSHRINK_FRAME_BLOCK_BOUND(IN_SIZE). */
+HEATSHRINK_FRAME_RES heatshrink_frame_encode_block(heatshrink_encoder *hse,
+    uint8_t *in_buf, size_t in_size,
+    uint8_t *out_buf, size_t out_buf_size, size_t *output_size);
+
+/* Like heatshrink_frame_encode_block, but prime the encoder with
+ * DICT_SIZE bytes from DICT, normally the end of the previous block. */
+HEATSHRINK_FRAME_RES heatshrink_frame_encode_block_primed(
+    heatshrink_encoder *hse, const uint8_t *dict, size_t dict_size,
+    uint8_t *in_buf, size_t in_size,
+    uint8_t *out_buf, size_t out_buf_size, size_t *output_size);
+
+/* A framed stream ends with an end block, whose payload is the total
+ * raw size of the stream's blocks as a u64le. Since the end is explicit,
+ * framed streams (each with its own container header, if any) can be
+ * concatenated, and decode to the concatenation of their contents. */
+
+#define HEATSHRINK_FRAME_END_SIZE (HEATSHRINK_FRAME_HEADER_SIZE + 8)
+
+/* Write an end block for a stream of RAW_TOTAL bytes, setting
+ * *OUTPUT_SIZE to HEATSHRINK_FRAME_END_SIZE. */
+HEATSHRINK_FRAME_RES heatshrink_frame_write_end(uint64_t raw_total,
+    uint8_t *out_buf, size_t out_buf_size, size_t *output_size);
+
+/* Read the raw total from the end block at the start of IN_BUF. */
+HEATSHRINK_FRAME_RES heatshrink_frame_read_end(const uint8_t *in_buf,
+    size_t size, uint64_t *raw_total);
+
+/* A seekable stream is a container with HSZ_FLAG_SEEKABLE, blocks that
+ * all hold BLOCK_SIZE raw bytes (except the last) and aren't primed,
+ * then an index block (before the end block) whose payload is
+ *
+ *     [offset of each block from the first:u64le]...
+ *     [block size:u32le] [block count:u32le] [index block size:u32le]
+ *     ["HSZX"]
+ *
+ * so the index can be found from the end of the stream. Sequential
+ * decoders just skip it. Concatenated seekable streams still decode in
+ * order, but heatshrink_reader can't seek within them. */
+
+#define HEATSHRINK_FRAME_INDEX_TRAILER_SIZE 16
+#define HEATSHRINK_FRAME_INDEX_BOUND(COUNT) \
+    (HEATSHRINK_FRAME_HEADER_SIZE + 8 * (size_t)(COUNT) \
+        + HEATSHRINK_FRAME_INDEX_TRAILER_SIZE)
+
+typedef struct {
+    uint32_t block_size;        /* raw size of every block but the last */
+    uint32_t block_count;
+    uint32_t index_size;        /* whole index block, header included */
+} heatshrink_frame_index_trailer;
+
+/* Write an index block for COUNT blocks at OFFSETS, setting
+ * *OUTPUT_SIZE to its size, at most HEATSHRINK_FRAME_INDEX_BOUND(COUNT). */
+HEATSHRINK_FRAME_RES heatshrink_frame_write_index(const uint64_t *offsets,
+    uint32_t count, uint32_t block_size,
+    uint8_t *out_buf, size_t out_buf_size, size_t *output_size);
+
+/* Parse the trailer in the last HEATSHRINK_FRAME_INDEX_TRAILER_SIZE
+ * bytes of a seekable stream, at BUF. */
+HEATSHRINK_FRAME_RES heatshrink_frame_read_index_trailer(const uint8_t *buf,
+    heatshrink_frame_index_trailer *trailer);
+
+/* Parse a block header from the first SIZE bytes of IN_BUF.
+ * Returns HSFR_MORE if SIZE is too short to hold the whole header. */
+HEATSHRINK_FRAME_RES heatshrink_frame_read_header(const uint8_t *in_buf,
+    size_t size, heatshrink_frame_header *header);
+
+/* Decode the block at the start of IN_BUF into OUT_BUF. HSD must have
+ * the same window and lookahead settings as the encoder; it is reset
+ * first. *INPUT_SIZE is set to the size of the whole block (header and
+ * payload), *OUTPUT_SIZE to the decoded size. Returns HSFR_MORE if IN_BUF
+ * doesn't hold the whole block yet. */
+HEATSHRINK_FRAME_RES heatshrink_frame_decode_block(heatshrink_decoder *hsd,
+    uint8_t *in_buf, size_t in_size, size_t *input_size,
+    uint8_t *out_buf, size_t out_buf_size, size_t *output_size);
+
+/* Like heatshrink_frame_decode_block, but with the previous block's
+ * output as DICT, in case the block was primed with it. Returns
+ * HSFR_ERROR_NO_DICTIONARY if the block is primed and DICT_SIZE is 0. */
+HEATSHRINK_FRAME_RES heatshrink_frame_decode_block_primed(
+    heatshrink_decoder *hsd, const uint8_t *dict, size_t dict_size,
+    uint8_t *in_buf, size_t in_size, size_t *input_size,
+    uint8_t *out_buf, size_t out_buf_size, size_t *output_size);
+
+#endif
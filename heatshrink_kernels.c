@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <string.h>
+#include "heatshrink_kernels.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_KERNELS 1
+#include <immintrin.h>
+#else
+#define X86_KERNELS 0
+#endif
+
+static uint16_t match_length_scalar(const uint8_t *a, const uint8_t *b,
+        uint16_t maxlen) {
+    uint16_t len = 0;
+    while (len < maxlen && a[len] == b[len]) len++;
+    return len;
+}
+
+static const heatshrink_kernels scalar = {
+    "scalar", match_length_scalar,
+};
+
+#if X86_KERNELS
+/* The wide loops never load bytes at or past MAXLEN; the tail is done
+ * with the next narrower kernel. */
+__attribute__((target("sse4.2")))
+static uint16_t match_length_sse42(const uint8_t *a, const uint8_t *b,
+        uint16_t maxlen) {
+    uint16_t len = 0;
+    while (len + 16 <= maxlen) {
+        __m128i va = _mm_loadu_si128((const __m128i *)&a[len]);
+        __m128i vb = _mm_loadu_si128((const __m128i *)&b[len]);
+        unsigned diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xFFFF;
+        if (diff) return len + __builtin_ctz(diff);
+        len += 16;
+    }
+    return len + match_length_scalar(&a[len], &b[len], maxlen - len);
+}
+
+__attribute__((target("avx2")))
+static uint16_t match_length_avx2(const uint8_t *a, const uint8_t *b,
+        uint16_t maxlen) {
+    uint16_t len = 0;
+    while (len + 32 <= maxlen) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)&a[len]);
+        __m256i vb = _mm256_loadu_si256((const __m256i *)&b[len]);
+        unsigned diff = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+        if (diff) return len + __builtin_ctz(diff);
+        len += 32;
+    }
+    return len + match_length_sse42(&a[len], &b[len], maxlen - len);
+}
+
+static const heatshrink_kernels sse42 = {
+    "sse4.2", match_length_sse42,
+};
+
+static const heatshrink_kernels avx2 = {
+    "avx2", match_length_avx2,
+};
+#endif
+
+/* Kernel sets the CPU can run, from slowest to fastest. */
+static size_t usable_kernels(const heatshrink_kernels **usable) {
+    size_t count = 0;
+    usable[count++] = &scalar;
+#if X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) usable[count++] = &sse42;
+    if (__builtin_cpu_supports("avx2")) usable[count++] = &avx2;
+#endif
+    return count;
+}
+
+const heatshrink_kernels *heatshrink_kernels_by_name(const char *name) {
+    const heatshrink_kernels *usable[3];
+    size_t count = usable_kernels(usable);
+    for (size_t i = 0; i < count; i++) {
+        if (0 == strcmp(name, usable[i]->name)) return usable[i];
+    }
+    return NULL;
+}
+
+#if X86_KERNELS
+static const heatshrink_kernels *select_kernels(void) {
+    const char *force = getenv("HEATSHRINK_KERNELS");
+    if (force != NULL) {
+        const heatshrink_kernels *k = heatshrink_kernels_by_name(force);
+        if (k != NULL) return k;
+    }
+    const heatshrink_kernels *usable[3];
+    return usable[usable_kernels(usable) - 1];
+}
+
+/* Chosen once at load time, before any threads can ask for it. */
+static const heatshrink_kernels *kernels = NULL;
+
+__attribute__((constructor))
+static void init_kernels(void) {
+    kernels = select_kernels();
+}
+
+const heatshrink_kernels *heatshrink_kernels_get(void) {
+    /* Only another constructor could get here first. */
+    return kernels != NULL ? kernels : select_kernels();
+}
+#else
+const heatshrink_kernels *heatshrink_kernels_get(void) {
+    return &scalar;             /* the only set there is */
+}
+#endif
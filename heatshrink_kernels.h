@@ -0,0 +1,24 @@
+#ifndef HEATSHRINK_KERNELS_H
+#define HEATSHRINK_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Inner loops with CPU-specific implementations. One set is chosen when
+ * the library loads, from what the CPU supports; setting the environment
+ * variable HEATSHRINK_KERNELS to "scalar", "sse4.2" or "avx2" picks that
+ * set instead, if the CPU can run it. */
+typedef struct {
+    const char *name;
+
+    /* How many of the first MAXLEN bytes at A and B match. */
+    uint16_t (*match_length)(const uint8_t *a, const uint8_t *b,
+        uint16_t maxlen);
+} heatshrink_kernels;
+
+const heatshrink_kernels *heatshrink_kernels_get(void);
+
+/* Get the kernels called NAME, or NULL if the CPU can't run them. */
+const heatshrink_kernels *heatshrink_kernels_by_name(const char *name);
+
+#endif
@@ -0,0 +1,500 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include "heatshrink_parallel.h"
+
+#if HEATSHRINK_USE_THREADS && HEATSHRINK_DYNAMIC_ALLOC
+#include <pthread.h>
+#include <unistd.h>
+
+/*************
+ * Thread pool
+ *************/
+
+/* Run task INDEX of a batch, on worker thread WORKER. */
+typedef void pool_task(void *udata, size_t worker, size_t index);
+
+typedef struct pool pool;
+
+typedef struct {
+    pool *p;
+    size_t id;
+    pthread_t thread;
+} pool_worker;
+
+/* Runs batches of numbered tasks. The caller waits for them one at a
+ * time, in order, so it can consume each result while later tasks are
+ * still running. */
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* tasks queued, or shutting down */
+    pthread_cond_t done;        /* a task finished */
+    pool_task *task;
+    void *udata;
+    size_t next;                /* next task to start */
+    size_t count;               /* tasks in the current batch */
+    uint8_t *finished;          /* per task in the current batch */
+    size_t finished_cap;
+    int shutdown;
+    size_t worker_count;
+    pool_worker workers[];
+};
+
+static void *pool_run_worker(void *arg) {
+    pool_worker *w = arg;
+    pool *p = w->p;
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->shutdown && p->next >= p->count) {
+            pthread_cond_wait(&p->work, &p->lock);
+        }
+        if (p->shutdown) break;
+        size_t index = p->next++;
+        pthread_mutex_unlock(&p->lock);
+
+        p->task(p->udata, w->id, index);
+
+        pthread_mutex_lock(&p->lock);
+        p->finished[index] = 1;
+        pthread_cond_broadcast(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+static void pool_free(pool *p);
+
+static pool *pool_alloc(size_t worker_count) {
+    pool *p = malloc(sizeof(*p) + worker_count * sizeof(pool_worker));
+    if (p == NULL) return NULL;
+    memset(p, 0, sizeof(*p));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    for (size_t i = 0; i < worker_count; i++) {
+        p->workers[i].p = p;
+        p->workers[i].id = i;
+        if (pthread_create(&p->workers[i].thread, NULL,
+                pool_run_worker, &p->workers[i]) != 0) {
+            pool_free(p);
+            return NULL;
+        }
+        p->worker_count++;
+    }
+    return p;
+}
+
+static void pool_free(pool *p) {
+    if (p == NULL) return;
+    pthread_mutex_lock(&p->lock);
+    p->shutdown = 1;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    for (size_t i = 0; i < p->worker_count; i++) {
+        pthread_join(p->workers[i].thread, NULL);
+    }
+    pthread_cond_destroy(&p->done);
+    pthread_cond_destroy(&p->work);
+    pthread_mutex_destroy(&p->lock);
+    free(p->finished);
+    free(p);
+}
+
+/* Start running TASK for indexes 0 to COUNT-1. The previous batch must
+ * have been waited for. Returns <0 on error. */
+static int pool_start(pool *p, pool_task *task, void *udata, size_t count) {
+    pthread_mutex_lock(&p->lock);
+    if (count > p->finished_cap) {
+        uint8_t *finished = realloc(p->finished, count);
+        if (finished == NULL) {
+            pthread_mutex_unlock(&p->lock);
+            return -1;
+        }
+        p->finished = finished;
+        p->finished_cap = count;
+    }
+    memset(p->finished, 0, count);
+    p->task = task;
+    p->udata = udata;
+    p->next = 0;
+    p->count = count;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+/* Wait for task INDEX of the current batch to finish. */
+static void pool_wait(pool *p, size_t index) {
+    pthread_mutex_lock(&p->lock);
+    while (!p->finished[index]) pthread_cond_wait(&p->done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+size_t heatshrink_parallel_default_threads(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (size_t)cpus : 1;
+}
+
+/**********************
+ * Parallel compression
+ **********************/
+
+struct heatshrink_parallel_encoder {
+    pool *pool;
+    heatshrink_encoder **encoders; /* one per worker */
+    size_t threads;
+    size_t block_size;
+    size_t window_sz;
+    uint8_t primed;
+
+    /* The current call's input, and an output slot per block. */
+    uint8_t *in_buf;
+    size_t in_size;
+    uint8_t *out;
+    size_t *out_sizes;          /* 0 if the block failed */
+    size_t out_cap;             /* blocks that fit in out */
+
+    /* The end of the previous call's last block. */
+    uint8_t *dict;
+    size_t dict_size;
+};
+
+static size_t block_bound(heatshrink_parallel_encoder *hpe) {
+    return HEATSHRINK_FRAME_BLOCK_BOUND(hpe->block_size);
+}
+
+static void encode_task(void *udata, size_t worker, size_t index) {
+    heatshrink_parallel_encoder *hpe = udata;
+    size_t offset = index * hpe->block_size;
+    size_t size = hpe->in_size - offset;
+    if (size > hpe->block_size) size = hpe->block_size;
+
+    const uint8_t *dict = NULL;
+    size_t dict_size = 0;
+    if (!hpe->primed) {
+        /* independent blocks */
+    } else if (index == 0) {
+        dict = hpe->dict;
+        dict_size = hpe->dict_size;
+    } else {
+        dict_size = hpe->block_size < hpe->window_sz
+            ? hpe->block_size : hpe->window_sz;
+        dict = &hpe->in_buf[offset - dict_size];
+    }
+
+    size_t out_sz = 0;
+    if (heatshrink_frame_encode_block_primed(hpe->encoders[worker],
+            dict, dict_size, &hpe->in_buf[offset], size,
+            &hpe->out[index * block_bound(hpe)], block_bound(hpe),
+            &out_sz) != HSFR_OK) {
+        out_sz = 0;
+    }
+    hpe->out_sizes[index] = out_sz;
+}
+
+heatshrink_parallel_encoder *heatshrink_parallel_encoder_alloc(
+        uint8_t window_sz2, uint8_t lookahead_sz2,
+        size_t block_size, size_t threads, uint8_t primed) {
+    if (block_size == 0 || block_size > HEATSHRINK_FRAME_MAX_BLOCK_SIZE
+        || threads == 0) {
+        return NULL;
+    }
+    heatshrink_parallel_encoder *hpe = malloc(sizeof(*hpe));
+    if (hpe == NULL) return NULL;
+    memset(hpe, 0, sizeof(*hpe));
+    hpe->block_size = block_size;
+    hpe->window_sz = (size_t)1 << window_sz2;
+    hpe->primed = primed;
+
+    hpe->encoders = calloc(threads, sizeof(heatshrink_encoder *));
+    hpe->dict = malloc(hpe->window_sz);
+    if (hpe->encoders == NULL || hpe->dict == NULL) goto cleanup;
+    hpe->threads = threads;
+    for (size_t i = 0; i < threads; i++) {
+        hpe->encoders[i] = heatshrink_encoder_alloc(window_sz2, lookahead_sz2);
+        if (hpe->encoders[i] == NULL) goto cleanup;
+    }
+    hpe->pool = pool_alloc(threads);
+    if (hpe->pool == NULL) goto cleanup;
+    return hpe;
+
+cleanup:
+    heatshrink_parallel_encoder_free(hpe);
+    return NULL;
+}
+
+void heatshrink_parallel_encoder_free(heatshrink_parallel_encoder *hpe) {
+    if (hpe == NULL) return;
+    pool_free(hpe->pool);
+    for (size_t i = 0; i < hpe->threads; i++) {
+        if (hpe->encoders[i]) heatshrink_encoder_free(hpe->encoders[i]);
+    }
+    free(hpe->encoders);
+    free(hpe->out);
+    free(hpe->out_sizes);
+    free(hpe->dict);
+    free(hpe);
+}
+
+HEATSHRINK_PARALLEL_RES heatshrink_parallel_encoder_set_format(
+        heatshrink_parallel_encoder *hpe, uint8_t format) {
+    if (hpe == NULL) return HSPR_ERROR_NULL;
+    for (size_t i = 0; i < hpe->threads; i++) {
+        if (heatshrink_encoder_set_format(hpe->encoders[i], format) < 0) {
+            return HSPR_ERROR_FRAME;
+        }
+    }
+    return HSPR_OK;
+}
+
+HEATSHRINK_PARALLEL_RES heatshrink_parallel_encode(
+        heatshrink_parallel_encoder *hpe, uint8_t *in_buf, size_t size,
+        heatshrink_write_fn *write, void *udata) {
+    if ((hpe == NULL) || (in_buf == NULL && size > 0) || (write == NULL)) {
+        return HSPR_ERROR_NULL;
+    }
+    if (size == 0) return HSPR_OK;
+
+    size_t blocks = (size + hpe->block_size - 1) / hpe->block_size;
+    if (blocks > hpe->out_cap) {
+        uint8_t *out = realloc(hpe->out, blocks * block_bound(hpe));
+        if (out == NULL) return HSPR_ERROR_ALLOC;
+        hpe->out = out;
+        size_t *out_sizes = realloc(hpe->out_sizes, blocks * sizeof(size_t));
+        if (out_sizes == NULL) return HSPR_ERROR_ALLOC;
+        hpe->out_sizes = out_sizes;
+        hpe->out_cap = blocks;
+    }
+    hpe->in_buf = in_buf;
+    hpe->in_size = size;
+    if (pool_start(hpe->pool, encode_task, hpe, blocks) < 0) {
+        return HSPR_ERROR_ALLOC;
+    }
+
+    /* Write each block as soon as it and all before it are done. After
+     * an error, still wait for the rest, since they use the buffers. */
+    HEATSHRINK_PARALLEL_RES res = HSPR_OK;
+    for (size_t i = 0; i < blocks; i++) {
+        pool_wait(hpe->pool, i);
+        if (res != HSPR_OK) continue;
+        if (hpe->out_sizes[i] == 0) {
+            res = HSPR_ERROR_FRAME;
+        } else if (write(udata, &hpe->out[i * block_bound(hpe)],
+                hpe->out_sizes[i]) < 0) {
+            res = HSPR_ERROR_WRITE;
+        }
+    }
+
+    size_t last = size - (blocks - 1) * hpe->block_size;
+    hpe->dict_size = last < hpe->window_sz ? last : hpe->window_sz;
+    memcpy(hpe->dict, &in_buf[size - hpe->dict_size], hpe->dict_size);
+    return res;
+}
+
+/************************
+ * Parallel decompression
+ ************************/
+
+struct heatshrink_parallel_decoder {
+    pool *pool;
+    heatshrink_decoder **decoders; /* one per worker */
+    size_t threads;
+    size_t window_sz;
+
+    /* The current call's blocks, and where each one's output goes. */
+    uint8_t *in_buf;
+    size_t *in_offsets;
+    size_t *out_offsets;        /* one more than blocks, for the end */
+    HEATSHRINK_FRAME_RES *results;
+    uint8_t *out;
+    size_t out_cap;
+
+    /* The end of the previous call's last block. */
+    uint8_t *dict;
+    size_t dict_size;
+
+    uint64_t stream_raw;        /* output so far, for checking the end */
+};
+
+static void decode_task(void *udata, size_t worker, size_t index) {
+    heatshrink_parallel_decoder *hpd = udata;
+    uint8_t *block = &hpd->in_buf[hpd->in_offsets[index]];
+    size_t block_sz = hpd->in_offsets[index + 1] - hpd->in_offsets[index];
+    size_t out_offset = hpd->out_offsets[index];
+    size_t raw_sz = hpd->out_offsets[index + 1] - out_offset;
+
+    const uint8_t *dict = hpd->dict;
+    size_t dict_size = hpd->dict_size;
+    if (index > 0) {
+        /* Tasks start in order, so the one before is already running. */
+        if (block[0] & HSF_BLOCK_PRIMED) pool_wait(hpd->pool, index - 1);
+        dict = &hpd->out[hpd->out_offsets[index - 1]];
+        dict_size = out_offset - hpd->out_offsets[index - 1];
+    }
+
+    size_t used = 0;
+    size_t out_sz = 0;
+    hpd->results[index] = heatshrink_frame_decode_block_primed(
+        hpd->decoders[worker], dict, dict_size, block, block_sz, &used,
+        &hpd->out[out_offset], raw_sz, &out_sz);
+}
+
+heatshrink_parallel_decoder *heatshrink_parallel_decoder_alloc(
+        uint8_t window_sz2, uint8_t lookahead_sz2, size_t threads) {
+    if (threads == 0) return NULL;
+    heatshrink_parallel_decoder *hpd = malloc(sizeof(*hpd));
+    if (hpd == NULL) return NULL;
+    memset(hpd, 0, sizeof(*hpd));
+    hpd->window_sz = (size_t)1 << window_sz2;
+
+    size_t max_blocks = threads * HEATSHRINK_PARALLEL_BLOCKS_PER_THREAD;
+    hpd->decoders = calloc(threads, sizeof(heatshrink_decoder *));
+    hpd->in_offsets = malloc((max_blocks + 1) * sizeof(size_t));
+    hpd->out_offsets = malloc((max_blocks + 1) * sizeof(size_t));
+    hpd->results = malloc(max_blocks * sizeof(HEATSHRINK_FRAME_RES));
+    hpd->dict = malloc(hpd->window_sz);
+    if (hpd->decoders == NULL || hpd->in_offsets == NULL
+        || hpd->out_offsets == NULL || hpd->results == NULL
+        || hpd->dict == NULL) {
+        goto cleanup;
+    }
+    hpd->threads = threads;
+    for (size_t i = 0; i < threads; i++) {
+        hpd->decoders[i] = heatshrink_decoder_alloc(256,
+            window_sz2, lookahead_sz2);
+        if (hpd->decoders[i] == NULL) goto cleanup;
+    }
+    hpd->pool = pool_alloc(threads);
+    if (hpd->pool == NULL) goto cleanup;
+    return hpd;
+
+cleanup:
+    heatshrink_parallel_decoder_free(hpd);
+    return NULL;
+}
+
+void heatshrink_parallel_decoder_free(heatshrink_parallel_decoder *hpd) {
+    if (hpd == NULL) return;
+    pool_free(hpd->pool);
+    for (size_t i = 0; i < hpd->threads; i++) {
+        if (hpd->decoders[i]) heatshrink_decoder_free(hpd->decoders[i]);
+    }
+    free(hpd->decoders);
+    free(hpd->in_offsets);
+    free(hpd->out_offsets);
+    free(hpd->results);
+    free(hpd->out);
+    free(hpd->dict);
+    free(hpd);
+}
+
+HEATSHRINK_PARALLEL_RES heatshrink_parallel_decoder_set_format(
+        heatshrink_parallel_decoder *hpd, uint8_t format) {
+    if (hpd == NULL) return HSPR_ERROR_NULL;
+    for (size_t i = 0; i < hpd->threads; i++) {
+        if (heatshrink_decoder_set_format(hpd->decoders[i], format) < 0) {
+            return HSPR_ERROR_FRAME;
+        }
+    }
+    return HSPR_OK;
+}
+
+HEATSHRINK_PARALLEL_RES heatshrink_parallel_decode(
+        heatshrink_parallel_decoder *hpd, uint8_t *in_buf, size_t in_size,
+        size_t *input_size, heatshrink_write_fn *write, void *udata) {
+    if ((hpd == NULL) || (in_buf == NULL && in_size > 0)
+        || (input_size == NULL) || (write == NULL)) {
+        return HSPR_ERROR_NULL;
+    }
+    *input_size = 0;
+
+    /* Find the whole blocks, and lay their output out back to back. */
+    size_t max_blocks = hpd->threads * HEATSHRINK_PARALLEL_BLOCKS_PER_THREAD;
+    size_t blocks = 0;
+    size_t offset = 0;
+    size_t out_total = 0;
+    uint8_t ended = 0;
+    while (blocks < max_blocks) {
+        heatshrink_frame_header h;
+        HEATSHRINK_FRAME_RES hres = heatshrink_frame_read_header(
+            &in_buf[offset], in_size - offset, &h);
+        if (hres == HSFR_MORE) break;
+        if (hres != HSFR_OK) return HSPR_ERROR_FRAME;
+        size_t block_sz = h.header_size + h.payload_size;
+        if (in_size - offset < block_sz) break;
+
+        if (h.type == HSF_BLOCK_END) {
+            uint64_t raw_total = 0;
+            if (heatshrink_frame_read_end(&in_buf[offset], block_sz,
+                    &raw_total) != HSFR_OK
+                || raw_total != hpd->stream_raw + out_total) {
+                return HSPR_ERROR_FRAME;
+            }
+            ended = 1;
+            break;
+        }
+
+        /* Headers cap each block's raw size, and this caps the batch's,
+         * so a corrupt stream can't ask for much memory. */
+        if (blocks > 0 && out_total + h.raw_size > HEATSHRINK_FRAME_MAX_BLOCK_SIZE) {
+            break;
+        }
+        hpd->in_offsets[blocks] = offset;
+        hpd->out_offsets[blocks] = out_total;
+        offset += block_sz;
+        out_total += h.raw_size;
+        blocks++;
+    }
+    if (blocks == 0) {
+        if (!ended) return HSPR_OK;
+        hpd->stream_raw = 0;
+        hpd->dict_size = 0;
+        *input_size = HEATSHRINK_FRAME_END_SIZE;
+        return HSPR_END;
+    }
+    hpd->in_offsets[blocks] = offset;
+    hpd->out_offsets[blocks] = out_total;
+
+    if (out_total > hpd->out_cap) {
+        uint8_t *out = realloc(hpd->out, out_total);
+        if (out == NULL) return HSPR_ERROR_ALLOC;
+        hpd->out = out;
+        hpd->out_cap = out_total;
+    }
+    hpd->in_buf = in_buf;
+    if (pool_start(hpd->pool, decode_task, hpd, blocks) < 0) {
+        return HSPR_ERROR_ALLOC;
+    }
+
+    /* As with encoding, write in order, and wait for every block. */
+    HEATSHRINK_PARALLEL_RES res = HSPR_OK;
+    for (size_t i = 0; i < blocks; i++) {
+        pool_wait(hpd->pool, i);
+        if (res != HSPR_OK) continue;
+        if (hpd->results[i] == HSFR_ERROR_CHECKSUM) {
+            res = HSPR_ERROR_CHECKSUM;
+        } else if (hpd->results[i] != HSFR_OK) {
+            res = HSPR_ERROR_FRAME;
+        } else if (write(udata, &hpd->out[hpd->out_offsets[i]],
+                hpd->out_offsets[i + 1] - hpd->out_offsets[i]) < 0) {
+            res = HSPR_ERROR_WRITE;
+        }
+    }
+    if (res != HSPR_OK) return res;
+
+    if (ended) {
+        hpd->stream_raw = 0;
+        hpd->dict_size = 0;
+        *input_size = offset + HEATSHRINK_FRAME_END_SIZE;
+        return HSPR_END;
+    }
+    hpd->stream_raw += out_total;
+    size_t last = out_total - hpd->out_offsets[blocks - 1];
+    hpd->dict_size = last < hpd->window_sz ? last : hpd->window_sz;
+    memcpy(hpd->dict, &hpd->out[out_total - hpd->dict_size], hpd->dict_size);
+    *input_size = offset;
+    return HSPR_OK;
+}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef HEATSHRINK_PARALLEL_H
+#define HEATSHRINK_PARALLEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "heatshrink_config.h"
+#include "heatshrink_frame.h"
+
+#if HEATSHRINK_USE_THREADS && HEATSHRINK_DYNAMIC_ALLOC
+
+typedef enum {
+    HSPR_OK,                    /* everything was written */
+    HSPR_END,                   /* ...up to and including an end block */
+    HSPR_ERROR_NULL=-1,         /* NULL argument */
+    HSPR_ERROR_WRITE=-2,        /* the write callback failed */
+    HSPR_ERROR_FRAME=-3,        /* a block couldn't be encoded / decoded */
+    HSPR_ERROR_ALLOC=-4,        /* out of memory */
+    HSPR_ERROR_CHECKSUM=-5,     /* a decoded block failed its checksum */
+} HEATSHRINK_PARALLEL_RES;
+
+/* Called with each block's output, in order. Returns <0 on error. */
+typedef int heatshrink_write_fn(void *udata, const uint8_t *buf, size_t size);
+
+typedef struct heatshrink_parallel_encoder heatshrink_parallel_encoder;
+
+/* Allocate an encoder that compresses BLOCK_SIZE-byte blocks (see
+ * heatshrink_frame.h; at most HEATSHRINK_FRAME_MAX_BLOCK_SIZE) on THREADS
+ * threads. If PRIMED is set, every block
+ * after the first is primed with the end of the block before it.
+ * Returns NULL on error. */
+heatshrink_parallel_encoder *heatshrink_parallel_encoder_alloc(
+    uint8_t window_sz2, uint8_t lookahead_sz2,
+    size_t block_size, size_t threads, uint8_t primed);
+
+/* Free a parallel encoder and stop its threads. */
+void heatshrink_parallel_encoder_free(heatshrink_parallel_encoder *hpe);
+
+/* Set every block's format extensions (see heatshrink_encoder_set_format).
+ * Only allowed before the first call to heatshrink_parallel_encode. */
+HEATSHRINK_PARALLEL_RES heatshrink_parallel_encoder_set_format(
+    heatshrink_parallel_encoder *hpe, uint8_t format);
+
+/* Split SIZE bytes from IN_BUF into blocks, compress them in parallel,
+ * and pass them to WRITE in order. Each call continues the same stream,
+ * so with PRIMED its first block is primed with the end of the previous
+ * call's last block. Memory use grows with SIZE; a few blocks per thread
+ * per call keeps every thread busy. */
+HEATSHRINK_PARALLEL_RES heatshrink_parallel_encode(
+    heatshrink_parallel_encoder *hpe, uint8_t *in_buf, size_t size,
+    heatshrink_write_fn *write, void *udata);
+
+typedef struct heatshrink_parallel_decoder heatshrink_parallel_decoder;
+
+/* Allocate a decoder for framed streams from an encoder with the same
+ * window and lookahead settings, which decodes blocks on THREADS
+ * threads. Returns NULL on error. */
+heatshrink_parallel_decoder *heatshrink_parallel_decoder_alloc(
+    uint8_t window_sz2, uint8_t lookahead_sz2, size_t threads);
+
+/* Free a parallel decoder and stop its threads. */
+void heatshrink_parallel_decoder_free(heatshrink_parallel_decoder *hpd);
+
+/* Decode blocks with the format extensions FORMAT. */
+HEATSHRINK_PARALLEL_RES heatshrink_parallel_decoder_set_format(
+    heatshrink_parallel_decoder *hpd, uint8_t format);
+
+/* Decode the whole blocks at the start of IN_BUF in parallel, each into
+ * its own region of one output buffer, and pass them to WRITE in order.
+ * At most HEATSHRINK_PARALLEL_BLOCKS_PER_THREAD blocks per thread, and
+ * HEATSHRINK_FRAME_MAX_BLOCK_SIZE bytes of output, are decoded per call,
+ * which bounds memory use. *INPUT_SIZE is set to the number of bytes
+ * used; call again with the rest, including any partial block. A primed
+ * block can't start until the block before it is done, so streams of
+ * primed blocks decode one block at a time.
+ *
+ * Decoding stops after an end block, returning HSPR_END once its stream's
+ * size has been checked. Whatever follows (another stream, perhaps with
+ * its own container header) starts afresh. */
+HEATSHRINK_PARALLEL_RES heatshrink_parallel_decode(
+    heatshrink_parallel_decoder *hpd, uint8_t *in_buf, size_t in_size,
+    size_t *input_size, heatshrink_write_fn *write, void *udata);
+
+#define HEATSHRINK_PARALLEL_BLOCKS_PER_THREAD 4
+
+/* How many threads to use by default: one per online CPU. */
+size_t heatshrink_parallel_default_threads(void);
+
+#endif
+
+#endif
@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include <string.h>
+#include "heatshrink_reader.h"
+
+#if HEATSHRINK_DYNAMIC_ALLOC
+
+typedef struct {
+    uint32_t block;             /* which block is cached */
+    uint32_t size;              /* its raw size; 0 if the slot is empty */
+    uint64_t last_used;
+    uint8_t *data;
+} cache_entry;
+
+struct heatshrink_reader {
+    heatshrink_read_at_fn *read_at;
+    void *udata;
+    heatshrink_decoder *hsd;
+    uint64_t data_start;        /* offset of the first block */
+    uint64_t *offsets;          /* per block from data_start, plus the end */
+    uint32_t block_count;
+    uint32_t block_size;
+    uint64_t raw_size;
+
+    uint8_t *scratch;           /* one compressed block */
+    size_t scratch_size;
+
+    uint64_t clock;             /* for least recently used eviction */
+    size_t cache_count;
+    cache_entry cache[];
+};
+
+static uint64_t read_u64le(const uint8_t *buf) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | buf[i];
+    return v;
+}
+
+/* Read the compressed block BLOCK into r->scratch, returning its size. */
+static HEATSHRINK_READER_RES read_block(heatshrink_reader *r,
+        uint32_t block, size_t *size) {
+    uint64_t start = r->offsets[block];
+    uint64_t end = r->offsets[block + 1];
+    if (end < start || end - start > SIZE_MAX) return HSRR_ERROR_FORMAT;
+    size_t sz = end - start;
+    if (sz > r->scratch_size) {
+        uint8_t *scratch = realloc(r->scratch, sz);
+        if (scratch == NULL) return HSRR_ERROR_ALLOC;
+        r->scratch = scratch;
+        r->scratch_size = sz;
+    }
+    if (r->read_at(r->udata, r->data_start + start, r->scratch, sz) < 0) {
+        return HSRR_ERROR_IO;
+    }
+    *size = sz;
+    return HSRR_OK;
+}
+
+static HEATSHRINK_READER_RES open_index(heatshrink_reader *r,
+        uint64_t stream_size) {
+    uint8_t buf[HEATSHRINK_CONTAINER_MAX_HEADER_SIZE];
+    if (stream_size < sizeof(buf)) return HSRR_ERROR_FORMAT;
+    if (r->read_at(r->udata, 0, buf, sizeof(buf)) < 0) return HSRR_ERROR_IO;
+
+    heatshrink_container_header h;
+    size_t hdr_sz = 0;
+    if (heatshrink_container_read_header(buf, sizeof(buf), &h, &hdr_sz)
+        != HSZR_OK) {
+        return HSRR_ERROR_FORMAT;
+    }
+    if (!(h.flags & HSZ_FLAG_FRAMED) || !(h.flags & HSZ_FLAG_SEEKABLE)) {
+        return HSRR_ERROR_FORMAT;
+    }
+    r->data_start = hdr_sz;
+
+    /* The index comes just before the end block. */
+    uint8_t ebuf[HEATSHRINK_FRAME_END_SIZE];
+    uint64_t raw_total = 0;
+    if (stream_size < r->data_start + sizeof(ebuf)) return HSRR_ERROR_FORMAT;
+    if (r->read_at(r->udata, stream_size - sizeof(ebuf), ebuf, sizeof(ebuf)) < 0) {
+        return HSRR_ERROR_IO;
+    }
+    if (heatshrink_frame_read_end(ebuf, sizeof(ebuf), &raw_total) != HSFR_OK) {
+        return HSRR_ERROR_FORMAT;
+    }
+    stream_size -= sizeof(ebuf);
+
+    uint8_t tbuf[HEATSHRINK_FRAME_INDEX_TRAILER_SIZE];
+    if (stream_size < r->data_start + sizeof(tbuf)) return HSRR_ERROR_FORMAT;
+    if (r->read_at(r->udata, stream_size - sizeof(tbuf), tbuf, sizeof(tbuf)) < 0) {
+        return HSRR_ERROR_IO;
+    }
+    heatshrink_frame_index_trailer t;
+    if (heatshrink_frame_read_index_trailer(tbuf, &t) != HSFR_OK
+        || t.index_size > stream_size - r->data_start) {
+        return HSRR_ERROR_FORMAT;
+    }
+    r->block_count = t.block_count;
+    r->block_size = t.block_size;
+
+    /* The offsets, then the start of the index as the end of the last
+     * block. */
+    uint64_t index_start = stream_size - t.index_size;
+    r->offsets = malloc(((size_t)t.block_count + 1) * sizeof(uint64_t));
+    uint8_t *index = malloc(t.index_size);
+    HEATSHRINK_READER_RES res = HSRR_ERROR_ALLOC;
+    if (r->offsets != NULL && index != NULL) {
+        res = HSRR_ERROR_IO;
+        if (r->read_at(r->udata, index_start, index, t.index_size) >= 0) {
+            res = HSRR_ERROR_FORMAT;
+            heatshrink_frame_header ih;
+            if (heatshrink_frame_read_header(index, t.index_size, &ih) == HSFR_OK
+                && ih.type == HSF_BLOCK_INDEX
+                && ih.header_size + ih.payload_size == t.index_size) {
+                for (uint32_t i = 0; i < t.block_count; i++) {
+                    r->offsets[i] = read_u64le(&index[ih.header_size + 8 * i]);
+                }
+                r->offsets[t.block_count] = index_start - r->data_start;
+                res = HSRR_OK;
+            }
+        }
+    }
+    free(index);
+    if (res != HSRR_OK || r->block_count == 0) return res;
+
+    /* Every block is full but the last, whose size is in its header. */
+    size_t last_sz = 0;
+    res = read_block(r, r->block_count - 1, &last_sz);
+    if (res != HSRR_OK) return res;
+    heatshrink_frame_header lh;
+    if (heatshrink_frame_read_header(r->scratch, last_sz, &lh) != HSFR_OK
+        || lh.raw_size > r->block_size) {
+        return HSRR_ERROR_FORMAT;
+    }
+    r->raw_size = (uint64_t)(r->block_count - 1) * r->block_size + lh.raw_size;
+    if (r->raw_size != raw_total) return HSRR_ERROR_FORMAT;
+
+    r->hsd = heatshrink_container_alloc_decoder(&h, 256);
+    return r->hsd == NULL ? HSRR_ERROR_FORMAT : HSRR_OK;
+}
+
+heatshrink_reader *heatshrink_reader_open(heatshrink_read_at_fn *read_at,
+        void *udata, uint64_t stream_size, size_t cache_blocks,
+        HEATSHRINK_READER_RES *res) {
+    HEATSHRINK_READER_RES dummy;
+    if (res == NULL) res = &dummy;
+    if (read_at == NULL) {
+        *res = HSRR_ERROR_NULL;
+        return NULL;
+    }
+    if (cache_blocks == 0) cache_blocks = 1;
+
+    size_t r_sz = sizeof(heatshrink_reader) + cache_blocks * sizeof(cache_entry);
+    heatshrink_reader *r = malloc(r_sz);
+    if (r == NULL) {
+        *res = HSRR_ERROR_ALLOC;
+        return NULL;
+    }
+    memset(r, 0, r_sz);
+    r->read_at = read_at;
+    r->udata = udata;
+    r->cache_count = cache_blocks;
+
+    *res = open_index(r, stream_size);
+    if (*res != HSRR_OK) {
+        heatshrink_reader_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+void heatshrink_reader_close(heatshrink_reader *r) {
+    if (r == NULL) return;
+    for (size_t i = 0; i < r->cache_count; i++) free(r->cache[i].data);
+    if (r->hsd) heatshrink_decoder_free(r->hsd);
+    free(r->scratch);
+    free(r->offsets);
+    free(r);
+}
+
+uint64_t heatshrink_reader_size(const heatshrink_reader *r) {
+    return r == NULL ? 0 : r->raw_size;
+}
+
+/* Get block BLOCK from the cache, decoding it into the least recently
+ * used slot if it isn't there. */
+static HEATSHRINK_READER_RES get_block(heatshrink_reader *r, uint32_t block,
+        cache_entry **entry) {
+    cache_entry *victim = &r->cache[0];
+    for (size_t i = 0; i < r->cache_count; i++) {
+        cache_entry *e = &r->cache[i];
+        if (e->size > 0 && e->block == block) {
+            e->last_used = ++r->clock;
+            *entry = e;
+            return HSRR_OK;
+        }
+        if (e->last_used < victim->last_used) victim = e;
+    }
+
+    size_t comp_sz = 0;
+    HEATSHRINK_READER_RES res = read_block(r, block, &comp_sz);
+    if (res != HSRR_OK) return res;
+    if (victim->data == NULL) {
+        victim->data = malloc(r->block_size);
+        if (victim->data == NULL) return HSRR_ERROR_ALLOC;
+    }
+    victim->size = 0;
+    size_t used = 0;
+    size_t out_sz = 0;
+    if (heatshrink_frame_decode_block(r->hsd, r->scratch, comp_sz, &used,
+            victim->data, r->block_size, &out_sz) != HSFR_OK
+        || used != comp_sz || out_sz == 0
+        || (block + 1 < r->block_count && out_sz != r->block_size)) {
+        return HSRR_ERROR_FORMAT;
+    }
+    victim->block = block;
+    victim->size = out_sz;
+    victim->last_used = ++r->clock;
+    *entry = victim;
+    return HSRR_OK;
+}
+
+HEATSHRINK_READER_RES heatshrink_reader_pread(heatshrink_reader *r,
+        uint8_t *buf, size_t size, uint64_t offset, size_t *read_size) {
+    if ((r == NULL) || (buf == NULL && size > 0) || (read_size == NULL)) {
+        return HSRR_ERROR_NULL;
+    }
+    *read_size = 0;
+    while (size > 0 && offset < r->raw_size) {
+        cache_entry *e = NULL;
+        HEATSHRINK_READER_RES res = get_block(r,
+            (uint32_t)(offset / r->block_size), &e);
+        if (res != HSRR_OK) return res;
+
+        size_t start = offset % r->block_size;
+        if (start >= e->size) return HSRR_ERROR_FORMAT;
+        size_t n = e->size - start;
+        if (n > size) n = size;
+        memcpy(buf, &e->data[start], n);
+        buf += n;
+        size -= n;
+        offset += n;
+        *read_size += n;
+    }
+    return HSRR_OK;
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef HEATSHRINK_READER_H
+#define HEATSHRINK_READER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "heatshrink_config.h"
+#include "heatshrink_container.h"
+#include "heatshrink_frame.h"
+
+#if HEATSHRINK_DYNAMIC_ALLOC
+
+/* Random access into a seekable stream (see heatshrink_frame.h): only
+ * the blocks covering a read are decoded, and the most recently used
+ * blocks are cached. */
+
+typedef enum {
+    HSRR_OK,                    /* read succeeded */
+    HSRR_ERROR_NULL=-1,         /* NULL argument */
+    HSRR_ERROR_IO=-2,           /* the read_at callback failed */
+    HSRR_ERROR_FORMAT=-3,       /* not a seekable stream, or corrupt */
+    HSRR_ERROR_ALLOC=-4,        /* out of memory */
+} HEATSHRINK_READER_RES;
+
+/* Read exactly SIZE bytes at OFFSET of the compressed stream into BUF.
+ * Returns <0 on error. */
+typedef int heatshrink_read_at_fn(void *udata, uint64_t offset,
+    uint8_t *buf, size_t size);
+
+typedef struct heatshrink_reader heatshrink_reader;
+
+/* Open the seekable stream of STREAM_SIZE bytes read by READ_AT,
+ * caching up to CACHE_BLOCKS decoded blocks (at least 1). Sets *RES and
+ * returns NULL on error. */
+heatshrink_reader *heatshrink_reader_open(heatshrink_read_at_fn *read_at,
+    void *udata, uint64_t stream_size, size_t cache_blocks,
+    HEATSHRINK_READER_RES *res);
+
+/* Free a reader and its cache. */
+void heatshrink_reader_close(heatshrink_reader *r);
+
+/* Size of the decompressed data. */
+uint64_t heatshrink_reader_size(const heatshrink_reader *r);
+
+/* Copy up to SIZE bytes of decompressed data, starting at OFFSET, to BUF.
+ * *READ_SIZE is only short at the end of the data. */
+HEATSHRINK_READER_RES heatshrink_reader_pread(heatshrink_reader *r,
+    uint8_t *buf, size_t size, uint64_t offset, size_t *read_size);
+
+#endif
+
+#endif
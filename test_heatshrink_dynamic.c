@@ -4,6 +4,13 @@
 
 #include "heatshrink_encoder.h"
 #include "heatshrink_decoder.h"
+#include "heatshrink_frame.h"
+#include "heatshrink_crc32.h"
+#include "heatshrink_kernels.h"
+#include "heatshrink_container.h"
+#include "heatshrink_parallel.h"
+#include "heatshrink_format.h"
+#include "heatshrink_reader.h"
 #include "greatest.h"
 
 #if !HEATSHRINK_DYNAMIC_ALLOC
@@ -223,6 +230,26 @@ TEST encoder_poll_should_detect_repeated_substring_and_preserve_trailing_literal
     PASS();
 }
 
+TEST match_length_kernels_should_agree_with_scalar() {
+    const heatshrink_kernels *scalar = heatshrink_kernels_by_name("scalar");
+    const char *names[] = {"sse4.2", "avx2"};
+    uint8_t a[128], b[128];
+    ASSERT(scalar != NULL);
+    for (int n = 0; n < sizeof(names) / sizeof(names[0]); n++) {
+        const heatshrink_kernels *k = heatshrink_kernels_by_name(names[n]);
+        if (k == NULL) continue;    /* CPU can't run it */
+        for (int diff = 0; diff <= sizeof(a); diff++) {
+            for (int i = 0; i < sizeof(a); i++) a[i] = b[i] = (uint8_t)(i * 7);
+            if (diff < sizeof(a)) b[diff] ^= 0x40;
+            for (uint16_t maxlen = 0; maxlen <= sizeof(a); maxlen += 13) {
+                ASSERT_EQ(scalar->match_length(a, b, maxlen),
+                    k->match_length(a, b, maxlen));
+            }
+        }
+    }
+    PASS();
+}
+
 SUITE(encoding) {
     RUN_TEST(encoder_alloc_should_reject_invalid_arguments);
 
@@ -239,6 +266,7 @@ SUITE(encoding) {
     RUN_TEST(encoder_should_emit_series_of_same_byte_as_literal_then_backref);
     RUN_TEST(encoder_poll_should_detect_repeated_substring);
     RUN_TEST(encoder_poll_should_detect_repeated_substring_and_preserve_trailing_literal);
+    RUN_TEST(match_length_kernels_should_agree_with_scalar);
 }
 
 TEST decoder_alloc_should_reject_excessively_small_window() {
@@ -527,6 +555,66 @@ TEST decoder_finish_should_note_when_done() {
     PASS();
 }
 
+TEST decoder_poll_span_should_expand_without_sinking() {
+    uint8_t input[] = {0xb3, 0x5b, 0xed, 0xe0, 0x40, 0x80}; //"foofoo"
+    uint8_t output[8];
+    heatshrink_decoder *hsd = heatshrink_decoder_alloc(1, 7, 7);
+    size_t used = 0;
+    size_t out_sz = 0;
+
+    HEATSHRINK_DECODER_POLL_RES pres = heatshrink_decoder_poll_span(hsd,
+        input, sizeof(input), &used, output, 4, &out_sz);
+    ASSERT_EQ(HSDR_POLL_MORE, pres);
+    ASSERT_EQ(4, out_sz);
+
+    size_t used2 = 0;
+    pres = heatshrink_decoder_poll_span(hsd, &input[used],
+        sizeof(input) - used, &used2, &output[4], 4, &out_sz);
+    ASSERT_EQ(HSDR_POLL_EMPTY, pres);
+    ASSERT_EQ(sizeof(input), used + used2);
+    ASSERT_EQ(2, out_sz);
+    ASSERT_EQ(0, memcmp(output, "foofoo", 6));
+    ASSERT_EQ(HSDR_FINISH_DONE, heatshrink_decoder_finish(hsd));
+
+    heatshrink_decoder_free(hsd);
+    PASS();
+}
+
+TEST decoder_poll_span_should_carry_fields_split_across_spans() {
+    /* Feed one byte per call, so most 16-bit backrefs are split. */
+    uint8_t input[1024];
+    uint8_t comp[2048];
+    uint8_t output[1024];
+    for (int i=0; i<sizeof(input); i++) input[i] = "heatshrink"[(i*i/7) % 10];
+
+    heatshrink_encoder *hse = heatshrink_encoder_alloc(11, 4);
+    uint16_t count = 0;
+    ASSERT_EQ(HSER_SINK_OK, heatshrink_encoder_sink(hse, input, sizeof(input), &count));
+    ASSERT_EQ(sizeof(input), count);
+    ASSERT_EQ(HSER_FINISH_MORE, heatshrink_encoder_finish(hse));
+    ASSERT_EQ(HSER_POLL_EMPTY, heatshrink_encoder_poll(hse, comp, sizeof(comp), &count));
+    uint16_t comp_sz = count;
+    heatshrink_encoder_free(hse);
+
+    heatshrink_decoder *hsd = heatshrink_decoder_alloc(1, 11, 4);
+    size_t polled = 0;
+    for (int i=0; i<comp_sz; i++) {
+        size_t used = 0;
+        size_t out_sz = 0;
+        HEATSHRINK_DECODER_POLL_RES pres = heatshrink_decoder_poll_span(hsd,
+            &comp[i], 1, &used, &output[polled], sizeof(output) - polled, &out_sz);
+        ASSERT_EQ(HSDR_POLL_EMPTY, pres);
+        ASSERT_EQ(1, used);
+        polled += out_sz;
+    }
+    ASSERT_EQ(HSDR_FINISH_DONE, heatshrink_decoder_finish(hsd));
+    ASSERT_EQ(sizeof(input), polled);
+    ASSERT_EQ(0, memcmp(input, output, sizeof(input)));
+
+    heatshrink_decoder_free(hsd);
+    PASS();
+}
+
 TEST gen() {
     heatshrink_encoder *hse = heatshrink_encoder_alloc(8, 7);
     uint8_t input[] = {'a', 'a', 'a', 'a', 'a'};
@@ -576,6 +664,9 @@ SUITE(decoding) {
     RUN_TEST(decoder_poll_should_suspend_if_out_of_space_in_output_buffer_during_backref_expansion);
     RUN_TEST(decoder_poll_should_expand_short_literal_and_backref_when_fed_input_byte_by_byte);
 
+    RUN_TEST(decoder_poll_span_should_expand_without_sinking);
+    RUN_TEST(decoder_poll_span_should_carry_fields_split_across_spans);
+
     RUN_TEST(decoder_finish_should_reject_null_input);
     RUN_TEST(decoder_finish_should_note_when_done);
 }
@@ -811,6 +902,14 @@ static void fill_with_pseudorandom_letters(uint8_t *buf, uint32_t size, uint32_t
     }
 }
 
+static void fill_with_noise(uint8_t *buf, uint32_t size, uint32_t seed) {
+    uint32_t x = seed ? seed : 1;
+    for (uint32_t i=0; i<size; i++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5; /* xorshift32 */
+        buf[i] = x & 0xFF;
+    }
+}
+
 TEST pseudorandom_data_should_match(uint32_t size, uint32_t seed, cfg_info *cfg) {
     uint8_t input[size];
     if (cfg->log_lvl > 0) {
@@ -881,17 +980,685 @@ TEST sixty_four_k() {
     return compress_and_expand_and_check(input, size, &cfg);
 }
 
+TEST regression_wide_fields_should_resume_across_input_boundaries() {
+    /* With more than 8 window bits, a backref index can span three input
+     * bytes. It used to be partially consumed and lost when the sunk input
+     * ran out in the middle of it. */
+    uint32_t size = 8192;
+    uint32_t seed = 7;
+    uint8_t input[size];
+    fill_with_pseudorandom_letters(input, size, seed);
+    cfg_info cfg;
+    cfg.log_lvl = 0;
+    cfg.window_sz2 = 11;
+    cfg.lookahead_sz2 = 4;
+    cfg.decoder_input_buffer_size = 3;
+    return compress_and_expand_and_check(input, size, &cfg);
+}
+
+TEST data_with_short_periods_should_match_across_window_wraparound() {
+    /* Exercise each backref copy strategy (byte runs, doubled short
+     * patterns, wide copies) with a window small enough to wrap often. */
+    uint32_t size = 0;
+    uint8_t input[40 * 40];
+    for (uint32_t period=1; period<=40; period++) {
+        for (uint32_t i=0; i<40; i++) input[size++] = 'a' + (i % period);
+    }
+    cfg_info cfg;
+    cfg.log_lvl = 0;
+    cfg.decoder_input_buffer_size = 64;
+    cfg.window_sz2 = 5;
+    cfg.lookahead_sz2 = 4;
+    if (compress_and_expand_and_check(input, size, &cfg) != 0) return -1;
+    cfg.window_sz2 = 8;
+    cfg.lookahead_sz2 = 7;
+    return compress_and_expand_and_check(input, size, &cfg);
+}
+
+TEST data_should_match_across_wraparound_of_page_sized_window() {
+    /* Windows of a page or more may be mirrored (see
+     * HEATSHRINK_USE_MIRRORED_WINDOW), so backrefs read and write
+     * straight across the end of the window. */
+    uint32_t size = 5 * 4096 + 123;
+    uint8_t *input = malloc(size);
+    if (input == NULL) FAILm("malloc fail");
+    fill_with_pseudorandom_letters(input, size, 11);
+    cfg_info cfg;
+    cfg.log_lvl = 0;
+    cfg.window_sz2 = 12;
+    cfg.lookahead_sz2 = 8;
+    cfg.decoder_input_buffer_size = 256;
+    int res = compress_and_expand_and_check(input, size, &cfg);
+    free(input);
+#if HEATSHRINK_USE_MIRRORED_WINDOW
+    /* Make sure the mirrored path is the one that just ran. */
+    heatshrink_decoder *hsd = heatshrink_decoder_alloc(256, 12, 8);
+    ASSERT(hsd->mirror != NULL);
+    heatshrink_decoder_free(hsd);
+#endif
+    return res;
+}
+
+/* Compress all of INPUT into OUT with a fresh encoder, returning the
+ * compressed size (or 0 on failure). If IN_PLACE_MARGIN is non-NULL, it
+ * is set to the encoder's in-place decompression margin. */
+static size_t compress_whole(uint8_t window_sz2, uint8_t lookahead_sz2,
+        uint8_t *input, size_t size, uint8_t *out, size_t out_size,
+        size_t *in_place_margin) {
+    heatshrink_encoder *hse = heatshrink_encoder_alloc(window_sz2, lookahead_sz2);
+    if (hse == NULL) return 0;
+    size_t sunk = 0, polled = 0;
+    uint16_t count = 0;
+    HEATSHRINK_ENCODER_POLL_RES pres = HSER_POLL_EMPTY;
+    while (pres >= 0) {
+        if (sunk < size) {
+            if (heatshrink_encoder_sink(hse, &input[sunk], size - sunk, &count) < 0) break;
+            sunk += count;
+        } else if (heatshrink_encoder_finish(hse) == HSER_FINISH_DONE) {
+            if (in_place_margin) {
+                *in_place_margin = heatshrink_encoder_in_place_margin(hse);
+            }
+            heatshrink_encoder_free(hse);
+            return polled;
+        }
+        do {
+            pres = heatshrink_encoder_poll(hse, &out[polled],
+                out_size - polled, &count);
+            polled += count;
+        } while (pres == HSER_POLL_MORE);
+    }
+    heatshrink_encoder_free(hse);
+    return 0;
+}
+
+TEST decoder_should_hand_off_between_fast_path_and_state_machine() {
+    /* Polling with just over a maximal backref of output room at a time
+     * makes the fast path stop and resume at every call. */
+    uint32_t size = 4096;
+    uint8_t input[size];
+    uint8_t comp[2 * size];
+    uint8_t decomp[size];
+    fill_with_pseudorandom_letters(input, size, 3);
+    size_t comp_sz = compress_whole(8, 4, input, size, comp, sizeof(comp), NULL);
+    ASSERT(comp_sz > 0);
+
+    heatshrink_decoder *hsd = heatshrink_decoder_alloc(256, 8, 4);
+    size_t used = 0, in_count = 0, out_count = 0, out = 0;
+    HEATSHRINK_DECODER_POLL_RES pres;
+    do {
+        size_t room = size - out < 17 ? size - out : 17;
+        pres = heatshrink_decoder_poll_span(hsd, &comp[used], comp_sz - used,
+            &in_count, &decomp[out], room, &out_count);
+        ASSERT(pres >= 0);
+        used += in_count;
+        out += out_count;
+    } while (pres == HSDR_POLL_MORE);
+    ASSERT_EQ(comp_sz, used);
+    ASSERT_EQ(size, out);
+    ASSERT_EQ(HSDR_FINISH_DONE, heatshrink_decoder_finish(hsd));
+    ASSERT_EQ(0, memcmp(input, decomp, size));
+    heatshrink_decoder_free(hsd);
+    PASS();
+}
+
+TEST decoder_poll_streams_should_decode_independent_streams() {
+    enum { STREAMS = 3, SIZE = 10000 };
+    uint8_t window_sz2[STREAMS] = { 8, 11, 5 };
+    uint8_t lookahead_sz2[STREAMS] = { 4, 6, 3 };
+    static uint8_t input[STREAMS][SIZE];
+    static uint8_t comp[STREAMS][2 * SIZE];
+    static uint8_t decomp[STREAMS][SIZE];
+    heatshrink_decoder_stream streams[STREAMS];
+
+    for (int i = 0; i < STREAMS; i++) {
+        fill_with_pseudorandom_letters(input[i], SIZE, i + 1);
+        size_t comp_sz = compress_whole(window_sz2[i], lookahead_sz2[i],
+            input[i], SIZE, comp[i], sizeof(comp[i]), NULL);
+        ASSERT(comp_sz > 0);
+        streams[i].hsd = heatshrink_decoder_alloc(1, window_sz2[i], lookahead_sz2[i]);
+        streams[i].in_buf = comp[i];
+        streams[i].in_size = comp_sz;
+        streams[i].out_buf = decomp[i];
+        streams[i].out_size = SIZE;
+    }
+    /* Stream 2 gets too little output space to finish. */
+    streams[2].out_size = SIZE / 2;
+
+    ASSERT_EQ(HSDR_POLL_MORE, heatshrink_decoder_poll_streams(streams, STREAMS));
+    for (int i = 0; i < 2; i++) {
+        ASSERT_EQ(HSDR_POLL_EMPTY, streams[i].res);
+        ASSERT_EQ(0, streams[i].in_size);
+        ASSERT_EQ(0, streams[i].out_size);
+        ASSERT_EQ(HSDR_FINISH_DONE, heatshrink_decoder_finish(streams[i].hsd));
+        ASSERT_EQ(0, memcmp(input[i], decomp[i], SIZE));
+    }
+    ASSERT_EQ(HSDR_POLL_MORE, streams[2].res);
+    ASSERT_EQ(0, streams[2].out_size);
+
+    /* Give it the rest, and it catches up. */
+    streams[2].out_size = SIZE / 2;
+    ASSERT_EQ(HSDR_POLL_EMPTY, heatshrink_decoder_poll_streams(&streams[2], 1));
+    ASSERT_EQ(HSDR_FINISH_DONE, heatshrink_decoder_finish(streams[2].hsd));
+    ASSERT_EQ(0, memcmp(input[2], decomp[2], SIZE));
+
+    for (int i = 0; i < STREAMS; i++) heatshrink_decoder_free(streams[i].hsd);
+    PASS();
+}
+
+static int in_place_round_trip(uint8_t *input, size_t size,
+        uint8_t window_sz2, uint8_t lookahead_sz2) {
+    size_t comp_cap = size + size/8 + 16;
+    uint8_t *comp = malloc(comp_cap);
+    if (comp == NULL) FAILm("malloc fail");
+    size_t enc_margin = 0;
+    size_t polled = compress_whole(window_sz2, lookahead_sz2, input, size,
+        comp, comp_cap, &enc_margin);
+    ASSERT(polled > 0);
+
+    size_t out_size = 0, margin = 0;
+    ASSERT_EQ(HSDR_IN_PLACE_OK, heatshrink_decoder_in_place_scan(comp, polled,
+            window_sz2, lookahead_sz2, &out_size, &margin));
+    ASSERT_EQ(size, out_size);
+    ASSERT_EQ(enc_margin, margin);
+
+    size_t buf_size = size + margin;
+    uint8_t *buf = malloc(buf_size);
+    if (buf == NULL) FAILm("alloc fail");
+    memcpy(&buf[buf_size - polled], comp, polled);
+    ASSERT_EQ(HSDR_IN_PLACE_OK, heatshrink_decoder_in_place(buf, buf_size,
+            buf_size - polled, window_sz2, lookahead_sz2, &out_size));
+    ASSERT_EQ(size, out_size);
+    ASSERT_EQ(0, memcmp(input, buf, size));
+    free(buf);
+    free(comp);
+    PASS();
+}
+
+TEST in_place_decompression_should_fit_in_the_reported_margin() {
+    uint32_t size = 6000;
+    uint8_t *input = malloc(size);
+    if (input == NULL) FAILm("malloc fail");
+
+    /* Incompressible data needs the most room; repetitive data the least. */
+    fill_with_noise(input, size, 5);
+    if (in_place_round_trip(input, size, 8, 4) != 0) return -1;
+    fill_with_pseudorandom_letters(input, size, 5);
+    if (in_place_round_trip(input, size, 8, 4) != 0) return -1;
+    if (in_place_round_trip(input, size, 11, 5) != 0) return -1;
+    for (uint32_t i = 0; i < size; i++) input[i] = (i / 100) % 2 ? 'x' : i % 7;
+    if (in_place_round_trip(input, size, 6, 3) != 0) return -1;
+    free(input);
+    PASS();
+}
+
+TEST in_place_decompression_should_reject_a_short_margin() {
+    /* A run expands far ahead of the input, then noise catches up. */
+    uint8_t input[512];
+    memset(input, 'a', 256);
+    fill_with_noise(&input[256], 256, 9);
+    uint8_t comp[1024];
+    size_t margin = 0;
+    size_t comp_sz = compress_whole(8, 4, input, sizeof(input),
+        comp, sizeof(comp), &margin);
+    ASSERT(comp_sz > 0);
+    ASSERT(margin > 0);
+
+    uint8_t buf[sizeof(input)];
+    size_t in_offset = sizeof(buf) - comp_sz;
+    memcpy(&buf[in_offset], comp, comp_sz);
+    size_t out_size = 0;
+    ASSERT_EQ(HSDR_IN_PLACE_ERROR_MARGIN, heatshrink_decoder_in_place(buf,
+            sizeof(buf), in_offset, 8, 4, &out_size));
+    PASS();
+}
+
+TEST in_place_margin_should_not_wrap_past_4_gb() {
+    uint8_t input[512];
+    memset(input, 'a', 256);
+    fill_with_noise(&input[256], 256, 9);
+    uint8_t comp[1024];
+    size_t margin = 0;
+    ASSERT(compress_whole(8, 4, input, sizeof(input),
+            comp, sizeof(comp), &margin) > 0);
+
+    /* The same data at the end of a long stream needs the same margin. */
+    heatshrink_encoder *hse = heatshrink_encoder_alloc(8, 4);
+    hse->bytes_in = hse->bytes_out = UINT32_MAX - 100;
+    size_t sunk = 0;
+    uint16_t count = 0;
+    while (sunk < sizeof(input)) {
+        ASSERT_EQ(HSER_SINK_OK, heatshrink_encoder_sink(hse, &input[sunk],
+                sizeof(input) - sunk, &count));
+        sunk += count;
+        while (heatshrink_encoder_poll(hse, comp, sizeof(comp), &count)
+            == HSER_POLL_MORE) {}
+    }
+    while (heatshrink_encoder_finish(hse) == HSER_FINISH_MORE) {
+        heatshrink_encoder_poll(hse, comp, sizeof(comp), &count);
+    }
+    ASSERT(hse->bytes_in > UINT32_MAX);
+    ASSERT_EQ(margin, heatshrink_encoder_in_place_margin(hse));
+    heatshrink_encoder_free(hse);
+    PASS();
+}
+
+TEST decoder_skip_should_discard_output_and_keep_the_window() {
+    /* Skip into a repetitive stream, then check that the rest (which
+     * refers back into the skipped part) still decodes. */
+    uint8_t input[3000];
+    fill_with_pseudorandom_letters(input, 1000, 4);
+    for (int i = 1000; i < 3000; i++) input[i] = input[i - 100 - (i / 250)];
+    uint8_t comp[4000];
+    size_t comp_sz = compress_whole(8, 4, input, sizeof(input),
+        comp, sizeof(comp), NULL);
+    ASSERT(comp_sz > 0);
+
+    heatshrink_decoder *hsd = heatshrink_decoder_alloc(comp_sz, 8, 4);
+    uint16_t count = 0;
+    ASSERT_EQ(HSDR_SINK_OK, heatshrink_decoder_sink(hsd, comp, comp_sz, &count));
+    ASSERT_EQ(comp_sz, count);
+
+    size_t skipped = 0;
+    ASSERT_EQ(HSDR_POLL_MORE, heatshrink_decoder_skip(hsd, 1234, &skipped));
+    ASSERT_EQ(1234, skipped);
+
+    uint8_t rest[sizeof(input)];
+    ASSERT_EQ(HSDR_POLL_EMPTY, heatshrink_decoder_poll(hsd, rest, sizeof(rest), &count));
+    ASSERT_EQ(sizeof(input) - 1234, count);
+    ASSERT_EQ(0, memcmp(&input[1234], rest, count));
+    heatshrink_decoder_free(hsd);
+    PASS();
+}
+
+#if HEATSHRINK_USE_EXTENDED_FORMATS
+/* Round-trip INPUT in FORMAT, sinking and polling CHUNK bytes at a time
+ * on both sides. Returns the compressed size, or 0 on failure. */
+static size_t format_round_trip(uint8_t format, uint8_t window_sz2,
+        uint8_t lookahead_sz2, uint8_t *input, size_t size, size_t chunk) {
+    heatshrink_encoder *hse = heatshrink_encoder_alloc(window_sz2, lookahead_sz2);
+    heatshrink_decoder *hsd = heatshrink_decoder_alloc(chunk, window_sz2, lookahead_sz2);
+    size_t comp_cap = 2 * size + 16;
+    uint8_t *comp = malloc(comp_cap);
+    uint8_t *decomp = malloc(size + 1);
+    size_t res = 0;
+    if (hse == NULL || hsd == NULL || comp == NULL || decomp == NULL) goto cleanup;
+    if (heatshrink_encoder_set_format(hse, format) < 0) goto cleanup;
+    if (heatshrink_decoder_set_format(hsd, format) < 0) goto cleanup;
+
+    size_t sunk = 0, polled = 0;
+    uint16_t count = 0;
+    for (;;) {
+        if (sunk < size) {
+            size_t n = size - sunk < chunk ? size - sunk : chunk;
+            if (heatshrink_encoder_sink(hse, &input[sunk], n, &count) < 0) goto cleanup;
+            sunk += count;
+        } else if (heatshrink_encoder_finish(hse) == HSER_FINISH_DONE) {
+            break;
+        }
+        HEATSHRINK_ENCODER_POLL_RES pres;
+        do {
+            size_t room = comp_cap - polled < chunk ? comp_cap - polled : chunk;
+            pres = heatshrink_encoder_poll(hse, &comp[polled], room, &count);
+            if (pres < 0) goto cleanup;
+            polled += count;
+        } while (pres == HSER_POLL_MORE);
+    }
+
+    size_t comp_sz = polled;
+    sunk = 0;
+    polled = 0;
+    for (;;) {
+        if (sunk < comp_sz) {
+            size_t n = comp_sz - sunk < chunk ? comp_sz - sunk : chunk;
+            if (heatshrink_decoder_sink(hsd, &comp[sunk], n, &count) < 0) goto cleanup;
+            sunk += count;
+        } else if (heatshrink_decoder_finish(hsd) == HSDR_FINISH_DONE) {
+            break;
+        }
+        HEATSHRINK_DECODER_POLL_RES pres;
+        do {
+            size_t room = size + 1 - polled < chunk ? size + 1 - polled : chunk;
+            pres = heatshrink_decoder_poll(hsd, &decomp[polled], room, &count);
+            if (pres < 0) goto cleanup;
+            polled += count;
+        } while (pres == HSDR_POLL_MORE);
+    }
+    if (polled == size && memcmp(input, decomp, size) == 0) res = comp_sz;
+
+cleanup:
+    free(comp);
+    free(decomp);
+    heatshrink_encoder_free(hse);
+    heatshrink_decoder_free(hsd);
+    return res;
+}
+
+TEST varlen_codes_should_read_back_what_they_write() {
+    uint8_t window_sz2[] = { 4, 8, 11, 15 };
+    for (int i = 0; i < 4; i++) {
+        uint8_t w = window_sz2[i], l = w - 1;
+        for (uint32_t off = 1; off <= (1UL << w); off++) {
+            uint32_t code = 0, got = 0;
+            uint8_t bits = heatshrink_varlen_offset_code(w, off, &code);
+            ASSERT(bits <= HEATSHRINK_VARLEN_OFFSET_MAX_BITS(w));
+            uint64_t top = (uint64_t)code << (64 - bits);
+            ASSERT_EQ(0, heatshrink_varlen_read_offset(top, bits - 1, w, &got));
+            ASSERT_EQ(bits, heatshrink_varlen_read_offset(top, 64, w, &got));
+            ASSERT_EQ(off, got);
+        }
+        for (uint32_t count = HEATSHRINK_VARLEN_MIN_COUNT;
+             count < (1UL << l) + 16; count++) {
+            uint32_t code = 0, got = 0;
+            uint8_t bits = heatshrink_varlen_count_code(l, count, &code);
+            ASSERT(bits <= HEATSHRINK_VARLEN_COUNT_MAX_BITS(l));
+            uint64_t top = (uint64_t)code << (64 - bits);
+            ASSERT_EQ(0, heatshrink_varlen_read_count(top, bits - 1, l, &got));
+            ASSERT_EQ(bits, heatshrink_varlen_read_count(top, 64, l, &got));
+            ASSERT_EQ(count, got);
+        }
+    }
+    PASS();
+}
+
+TEST extended_formats_should_round_trip_in_any_chunks() {
+    uint32_t size = 20000;
+    uint8_t *input = malloc(size);
+    if (input == NULL) FAILm("malloc fail");
+    uint8_t formats[] = { HEATSHRINK_FORMAT_VARLEN, HEATSHRINK_FORMAT_REPEAT,
+        HEATSHRINK_FORMAT_VARLEN | HEATSHRINK_FORMAT_REPEAT,
+        HEATSHRINK_FORMAT_LONG, HEATSHRINK_FORMAT_LITERAL_RUNS,
+        HEATSHRINK_FORMATS_SUPPORTED
+            & ~(HEATSHRINK_FORMAT_ALIGNED | HEATSHRINK_FORMAT_ENTROPY),
+        HEATSHRINK_FORMAT_ALIGNED,
+#if HEATSHRINK_USE_ENTROPY_CODER
+        HEATSHRINK_FORMAT_ENTROPY,
+#endif
+    };
+    uint8_t window_sz2[] = { 4, 8, 11, 15 };
+    uint8_t lookahead_sz2[] = { 3, 4, 6, 8 };
+    size_t chunks[] = { 1, 7, 4096 };
+
+    for (int data = 0; data < 5; data++) {
+        if (data == 0) fill_with_pseudorandom_letters(input, size, 21);
+        if (data == 1) fill_with_noise(input, size, 21);
+        if (data == 2) {
+            for (uint32_t i = 0; i < size; i++) input[i] = (i / 300) % 2 ? 'r' : i % 13;
+        }
+        if (data == 3) {        /* records with a few changing fields */
+            fill_with_noise(input, 48, 21);
+            for (uint32_t i = 48; i < size; i++) {
+                input[i] = i % 48 < 4 ? (uint8_t)(i / 48) : input[i - 48];
+            }
+        }
+        if (data == 4) {        /* runs longer than any input buffer */
+            fill_with_noise(input, size, 21);
+            memset(&input[100], 0, 9000);
+            for (uint32_t i = 12000; i < 19000; i++) input[i] = input[i - 3];
+        }
+        for (size_t f = 0; f < sizeof(formats); f++) {
+            for (int i = 0; i < 4; i++) {
+                for (int c = 0; c < 3; c++) {
+                    ASSERT(format_round_trip(formats[f], window_sz2[i],
+                            lookahead_sz2[i], input, size, chunks[c]) > 0);
+                }
+            }
+        }
+    }
+
+    /* Near, short matches are where varlen pays off. */
+    fill_with_pseudorandom_letters(input, size, 22);
+    size_t classic = format_round_trip(HEATSHRINK_FORMAT_CLASSIC, 11, 6,
+        input, size, 4096);
+    size_t varlen = format_round_trip(HEATSHRINK_FORMAT_VARLEN, 11, 6,
+        input, size, 4096);
+    ASSERT(classic > 0);
+    ASSERT(varlen > 0);
+    ASSERT(varlen < classic);
+
+    /* As are matches at the same distance as the last one. */
+    for (uint32_t i = 0; i < size; i++) {
+        input[i] = i % 24 == 0 ? (uint8_t)(i / 24 * 7) : "rec:0123456789abcdefghi"[i % 24 - 1];
+    }
+    classic = format_round_trip(HEATSHRINK_FORMAT_CLASSIC, 8, 4,
+        input, size, 4096);
+    size_t repeat = format_round_trip(HEATSHRINK_FORMAT_REPEAT, 8, 4,
+        input, size, 4096);
+    ASSERT(classic > 0);
+    ASSERT(repeat > 0);
+    ASSERT(repeat < classic);
+
+    /* And a long run is a single backref. */
+    memset(input, 0, size);
+    size_t run = format_round_trip(HEATSHRINK_FORMAT_LONG, 8, 4,
+        input, size, 4096);
+    ASSERT(run > 0);
+    ASSERT(run < 16);
+
+    /* Noise goes out raw, at close to 8 bits a byte. */
+    fill_with_noise(input, size, 23);
+    size_t raw = format_round_trip(HEATSHRINK_FORMAT_LITERAL_RUNS, 8, 4,
+        input, size, 4096);
+    ASSERT(raw > 0);
+    ASSERT(raw < size + size / 64);
+
+    /* Short matches in noise aren't worth breaking a run for. */
+    const uint8_t with_runs[] = {
+        HEATSHRINK_FORMAT_REPEAT | HEATSHRINK_FORMAT_LITERAL_RUNS,
+        HEATSHRINK_FORMAT_VARLEN | HEATSHRINK_FORMAT_LITERAL_RUNS,
+        HEATSHRINK_FORMAT_VARLEN | HEATSHRINK_FORMAT_REPEAT
+            | HEATSHRINK_FORMAT_LONG | HEATSHRINK_FORMAT_LITERAL_RUNS,
+    };
+    for (size_t i = 0; i < sizeof(with_runs); i++) {
+        size_t combined = format_round_trip(with_runs[i], 8, 4,
+            input, size, 4096);
+        ASSERT(combined > 0);
+        ASSERT(combined < raw + size / 1024);
+    }
+
+    /* Aligned sequences still catch the repeats in records. */
+    for (uint32_t i = 0; i < size; i++) {
+        input[i] = i % 24 == 0 ? (uint8_t)(i / 24 * 7) : "rec:0123456789abcdefghi"[i % 24 - 1];
+    }
+    size_t aligned = format_round_trip(HEATSHRINK_FORMAT_ALIGNED, 8, 4,
+        input, size, 4096);
+    ASSERT(aligned > 0);
+    ASSERT(aligned < size / 4);
+
+#if HEATSHRINK_USE_ENTROPY_CODER
+    /* Range coding the same tokens takes out their redundancy. */
+    fill_with_pseudorandom_letters(input, size, 24);
+    classic = format_round_trip(HEATSHRINK_FORMAT_CLASSIC, 8, 4,
+        input, size, 4096);
+    size_t entropy = format_round_trip(HEATSHRINK_FORMAT_ENTROPY, 8, 4,
+        input, size, 4096);
+    ASSERT(classic > 0);
+    ASSERT(entropy > 0);
+    ASSERT(entropy < classic - classic / 5);
+#endif
+    free(input);
+    PASS();
+}
+
+/* Append the low COUNT bits of VALUE to BUF, MSB first, at bit *POS. */
+static void put_bits(uint8_t *buf, size_t *pos, uint32_t value, uint8_t count) {
+    while (count--) {
+        if ((value >> count) & 1) buf[*pos / 8] |= 0x80 >> (*pos % 8);
+        (*pos)++;
+    }
+}
+
+/* Decode a varlen stream of SIZE bytes at IN into OUT with both the fast
+ * path and the state machine, returning the output size (or 0 if they
+ * differ or fail). */
+static size_t varlen_decode_both_ways(uint8_t *in, size_t size,
+        uint8_t *out, size_t out_cap) {
+    heatshrink_decoder *hsd = heatshrink_decoder_alloc(1, 8, 4);
+    heatshrink_decoder_set_format(hsd, HEATSHRINK_FORMAT_VARLEN);
+    size_t used = 0, span_sz = 0;
+    heatshrink_decoder_poll_span(hsd, in, size, &used, out, out_cap, &span_sz);
+
+    uint8_t *polled = malloc(out_cap);
+    size_t polled_sz = 0;
+    heatshrink_decoder_reset(hsd);
+    heatshrink_decoder_set_format(hsd, HEATSHRINK_FORMAT_VARLEN);
+    for (size_t i = 0; i < size; i++) {
+        uint16_t count = 0;
+        heatshrink_decoder_sink(hsd, &in[i], 1, &count);
+        while (heatshrink_decoder_poll(hsd, &polled[polled_sz],
+                out_cap - polled_sz, &count) == HSDR_POLL_MORE) {
+            polled_sz += count;
+        }
+        polled_sz += count;
+    }
+    heatshrink_decoder_free(hsd);
+    int same = used == size && span_sz == polled_sz
+        && memcmp(out, polled, span_sz) == 0;
+    free(polled);
+    return same ? span_sz : 0;
+}
+
+TEST varlen_decoder_should_wrap_offsets_past_the_window() {
+    /* With -w 8, the varlen offset buckets reach 2^3 + 2^4 + 2^6 + 2^8,
+     * past the window. A corrupt stream's out-of-range offset should wrap
+     * like an aligned one, not read past the window. */
+    uint8_t literals[256];
+    fill_with_noise(literals, sizeof(literals), 45);
+    uint8_t in[2][300];
+    size_t size[2];
+    for (int s = 0; s < 2; s++) {
+        size_t pos = 0;
+        memset(in[s], 0, sizeof(in[s]));
+        for (size_t i = 0; i < sizeof(literals); i++) {
+            put_bits(in[s], &pos, HEATSHRINK_LITERAL_MARKER, 1);
+            put_bits(in[s], &pos, literals[i], 8);
+        }
+        uint32_t code = 0;
+        uint8_t bits = heatshrink_varlen_offset_code(8, s == 0 ? 344 : 88, &code);
+        put_bits(in[s], &pos, HEATSHRINK_BACKREF_MARKER, 1);
+        put_bits(in[s], &pos, code, bits);
+        bits = heatshrink_varlen_count_code(4, 3, &code);
+        put_bits(in[s], &pos, code, bits);
+        size[s] = (pos + 7) / 8;
+    }
+
+    uint8_t out[2][512];
+    size_t out_sz = varlen_decode_both_ways(in[0], size[0], out[0], sizeof(out[0]));
+    ASSERT_EQ(sizeof(literals) + 3, out_sz);
+    ASSERT_EQ(out_sz, varlen_decode_both_ways(in[1], size[1], out[1], sizeof(out[1])));
+    ASSERT_EQ(0, memcmp(out[0], out[1], out_sz));
+    ASSERT_EQ(0, memcmp(&out[0][sizeof(literals)], &literals[256 - 88], 3));
+
+    /* Decoding noise never reads outside the window, which only the
+     * sanitizers can tell, in any format that can code such offsets. */
+    uint8_t formats[] = { HEATSHRINK_FORMAT_VARLEN,
+        HEATSHRINK_FORMAT_VARLEN | HEATSHRINK_FORMAT_LONG,
+        HEATSHRINK_FORMATS_SUPPORTED
+            & ~(HEATSHRINK_FORMAT_ALIGNED | HEATSHRINK_FORMAT_ENTROPY) };
+    uint8_t noise[600];
+    for (size_t f = 0; f < sizeof(formats); f++) {
+        for (uint32_t seed = 0; seed < 50; seed++) {
+            fill_with_noise(noise, sizeof(noise), seed);
+            heatshrink_decoder *hsd = heatshrink_decoder_alloc(1, 8, 4);
+            heatshrink_decoder_set_format(hsd, formats[f]);
+            size_t used = 0, sz = 0;
+            uint8_t *big = malloc(1 << 20);
+            heatshrink_decoder_poll_span(hsd, noise, sizeof(noise),
+                &used, big, 1 << 20, &sz);
+            free(big);
+            heatshrink_decoder_free(hsd);
+        }
+    }
+    PASS();
+}
+
+TEST varlen_format_should_only_be_set_before_input() {
+    heatshrink_encoder *hse = heatshrink_encoder_alloc(8, 4);
+    heatshrink_decoder *hsd = heatshrink_decoder_alloc(64, 8, 4);
+    uint8_t byte = 'x';
+    uint16_t count = 0;
+    ASSERT_EQ(HSER_SINK_ERROR_MISUSE, heatshrink_encoder_set_format(hse, 0x80));
+    ASSERT_EQ(HSER_SINK_ERROR_MISUSE, heatshrink_encoder_set_format(hse,
+            HEATSHRINK_FORMAT_ALIGNED | HEATSHRINK_FORMAT_VARLEN));
+    ASSERT_EQ(HSER_SINK_ERROR_MISUSE, heatshrink_encoder_set_format(hse,
+            HEATSHRINK_FORMAT_ENTROPY | HEATSHRINK_FORMAT_REPEAT));
+    ASSERT_EQ(HSER_SINK_OK, heatshrink_encoder_sink(hse, &byte, 1, &count));
+    ASSERT_EQ(HSER_SINK_ERROR_MISUSE,
+        heatshrink_encoder_set_format(hse, HEATSHRINK_FORMAT_VARLEN));
+    heatshrink_encoder_reset(hse);
+    ASSERT_EQ(HSER_SINK_OK,
+        heatshrink_encoder_set_format(hse, HEATSHRINK_FORMAT_VARLEN));
+
+    ASSERT_EQ(HSDR_SINK_OK, heatshrink_decoder_sink(hsd, &byte, 1, &count));
+    ASSERT_EQ(HSDR_SINK_ERROR_MISUSE,
+        heatshrink_decoder_set_format(hsd, HEATSHRINK_FORMAT_VARLEN));
+    heatshrink_decoder_reset(hsd);
+    ASSERT_EQ(HSDR_SINK_OK,
+        heatshrink_decoder_set_format(hsd, HEATSHRINK_FORMAT_VARLEN));
+    heatshrink_encoder_free(hse);
+    heatshrink_decoder_free(hsd);
+    PASS();
+}
+
+TEST repeat_format_should_round_trip_short_inputs_at_small_sizes() {
+    /* The last byte's padding must not decode as a whole backref. */
+    const uint8_t formats[] = {
+        HEATSHRINK_FORMAT_REPEAT,
+        HEATSHRINK_FORMAT_REPEAT | HEATSHRINK_FORMAT_LONG,
+        HEATSHRINK_FORMAT_REPEAT | HEATSHRINK_FORMAT_LITERAL_RUNS,
+        HEATSHRINK_FORMAT_REPEAT | HEATSHRINK_FORMAT_VARLEN,
+    };
+    uint8_t input[] = "Heatshrink heatshrink, aaaaaaaaaaaaaaaa HHHH";
+    heatshrink_encoder *hse = heatshrink_encoder_alloc(4, 1);
+    heatshrink_decoder *hsd = heatshrink_decoder_alloc(64, 4, 1);
+    ASSERT_EQ(HSER_SINK_ERROR_MISUSE,
+        heatshrink_encoder_set_format(hse, HEATSHRINK_FORMAT_REPEAT));
+    ASSERT_EQ(HSDR_SINK_ERROR_MISUSE,
+        heatshrink_decoder_set_format(hsd, HEATSHRINK_FORMAT_REPEAT));
+    heatshrink_encoder_free(hse);
+    heatshrink_decoder_free(hsd);
+
+    for (size_t f = 0; f < sizeof(formats); f++) {
+        for (uint8_t w = 4; w <= 5; w++) {
+            for (uint8_t l = 1; l < w; l++) {
+                if (!heatshrink_format_fits(formats[f], w, l)) continue;
+                for (size_t size = 1; size < sizeof(input); size++) {
+                    ASSERTm("round trip failed",
+                        format_round_trip(formats[f], w, l, input, size, 1) > 0);
+                }
+            }
+        }
+    }
+    PASS();
+}
+#endif
+
 SUITE(integration) {
     RUN_TEST(data_without_duplication_should_match);
     RUN_TEST(data_with_simple_repetition_should_compress_and_decompress_properly);
     RUN_TEST(data_without_duplication_should_match_with_absurdly_tiny_buffers);
     RUN_TEST(data_with_simple_repetition_should_match_with_absurdly_tiny_buffers);
+    RUN_TEST(data_with_short_periods_should_match_across_window_wraparound);
+    RUN_TEST(decoder_should_hand_off_between_fast_path_and_state_machine);
+    RUN_TEST(decoder_poll_streams_should_decode_independent_streams);
+    RUN_TEST(in_place_decompression_should_fit_in_the_reported_margin);
+    RUN_TEST(in_place_decompression_should_reject_a_short_margin);
+    RUN_TEST(in_place_margin_should_not_wrap_past_4_gb);
+    RUN_TEST(decoder_skip_should_discard_output_and_keep_the_window);
+    RUN_TEST(data_should_match_across_wraparound_of_page_sized_window);
+#if HEATSHRINK_USE_EXTENDED_FORMATS
+    RUN_TEST(varlen_codes_should_read_back_what_they_write);
+    RUN_TEST(extended_formats_should_round_trip_in_any_chunks);
+    RUN_TEST(varlen_decoder_should_wrap_offsets_past_the_window);
+    RUN_TEST(varlen_format_should_only_be_set_before_input);
+    RUN_TEST(repeat_format_should_round_trip_short_inputs_at_small_sizes);
+#endif
 
     // Regressions from fuzzing
     RUN_TEST(small_input_buffer_should_not_impact_decoder_correctness);
     RUN_TEST(regression_backreference_counters_should_not_roll_over);
     RUN_TEST(regression_index_fail);
     RUN_TEST(sixty_four_k);
+    RUN_TEST(regression_wide_fields_should_resume_across_input_boundaries);
 
 #if __STDC_VERSION__ >= 19901L
     printf("\n\nFuzzing:\n");
@@ -913,6 +1680,532 @@ SUITE(integration) {
 #endif
 }
 
+TEST frame_should_store_incompressible_block() {
+    heatshrink_encoder *hse = heatshrink_encoder_alloc(8, 4);
+    heatshrink_decoder *hsd = heatshrink_decoder_alloc(256, 8, 4);
+    uint32_t size = 4096;
+    uint8_t input[size];
+    uint8_t framed[HEATSHRINK_FRAME_BLOCK_BOUND(size)];
+    uint8_t output[size];
+    fill_with_noise(input, size, 12345);
+
+    size_t framed_sz = 0;
+    ASSERT_EQ(HSFR_OK, heatshrink_frame_encode_block(hse, input, size,
+            framed, sizeof(framed), &framed_sz));
+    ASSERT_EQ(HEATSHRINK_FRAME_BLOCK_BOUND(size), framed_sz);
+    ASSERT_EQ(HSF_BLOCK_STORED | HSF_BLOCK_CHECKED, framed[0]);
+
+    size_t used = 0;
+    size_t out_sz = 0;
+    ASSERT_EQ(HSFR_OK, heatshrink_frame_decode_block(hsd, framed, framed_sz,
+            &used, output, sizeof(output), &out_sz));
+    ASSERT_EQ(framed_sz, used);
+    ASSERT_EQ(size, out_sz);
+    ASSERT_EQ(0, memcmp(input, output, size));
+
+    heatshrink_encoder_free(hse);
+    heatshrink_decoder_free(hsd);
+    PASS();
+}
+
+TEST frame_should_compress_repetitive_block() {
+    heatshrink_encoder *hse = heatshrink_encoder_alloc(8, 4);
+    heatshrink_decoder *hsd = heatshrink_decoder_alloc(256, 8, 4);
+    uint32_t size = 4096;
+    uint8_t input[size];
+    uint8_t framed[HEATSHRINK_FRAME_BLOCK_BOUND(size)];
+    uint8_t output[size];
+    for (uint32_t i=0; i<size; i++) input[i] = "abcabcd"[i % 7];
+
+    size_t framed_sz = 0;
+    ASSERT_EQ(HSFR_OK, heatshrink_frame_encode_block(hse, input, size,
+            framed, sizeof(framed), &framed_sz));
+    ASSERT(framed_sz < size / 2);
+    ASSERT_EQ(HSF_BLOCK_COMPRESSED | HSF_BLOCK_CHECKED, framed[0]);
+
+    size_t used = 0;
+    size_t out_sz = 0;
+    ASSERT_EQ(HSFR_MORE, heatshrink_frame_decode_block(hsd, framed,
+            framed_sz - 1, &used, output, sizeof(output), &out_sz));
+    ASSERT_EQ(HSFR_OK, heatshrink_frame_decode_block(hsd, framed, framed_sz,
+            &used, output, sizeof(output), &out_sz));
+    ASSERT_EQ(framed_sz, used);
+    ASSERT_EQ(size, out_sz);
+    ASSERT_EQ(0, memcmp(input, output, size));
+
+    heatshrink_encoder_free(hse);
+    heatshrink_decoder_free(hsd);
+    PASS();
+}
+
+TEST frame_should_reject_block_with_wrong_raw_size() {
+    heatshrink_encoder *hse = heatshrink_encoder_alloc(8, 4);
+    heatshrink_decoder *hsd = heatshrink_decoder_alloc(256, 8, 4);
+    uint8_t input[512];
+    uint8_t framed[HEATSHRINK_FRAME_BLOCK_BOUND(sizeof(input))];
+    uint8_t output[1024];
+    memset(input, 'x', sizeof(input));
+
+    size_t framed_sz = 0;
+    ASSERT_EQ(HSFR_OK, heatshrink_frame_encode_block(hse, input, sizeof(input),
+            framed, sizeof(framed), &framed_sz));
+    framed[1]++;                /* claim one more byte than was encoded */
+
+    size_t used = 0;
+    size_t out_sz = 0;
+    ASSERT_EQ(HSFR_ERROR_CORRUPT, heatshrink_frame_decode_block(hsd, framed,
+            framed_sz, &used, output, sizeof(output), &out_sz));
+
+    framed[0] = 0x0F;           /* unknown block type */
+    ASSERT_EQ(HSFR_ERROR_CORRUPT, heatshrink_frame_decode_block(hsd, framed,
+            framed_sz, &used, output, sizeof(output), &out_sz));
+
+    framed[0] = HSF_BLOCK_COMPRESSED;
+    framed[4] = 0xFF;           /* a raw size no block can have */
+    heatshrink_frame_header h;
+    ASSERT_EQ(HSFR_ERROR_CORRUPT, heatshrink_frame_read_header(framed,
+            framed_sz, &h));
+
+    heatshrink_encoder_free(hse);
+    heatshrink_decoder_free(hsd);
+    PASS();
+}
+
+TEST crc32_should_match_check_value_in_any_pieces() {
+    uint8_t check[] = "123456789";
+    ASSERT_EQ(0xCBF43926, heatshrink_crc32(0, check, 9));
+    uint32_t crc = heatshrink_crc32(0, check, 4);
+    ASSERT_EQ(0xCBF43926, heatshrink_crc32(crc, &check[4], 5));
+    ASSERT_EQ(0, heatshrink_crc32(0, check, 0));
+    PASS();
+}
+
+TEST container_should_configure_decoder_from_header() {
+    uint32_t size = 3000;
+    uint8_t input[size];
+    uint8_t stream[HEATSHRINK_CONTAINER_MAX_HEADER_SIZE + 2 * size];
+    fill_with_pseudorandom_letters(input, size, 11);
+
+    heatshrink_container_header h;
+    memset(&h, 0, sizeof(h));
+    h.flags = HSZ_FLAG_HAS_SIZE;
+    h.window_sz2 = 9;
+    h.lookahead_sz2 = 5;
+    h.original_size = size;
+    size_t hdr_sz = 0;
+    ASSERT_EQ(HSZR_OK, heatshrink_container_write_header(&h,
+            stream, sizeof(stream), &hdr_sz));
+    ASSERT_EQ(HEATSHRINK_CONTAINER_MIN_HEADER_SIZE + 8, hdr_sz);
+    size_t comp_sz = compress_whole(9, 5, input, size, &stream[hdr_sz],
+        sizeof(stream) - hdr_sz, NULL);
+    ASSERT(comp_sz > 0);
+
+    /* The reader knows nothing but the stream itself. */
+    heatshrink_container_header rh;
+    size_t used = 0;
+    ASSERT_EQ(HSZR_MORE, heatshrink_container_read_header(stream,
+            hdr_sz - 1, &rh, &used));
+    ASSERT_EQ(HSZR_OK, heatshrink_container_read_header(stream,
+            hdr_sz + comp_sz, &rh, &used));
+    ASSERT_EQ(hdr_sz, used);
+    ASSERT_EQ(9, rh.window_sz2);
+    ASSERT_EQ(5, rh.lookahead_sz2);
+    ASSERT_EQ(size, rh.original_size);
+
+    heatshrink_decoder *hsd = heatshrink_container_alloc_decoder(&rh, 256);
+    ASSERT(hsd != NULL);
+    uint8_t *output = malloc(rh.original_size);
+    size_t in_count = 0, out_count = 0;
+    ASSERT_EQ(HSDR_POLL_EMPTY, heatshrink_decoder_poll_span(hsd,
+            &stream[used], comp_sz, &in_count,
+            output, rh.original_size, &out_count));
+    ASSERT_EQ(comp_sz, in_count);
+    ASSERT_EQ(size, out_count);
+    ASSERT_EQ(HSDR_FINISH_DONE, heatshrink_decoder_finish(hsd));
+    ASSERT_EQ(0, memcmp(input, output, size));
+    free(output);
+    heatshrink_decoder_free(hsd);
+    PASS();
+}
+
+TEST container_should_reject_foreign_or_newer_headers() {
+    heatshrink_container_header h;
+    memset(&h, 0, sizeof(h));
+    h.window_sz2 = 8;
+    h.lookahead_sz2 = 4;
+    uint8_t buf[HEATSHRINK_CONTAINER_MAX_HEADER_SIZE];
+    size_t hdr_sz = 0;
+    ASSERT_EQ(HSZR_OK, heatshrink_container_write_header(&h,
+            buf, sizeof(buf), &hdr_sz));
+    ASSERT_EQ(HEATSHRINK_CONTAINER_MIN_HEADER_SIZE, hdr_sz);
+
+    heatshrink_container_header rh;
+    size_t used = 0;
+    buf[4]++;                   /* version */
+    ASSERT_EQ(HSZR_ERROR_UNSUPPORTED, heatshrink_container_read_header(buf,
+            hdr_sz, &rh, &used));
+    buf[4]--;
+    buf[5] = 0x80;              /* unknown flag */
+    ASSERT_EQ(HSZR_ERROR_UNSUPPORTED, heatshrink_container_read_header(buf,
+            hdr_sz, &rh, &used));
+    buf[5] = 0;
+    buf[7] = 8;                 /* lookahead as big as the window */
+    ASSERT_EQ(HSZR_ERROR_UNSUPPORTED, heatshrink_container_read_header(buf,
+            hdr_sz, &rh, &used));
+    buf[7] = 4;
+
+#if HEATSHRINK_USE_EXTENDED_FORMATS
+    /* Format extensions add a byte, and unknown ones are refused. */
+    h.format = HEATSHRINK_FORMATS_SUPPORTED
+        & ~(HEATSHRINK_FORMAT_ALIGNED | HEATSHRINK_FORMAT_ENTROPY);
+    ASSERT_EQ(HSZR_OK, heatshrink_container_write_header(&h,
+            buf, sizeof(buf), &hdr_sz));
+    ASSERT_EQ(HEATSHRINK_CONTAINER_MIN_HEADER_SIZE + 1, hdr_sz);
+    ASSERT_EQ(HSZR_OK, heatshrink_container_read_header(buf,
+            hdr_sz, &rh, &used));
+    ASSERT_EQ(h.format, rh.format);
+    buf[8] = 0x80;
+    ASSERT_EQ(HSZR_ERROR_UNSUPPORTED, heatshrink_container_read_header(buf,
+            hdr_sz, &rh, &used));
+    buf[8] = HEATSHRINK_FORMAT_ALIGNED | HEATSHRINK_FORMAT_VARLEN;
+    ASSERT_EQ(HSZR_ERROR_UNSUPPORTED, heatshrink_container_read_header(buf,
+            hdr_sz, &rh, &used));
+#endif
+
+    /* A raw stream starts with a literal, so its top bit is set. */
+    uint8_t raw[] = {0xb0, 0x80};
+    ASSERT_EQ(HSZR_ERROR_BAD_MAGIC, heatshrink_container_read_header(raw,
+            sizeof(raw), &rh, &used));
+    PASS();
+}
+
+TEST frame_should_reject_block_that_fails_its_checksum() {
+    heatshrink_encoder *hse = heatshrink_encoder_alloc(8, 4);
+    heatshrink_decoder *hsd = heatshrink_decoder_alloc(256, 8, 4);
+    uint32_t size = 1024;
+    uint8_t input[size];
+    uint8_t framed[HEATSHRINK_FRAME_BLOCK_BOUND(size)];
+    uint8_t output[size];
+    fill_with_noise(input, size, 77);
+
+    size_t framed_sz = 0;
+    ASSERT_EQ(HSFR_OK, heatshrink_frame_encode_block(hse, input, size,
+            framed, sizeof(framed), &framed_sz));
+    framed[HEATSHRINK_FRAME_MAX_HEADER_SIZE + 100] ^= 0x01;
+
+    size_t used = 0;
+    size_t out_sz = 0;
+    ASSERT_EQ(HSFR_ERROR_CHECKSUM, heatshrink_frame_decode_block(hsd, framed,
+            framed_sz, &used, output, sizeof(output), &out_sz));
+
+    heatshrink_encoder_free(hse);
+    heatshrink_decoder_free(hsd);
+    PASS();
+}
+
+TEST frame_primed_block_should_decode_with_previous_block() {
+    heatshrink_encoder *hse = heatshrink_encoder_alloc(8, 4);
+    heatshrink_decoder *hsd = heatshrink_decoder_alloc(256, 8, 4);
+    uint32_t size = 600;
+    uint8_t input[2 * size];
+    uint8_t framed[HEATSHRINK_FRAME_BLOCK_BOUND(size)];
+    uint8_t output[size];
+    /* The second block repeats the end of the first. */
+    fill_with_pseudorandom_letters(input, size, 21);
+    memcpy(&input[size], &input[size - 200], 200);
+    fill_with_pseudorandom_letters(&input[size + 200], size - 200, 22);
+
+    size_t plain_sz = 0;
+    ASSERT_EQ(HSFR_OK, heatshrink_frame_encode_block(hse, &input[size], size,
+            framed, sizeof(framed), &plain_sz));
+    size_t framed_sz = 0;
+    ASSERT_EQ(HSFR_OK, heatshrink_frame_encode_block_primed(hse, input, size,
+            &input[size], size, framed, sizeof(framed), &framed_sz));
+    ASSERT(framed_sz < plain_sz);
+    ASSERT(framed[0] & HSF_BLOCK_PRIMED);
+
+    size_t used = 0;
+    size_t out_sz = 0;
+    ASSERT_EQ(HSFR_ERROR_NO_DICTIONARY, heatshrink_frame_decode_block(hsd,
+            framed, framed_sz, &used, output, sizeof(output), &out_sz));
+    ASSERT_EQ(HSFR_OK, heatshrink_frame_decode_block_primed(hsd, input, size,
+            framed, framed_sz, &used, output, sizeof(output), &out_sz));
+    ASSERT_EQ(framed_sz, used);
+    ASSERT_EQ(size, out_sz);
+    ASSERT_EQ(0, memcmp(&input[size], output, size));
+
+    heatshrink_encoder_free(hse);
+    heatshrink_decoder_free(hsd);
+    PASS();
+}
+
+#if HEATSHRINK_USE_THREADS
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+} collected_output;
+
+static int collect_block(void *udata, const uint8_t *buf, size_t size) {
+    collected_output *out = udata;
+    memcpy(&out->buf[out->size], buf, size);
+    out->size += size;
+    return 0;
+}
+
+TEST parallel_encode_should_match_serial_blocks() {
+    size_t block_sz = 512;
+    size_t size = 20 * block_sz + 100;
+    uint8_t *input = malloc(size);
+    uint8_t *expected = malloc(2 * size);
+    uint8_t *actual = malloc(2 * size);
+    fill_with_pseudorandom_letters(input, size, 31);
+
+    heatshrink_encoder *hse = heatshrink_encoder_alloc(8, 4);
+    size_t expected_sz = 0;
+    for (size_t offset = 0; offset < size; offset += block_sz) {
+        size_t n = size - offset < block_sz ? size - offset : block_sz;
+        size_t dict_sz = offset == 0 ? 0 : block_sz;
+        size_t out_sz = 0;
+        ASSERT_EQ(HSFR_OK, heatshrink_frame_encode_block_primed(hse,
+                &input[offset - dict_sz], dict_sz, &input[offset], n,
+                &expected[expected_sz], 2 * size - expected_sz, &out_sz));
+        expected_sz += out_sz;
+    }
+    heatshrink_encoder_free(hse);
+
+    heatshrink_parallel_encoder *hpe = heatshrink_parallel_encoder_alloc(
+        8, 4, block_sz, 3, 1);
+    ASSERT(hpe != NULL);
+    collected_output out = { actual, 0 };
+    /* Calls of a few blocks each continue the same stream. */
+    for (size_t offset = 0; offset < size; offset += 7 * block_sz) {
+        size_t n = size - offset < 7 * block_sz ? size - offset : 7 * block_sz;
+        ASSERT_EQ(HSPR_OK, heatshrink_parallel_encode(hpe, &input[offset], n,
+                collect_block, &out));
+    }
+    heatshrink_parallel_encoder_free(hpe);
+
+    ASSERT_EQ(expected_sz, out.size);
+    ASSERT_EQ(0, memcmp(expected, actual, expected_sz));
+    free(input);
+    free(expected);
+    free(actual);
+    PASS();
+}
+
+TEST parallel_decode_should_round_trip_in_any_chunks() {
+    size_t block_sz = 512;
+    size_t size = 30 * block_sz + 77;
+    uint8_t *input = malloc(size);
+    uint8_t *comp = malloc(2 * size);
+    uint8_t *output = malloc(size);
+    fill_with_pseudorandom_letters(input, size, 41);
+
+    for (uint8_t primed = 0; primed <= 1; primed++) {
+        heatshrink_parallel_encoder *hpe = heatshrink_parallel_encoder_alloc(
+            8, 4, block_sz, 2, primed);
+        collected_output c = { comp, 0 };
+        ASSERT_EQ(HSPR_OK, heatshrink_parallel_encode(hpe, input, size,
+                collect_block, &c));
+        heatshrink_parallel_encoder_free(hpe);
+
+        /* Feed it a little at a time, so blocks get split across calls. */
+        heatshrink_parallel_decoder *hpd = heatshrink_parallel_decoder_alloc(
+            8, 4, 3);
+        ASSERT(hpd != NULL);
+        collected_output d = { output, 0 };
+        size_t offset = 0;
+        size_t avail = 0;
+        while (offset < c.size) {
+            avail += 1000;
+            if (offset + avail > c.size) avail = c.size - offset;
+            size_t used = 0;
+            ASSERT_EQ(HSPR_OK, heatshrink_parallel_decode(hpd,
+                    &comp[offset], avail, &used, collect_block, &d));
+            offset += used;
+            avail -= used;
+        }
+        heatshrink_parallel_decoder_free(hpd);
+        ASSERT_EQ(size, d.size);
+        ASSERT_EQ(0, memcmp(input, output, size));
+    }
+    free(input);
+    free(comp);
+    free(output);
+    PASS();
+}
+
+TEST parallel_decode_should_continue_after_end_block() {
+    size_t block_sz = 512;
+    size_t sizes[2] = { 5 * block_sz + 9, 3 * block_sz };
+    size_t size = sizes[0] + sizes[1];
+    uint8_t *input = malloc(size);
+    uint8_t *comp = malloc(2 * size);
+    uint8_t *output = malloc(size);
+    fill_with_pseudorandom_letters(input, size, 61);
+
+    /* Two primed streams back to back: the second mustn't be primed
+     * with the end of the first. */
+    collected_output c = { comp, 0 };
+    size_t offset = 0;
+    for (int i = 0; i < 2; i++) {
+        heatshrink_parallel_encoder *hpe = heatshrink_parallel_encoder_alloc(
+            8, 4, block_sz, 2, 1);
+        ASSERT_EQ(HSPR_OK, heatshrink_parallel_encode(hpe, &input[offset],
+                sizes[i], collect_block, &c));
+        heatshrink_parallel_encoder_free(hpe);
+        size_t end_sz = 0;
+        ASSERT_EQ(HSFR_OK, heatshrink_frame_write_end(sizes[i],
+                &comp[c.size], HEATSHRINK_FRAME_END_SIZE, &end_sz));
+        c.size += end_sz;
+        offset += sizes[i];
+    }
+
+    heatshrink_parallel_decoder *hpd = heatshrink_parallel_decoder_alloc(
+        8, 4, 2);
+    collected_output d = { output, 0 };
+    int ends = 0;
+    offset = 0;
+    while (offset < c.size) {
+        size_t used = 0;
+        HEATSHRINK_PARALLEL_RES res = heatshrink_parallel_decode(hpd,
+            &comp[offset], c.size - offset, &used, collect_block, &d);
+        ASSERT(res == HSPR_OK || res == HSPR_END);
+        if (res == HSPR_END) ends++;
+        ASSERT(used > 0);
+        offset += used;
+    }
+    heatshrink_parallel_decoder_free(hpd);
+    ASSERT_EQ(2, ends);
+    ASSERT_EQ(size, d.size);
+    ASSERT_EQ(0, memcmp(input, output, size));
+
+    /* An end block with the wrong size means blocks went missing. */
+    comp[c.size - 8]++;
+    hpd = heatshrink_parallel_decoder_alloc(8, 4, 2);
+    d.size = 0;
+    size_t used = 0;
+    HEATSHRINK_PARALLEL_RES res = HSPR_OK;
+    for (offset = 0; offset < c.size && res >= 0; offset += used) {
+        res = heatshrink_parallel_decode(hpd, &comp[offset], c.size - offset,
+            &used, collect_block, &d);
+    }
+    heatshrink_parallel_decoder_free(hpd);
+    ASSERT_EQ(HSPR_ERROR_FRAME, res);
+    free(input);
+    free(comp);
+    free(output);
+    PASS();
+}
+#endif
+
+typedef struct {
+    uint8_t *buf;
+    size_t size;
+    int reads;
+} memory_stream;
+
+static int read_memory_at(void *udata, uint64_t offset,
+        uint8_t *buf, size_t size) {
+    memory_stream *ms = udata;
+    if (offset > ms->size || size > ms->size - offset) return -1;
+    memcpy(buf, &ms->buf[offset], size);
+    ms->reads++;
+    return 0;
+}
+
+TEST reader_should_decode_only_the_blocks_it_needs() {
+    size_t block_sz = 1000;
+    size_t size = 10 * block_sz + 123;
+    uint8_t *input = malloc(size);
+    uint8_t *stream = malloc(2 * size + 1024);
+    fill_with_pseudorandom_letters(input, size, 51);
+
+    heatshrink_container_header h;
+    memset(&h, 0, sizeof(h));
+    h.flags = HSZ_FLAG_FRAMED | HSZ_FLAG_SEEKABLE;
+    h.window_sz2 = 8;
+    h.lookahead_sz2 = 4;
+    size_t pos = 0;
+    ASSERT_EQ(HSZR_OK, heatshrink_container_write_header(&h, stream,
+            HEATSHRINK_CONTAINER_MAX_HEADER_SIZE, &pos));
+    size_t data_start = pos;
+    heatshrink_encoder *hse = heatshrink_encoder_alloc(8, 4);
+    uint64_t offsets[11];
+    uint32_t count = 0;
+    for (size_t offset = 0; offset < size; offset += block_sz) {
+        size_t n = size - offset < block_sz ? size - offset : block_sz;
+        size_t out_sz = 0;
+        offsets[count++] = pos - data_start;
+        ASSERT_EQ(HSFR_OK, heatshrink_frame_encode_block(hse, &input[offset],
+                n, &stream[pos], HEATSHRINK_FRAME_BLOCK_BOUND(n), &out_sz));
+        pos += out_sz;
+    }
+    heatshrink_encoder_free(hse);
+    size_t index_sz = 0;
+    ASSERT_EQ(HSFR_OK, heatshrink_frame_write_index(offsets, count, block_sz,
+            &stream[pos], HEATSHRINK_FRAME_INDEX_BOUND(count), &index_sz));
+    pos += index_sz;
+    size_t end_sz = 0;
+    ASSERT_EQ(HSFR_OK, heatshrink_frame_write_end(size, &stream[pos],
+            HEATSHRINK_FRAME_END_SIZE, &end_sz));
+    pos += end_sz;
+
+    memory_stream ms = { stream, pos, 0 };
+    HEATSHRINK_READER_RES res;
+    heatshrink_reader *r = heatshrink_reader_open(read_memory_at, &ms, pos,
+        2, &res);
+    ASSERT(r != NULL);
+    ASSERT_EQ(size, heatshrink_reader_size(r));
+
+    /* A range spanning a block boundary, then the same range again,
+     * which should come from the cache. */
+    uint8_t out[3000];
+    size_t got = 0;
+    ASSERT_EQ(HSRR_OK, heatshrink_reader_pread(r, out, 500, 4700, &got));
+    ASSERT_EQ(500, got);
+    ASSERT_EQ(0, memcmp(&input[4700], out, 500));
+    int reads = ms.reads;
+    ASSERT_EQ(HSRR_OK, heatshrink_reader_pread(r, out, 500, 4700, &got));
+    ASSERT_EQ(reads, ms.reads);
+
+    /* Reads stop at the end of the data. */
+    ASSERT_EQ(HSRR_OK, heatshrink_reader_pread(r, out, sizeof(out),
+            size - 200, &got));
+    ASSERT_EQ(200, got);
+    ASSERT_EQ(0, memcmp(&input[size - 200], out, 200));
+    ASSERT_EQ(HSRR_OK, heatshrink_reader_pread(r, out, 10, size, &got));
+    ASSERT_EQ(0, got);
+    heatshrink_reader_close(r);
+
+    /* Without the index, it isn't seekable. */
+    memmove(&stream[pos - end_sz - index_sz], &stream[pos - end_sz], end_sz);
+    ms.size = pos - index_sz;
+    ASSERT(NULL == heatshrink_reader_open(read_memory_at, &ms, ms.size,
+            2, &res));
+    ASSERT_EQ(HSRR_ERROR_FORMAT, res);
+    free(input);
+    free(stream);
+    PASS();
+}
+
+SUITE(framing) {
+    RUN_TEST(crc32_should_match_check_value_in_any_pieces);
+    RUN_TEST(frame_should_store_incompressible_block);
+    RUN_TEST(frame_should_compress_repetitive_block);
+    RUN_TEST(frame_should_reject_block_with_wrong_raw_size);
+    RUN_TEST(frame_should_reject_block_that_fails_its_checksum);
+    RUN_TEST(frame_primed_block_should_decode_with_previous_block);
+#if HEATSHRINK_USE_THREADS
+    RUN_TEST(parallel_encode_should_match_serial_blocks);
+    RUN_TEST(parallel_decode_should_round_trip_in_any_chunks);
+    RUN_TEST(parallel_decode_should_continue_after_end_block);
+#endif
+    RUN_TEST(reader_should_decode_only_the_blocks_it_needs);
+    RUN_TEST(container_should_configure_decoder_from_header);
+    RUN_TEST(container_should_reject_foreign_or_newer_headers);
+}
+
 /* Add all the definitions that need to be in the test runner's main file. */
 GREATEST_MAIN_DEFS();
 
@@ -921,5 +2214,6 @@ int main(int argc, char **argv) {
     RUN_SUITE(encoding);
     RUN_SUITE(decoding);
     RUN_SUITE(integration);
+    RUN_SUITE(framing);
     GREATEST_MAIN_END();        /* display results */
 }